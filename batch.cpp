@@ -0,0 +1,460 @@
+#include <QThread>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+#include "batch.h"
+#include "hivebatch.h"
+#include "hivediff.h"
+#include "global.h"
+
+CBatchRunner::CBatchRunner(CRegController *reg)
+    : m_reg(reg)
+    , m_out(stdout, QIODevice::WriteOnly)
+{
+}
+
+void CBatchRunner::printUsage()
+{
+    m_out << tr("Usage: qregedit --batch <command> [<command> ...]\n\n"
+                "Commands work on the hive opened last:\n"
+                "  open [-r] <hive>                open hive file, -r for read only\n"
+                "  close                           close current hive, unsaved changes are lost\n"
+                "  save                            write current hive, if it was changed\n"
+                "  compact <file>                  write current hive without free space, keys in\n"
+                "                                  tree order; its own file is replaced and reopened\n"
+                "  export [-j <threads>] <key> <file>\n"
+                "                                  export key subtree to .reg file, '-' for stdout\n"
+                "  import <file>                   import .reg file to current hive\n"
+                "  query [-v <value>] <key>        list values and subkeys of key\n"
+                "  search [-e] [-k <key>] <text>   find keys and values, -e for regexp\n"
+                "  diff [-k <key>] [-o <file>] <hive>\n"
+                "                                  compare current hive with another one, -o writes\n"
+                "                                  changes as .reg file, '-' for stdout\n"
+                "  multi [-j <threads>] [-m <MiB>] <command> <hive> ...\n"
+                "                                  run query, export or search on many hives at once,\n"
+                "                                  with limit for open hives size; export takes\n"
+                "                                  [-o <dir>] <key> there and writes a file per hive\n\n"
+                "Key path is relative to hive root, hive prefix is allowed too. "
+                "Use '\\' for the root key.\n");
+    m_out.flush();
+}
+
+bool CBatchRunner::nextIsOption() const
+{
+    if (m_pos >= m_args.count())
+        return false;
+
+    const QString &s = m_args.at(m_pos);
+    return (s.length() > 1 && s.startsWith(QChar('-')));
+}
+
+bool CBatchRunner::takeArg(const QString &cmd, QString &arg)
+{
+    if (m_pos >= m_args.count()) {
+        qCritical() << tr("%1: missing argument").arg(cmd);
+        return false;
+    }
+
+    arg = m_args.at(m_pos++);
+    return true;
+}
+
+struct hive *CBatchRunner::currentHive(const QString &cmd)
+{
+    if (m_hive < 0 || m_hive >= m_reg->getHivesCount()) {
+        qCritical() << tr("%1: no hive opened").arg(cmd);
+        return nullptr;
+    }
+
+    return m_reg->getHivePtr(m_hive);
+}
+
+void CBatchRunner::closeAll()
+{
+    while (m_reg->getHivesCount() > 0) {
+        const struct hive *h = m_reg->getHivePtr(0);
+
+        if ((h->state & HMODE_DIRTY) != 0)
+            qWarning() << tr("Changes in hive %1 were not saved").arg(QString::fromUtf8(h->filename));
+
+        m_reg->closeTopHive(0);
+    }
+
+    m_hive = -1;
+}
+
+int CBatchRunner::cmdOpen()
+{
+    int mode = HMODE_RW;
+
+    while (nextIsOption()) {
+        const QString opt = m_args.at(m_pos++);
+
+        if (opt == QSL("-r")) {
+            mode = HMODE_RO;
+        } else {
+            qCritical() << tr("open: unknown option %1").arg(opt);
+            return exitUsage;
+        }
+    }
+
+    QString filename;
+    if (!takeArg(QSL("open"), filename))
+        return exitUsage;
+
+    if (!m_reg->openTopHive(filename, mode))
+        return exitFailed;
+
+    m_hive = m_reg->getHivesCount() - 1;
+    return exitOk;
+}
+
+int CBatchRunner::cmdClose()
+{
+    if (currentHive(QSL("close")) == nullptr)
+        return exitFailed;
+
+    const struct hive *h = m_reg->getHivePtr(m_hive);
+    if ((h->state & HMODE_DIRTY) != 0)
+        qWarning() << tr("Changes in hive %1 were not saved").arg(QString::fromUtf8(h->filename));
+
+    m_reg->closeTopHive(m_hive);
+    m_hive = m_reg->getHivesCount() - 1;
+    return exitOk;
+}
+
+int CBatchRunner::cmdSave()
+{
+    struct hive *h = currentHive(QSL("save"));
+
+    if (h == nullptr)
+        return exitFailed;
+
+    if ((h->state & HMODE_DIDEXPAND) != 0)
+        qWarning() << tr("Hive %1 has been expanded, saving it anyway").arg(QString::fromUtf8(h->filename));
+
+    const bool dirty = ((h->state & HMODE_DIRTY) != 0);
+    if (!m_reg->writeTopHive(m_hive))
+        return exitFailed;
+
+    if (dirty) {
+        m_out << tr("%1: %2 of %3 bytes written").arg(QString::fromUtf8(h->filename)).arg(h->lastwrite).arg(h->size) << '\n';
+        m_out.flush();
+    }
+    return exitOk;
+}
+
+int CBatchRunner::cmdImport()
+{
+    QString filename;
+    if (!takeArg(QSL("import"), filename))
+        return exitUsage;
+
+    struct hive *h = currentHive(QSL("import"));
+    if (h == nullptr)
+        return exitFailed;
+
+    return (m_reg->importReg(h, filename) ? exitOk : exitFailed);
+}
+
+int CBatchRunner::cmdCompact()
+{
+    QString filename;
+    if (!takeArg(QSL("compact"), filename))
+        return exitUsage;
+
+    struct hive *h = currentHive(QSL("compact"));
+    if (h == nullptr)
+        return exitFailed;
+
+    const int oldSize = h->size;
+    const int idx = m_reg->compactTopHive(m_hive, filename);
+
+    if (idx < 0)
+        return exitFailed;
+
+    m_hive = idx;
+    m_out << tr("%1: %2 bytes, was %3 bytes").arg(filename).arg(QFileInfo(filename).size()).arg(oldSize) << '\n';
+    m_out.flush();
+    return exitOk;
+}
+
+/* Parses arguments of query, export or search. In multi mode export writes
+ * a file per hive to a directory, instead of a single file. */
+bool CBatchRunner::parseJob(const QString &cmd, CHiveBatchJob &job, bool multi)
+{
+    QString arg;
+
+    if (cmd == QSL("query")) {
+        job.action = CHiveBatchJob::Query;
+    } else if (cmd == QSL("export")) {
+        job.action = CHiveBatchJob::Export;
+        job.exportThreads = (multi ? 1 : QThread::idealThreadCount());
+        if (multi)
+            job.outputDir = QSL(".");
+    } else if (cmd == QSL("search")) {
+        job.action = CHiveBatchJob::Search;
+        job.keyPath = QSL("\\");
+    } else {
+        qCritical() << tr("Unknown command %1").arg(cmd);
+        return false;
+    }
+
+    while (nextIsOption()) {
+        const QString opt = m_args.at(m_pos++);
+
+        if (job.action == CHiveBatchJob::Query && opt == QSL("-v") && takeArg(cmd, job.valueName)) {
+            job.oneValue = true;
+        } else if (job.action == CHiveBatchJob::Export && !multi && opt == QSL("-j") && takeArg(cmd, arg)) {
+            bool ok = false;
+            job.exportThreads = arg.toInt(&ok);
+            if (!ok || job.exportThreads < 1) {
+                qCritical() << tr("%1: bad thread count %2").arg(cmd, arg);
+                return false;
+            }
+        } else if (job.action == CHiveBatchJob::Export && multi && opt == QSL("-o")
+                   && takeArg(cmd, job.outputDir)) {
+            continue;
+        } else if (job.action == CHiveBatchJob::Search && opt == QSL("-e")) {
+            job.query.useRegExp = true;
+        } else if (job.action == CHiveBatchJob::Search && opt == QSL("-k") && takeArg(cmd, job.keyPath)) {
+            continue;
+        } else {
+            qCritical() << tr("%1: unknown option %2").arg(cmd, opt);
+            return false;
+        }
+    }
+
+    if (job.action == CHiveBatchJob::Search) {
+        QString error;
+        if (!takeArg(cmd, job.query.text))
+            return false;
+
+        if (!job.query.prepare(&error)) {
+            qCritical() << tr("%1: %2").arg(cmd, error);
+            return false;
+        }
+        return true;
+    }
+
+    if (!takeArg(cmd, job.keyPath))
+        return false;
+
+    return (job.action != CHiveBatchJob::Export || multi || takeArg(cmd, job.outputFile));
+}
+
+int CBatchRunner::cmdJob(const QString &cmd)
+{
+    CHiveBatchJob job;
+
+    if (!parseJob(cmd, job, false))
+        return exitUsage;
+
+    struct hive *h = currentHive(cmd);
+    if (h == nullptr)
+        return exitFailed;
+
+    m_out.flush();
+    const CHiveBatchResult res = CHiveBatch::processHive(h, job);
+
+    for (const QString &line : res.lines)
+        m_out << line << '\n';
+    m_out.flush();
+
+    if (!res.ok) {
+        qCritical() << tr("%1: %2").arg(cmd, res.error);
+        return exitFailed;
+    }
+
+    return exitOk;
+}
+
+/* Compares current hive, as the old one, with another hive file. Changes
+ * are listed on stdout, -o writes them as .reg file that turns the old
+ * hive into the new one. */
+int CBatchRunner::cmdDiff()
+{
+    QString keyPath;
+    QString outputFile;
+
+    while (nextIsOption()) {
+        const QString opt = m_args.at(m_pos++);
+
+        if (opt == QSL("-k") && takeArg(QSL("diff"), keyPath)) {
+            continue;
+        } else if (opt == QSL("-o") && takeArg(QSL("diff"), outputFile)) {
+            continue;
+        } else {
+            qCritical() << tr("diff: unknown option %1").arg(opt);
+            return exitUsage;
+        }
+    }
+
+    QString filename;
+    if (!takeArg(QSL("diff"), filename))
+        return exitUsage;
+
+    struct hive *h = currentHive(QSL("diff"));
+    if (h == nullptr)
+        return exitFailed;
+
+    struct hive *other = m_reg->openDetachedHive(filename, HMODE_RO);
+    if (other == nullptr)
+        return exitFailed;
+
+    CHiveDiff diff(h, other);
+    int res = exitOk;
+
+    if (!diff.compare(keyPath)) {
+        m_reg->closeDetachedHive(other);
+        return exitFailed;
+    }
+
+    // Listing is left out when the .reg goes to stdout
+    if (outputFile != QSL("-")) {
+        static const char marks[] = { '+', '-', '+', '-', '*' }; // in order of CHiveDiffEntry::Kind
+
+        for (const CHiveDiffEntry &e : diff.entries()) {
+            m_out << marks[e.kind] << ' ';
+
+            if (e.kind == CHiveDiffEntry::KeyAdded || e.kind == CHiveDiffEntry::KeyRemoved) {
+                m_out << '[' << e.path << "]\n";
+            } else {
+                m_out << e.path << '\t' << (e.valueName.isEmpty() ? QSL("@") : e.valueName) << '\n';
+            }
+        }
+        m_out.flush();
+    }
+
+    if (!outputFile.isEmpty()) {
+        QFile f;
+        bool opened = false;
+
+        if (outputFile == QSL("-")) {
+            opened = f.open(stdout, QIODevice::WriteOnly);
+        } else {
+            f.setFileName(outputFile);
+            opened = f.open(QIODevice::WriteOnly);
+        }
+
+        if (!opened || !diff.writeReg(&f)) {
+            qCritical() << tr("diff: failed to write %1").arg(outputFile);
+            res = exitFailed;
+        }
+    }
+
+    m_reg->closeDetachedHive(other);
+    return res;
+}
+
+/* Same job on many hives at once, all arguments after the job are hive files.
+ * Output lines are prefixed with hive file name, in order of completion. */
+int CBatchRunner::cmdMulti()
+{
+    CHiveBatch batch;
+
+    while (nextIsOption()) {
+        const QString opt = m_args.at(m_pos++);
+        QString arg;
+        bool ok = false;
+
+        if (opt == QSL("-j") && takeArg(QSL("multi"), arg)) {
+            const int threads = arg.toInt(&ok);
+            ok = (ok && threads > 0);
+            if (ok)
+                batch.setThreadCount(threads);
+        } else if (opt == QSL("-m") && takeArg(QSL("multi"), arg)) {
+            const qint64 limit = arg.toLongLong(&ok);
+            ok = (ok && limit > 0);
+            if (ok)
+                batch.setMemoryLimit(limit * 1024 * 1024);
+        } else {
+            qCritical() << tr("multi: unknown option %1").arg(opt);
+            return exitUsage;
+        }
+
+        if (!ok) {
+            qCritical() << tr("multi: bad value %1 for %2").arg(arg, opt);
+            return exitUsage;
+        }
+    }
+
+    QString cmd;
+    CHiveBatchJob job;
+    if (!takeArg(QSL("multi"), cmd) || !parseJob(cmd, job, true))
+        return exitUsage;
+
+    const QStringList files = m_args.mid(m_pos);
+    m_pos = m_args.count();
+
+    if (files.isEmpty()) {
+        qCritical() << tr("multi: no hive files");
+        return exitUsage;
+    }
+
+    QEventLoop loop;
+    int failed = 0;
+
+    QObject::connect(&batch, &CHiveBatch::hiveFinished, &loop, [this](const CHiveBatchResult &res) {
+        if (!res.ok) {
+            qCritical() << tr("%1: %2").arg(res.filename, res.error);
+            return;
+        }
+
+        for (const QString &line : res.lines)
+            m_out << res.filename << '\t' << line << '\n';
+        if (!res.outputFile.isEmpty())
+            m_out << res.filename << '\t' << res.outputFile << '\n';
+        m_out.flush();
+    });
+    QObject::connect(&batch, &CHiveBatch::finished, &loop, [&loop, &failed](int count) {
+        failed = count;
+        loop.quit();
+    });
+
+    batch.start(files, job);
+    loop.exec();
+
+    return (failed > 0 ? exitFailed : exitOk);
+}
+
+int CBatchRunner::run(const QStringList &args)
+{
+    if (args.isEmpty() || args.first() == QSL("-h") || args.first() == QSL("--help")) {
+        printUsage();
+        return (args.isEmpty() ? exitUsage : exitOk);
+    }
+
+    m_args = args;
+    m_pos = 0;
+    int res = exitOk;
+
+    while (m_pos < m_args.count() && res == exitOk) {
+        const QString cmd = m_args.at(m_pos++);
+
+        if (cmd == QSL("open")) {
+            res = cmdOpen();
+        } else if (cmd == QSL("close")) {
+            res = cmdClose();
+        } else if (cmd == QSL("save")) {
+            res = cmdSave();
+        } else if (cmd == QSL("import")) {
+            res = cmdImport();
+        } else if (cmd == QSL("compact")) {
+            res = cmdCompact();
+        } else if (cmd == QSL("export") || cmd == QSL("query") || cmd == QSL("search")) {
+            res = cmdJob(cmd);
+        } else if (cmd == QSL("diff")) {
+            res = cmdDiff();
+        } else if (cmd == QSL("multi")) {
+            res = cmdMulti();
+        } else {
+            qCritical() << tr("Unknown command %1").arg(cmd);
+            res = exitUsage;
+        }
+    }
+
+    closeAll();
+    return res;
+}
@@ -0,0 +1,52 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTextStream>
+#include "regutils.h"
+
+class CHiveBatchJob;
+
+/* Runs commands from the command line without any widgets. Commands go one
+ * after another, each works on the hive opened last:
+ *   qregedit --batch open SOFTWARE import fix.reg save
+ * Results are printed to stdout, log messages go to stderr.
+ */
+class CBatchRunner
+{
+    Q_DECLARE_TR_FUNCTIONS(CBatchRunner)
+
+public:
+    enum ExitCode { exitOk = 0, exitFailed = 1, exitUsage = 2 };
+
+private:
+    CRegController *m_reg { nullptr };
+    QTextStream m_out;
+    QStringList m_args;
+    int m_pos { 0 };
+    int m_hive { -1 }; // current hive index in controller
+
+    bool nextIsOption() const;
+    bool takeArg(const QString &cmd, QString &arg);
+    struct hive *currentHive(const QString &cmd);
+    bool parseJob(const QString &cmd, CHiveBatchJob &job, bool multi);
+    void closeAll();
+
+    int cmdOpen();
+    int cmdClose();
+    int cmdSave();
+    int cmdImport();
+    int cmdCompact();
+    int cmdJob(const QString &cmd);
+    int cmdDiff();
+    int cmdMulti();
+
+public:
+    explicit CBatchRunner(CRegController *reg);
+
+    int run(const QStringList &args);
+    void printUsage();
+};
+
+#endif // BATCH_H
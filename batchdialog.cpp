@@ -0,0 +1,176 @@
+#include <QMessageBox>
+#include <QFileInfo>
+#include <QThread>
+#include <QDir>
+#include "global.h"
+#include "batchdialog.h"
+#include "ui_batchdialog.h"
+
+CBatchDialog::CBatchDialog(QWidget *parent) :
+    QDialog(parent),
+    ui(new Ui::CBatchDialog)
+{
+    ui->setupUi(this);
+
+    m_batch = new CHiveBatch(this);
+    m_runButton = ui->buttonBox->addButton(tr("&Run"), QDialogButtonBox::ActionRole);
+
+    ui->spinThreads->setValue(QThread::idealThreadCount());
+    ui->spinMemory->setValue(static_cast<int>(CHiveBatch::defaultMemoryLimit / (1024 * 1024)));
+    ui->editOutputDir->setText(QDir::currentPath());
+
+    connect(ui->comboAction, qOverload<int>(&QComboBox::currentIndexChanged), this, &CBatchDialog::updateAction);
+    connect(ui->buttonAdd, &QPushButton::clicked, this, &CBatchDialog::addFiles);
+    connect(ui->buttonRemove, &QPushButton::clicked, this, &CBatchDialog::removeFiles);
+    connect(ui->buttonBrowse, &QPushButton::clicked, this, &CBatchDialog::browseOutputDir);
+    connect(m_runButton, &QPushButton::clicked, this, &CBatchDialog::run);
+    connect(m_batch, &CHiveBatch::hiveFinished, this, &CBatchDialog::hiveFinished);
+    connect(m_batch, &CHiveBatch::finished, this, &CBatchDialog::batchFinished);
+
+    updateAction();
+}
+
+CBatchDialog::~CBatchDialog()
+{
+    delete ui;
+}
+
+void CBatchDialog::reject()
+{
+    // Hives being processed are finished in CHiveBatch destructor
+    if (m_batch->isRunning())
+        m_batch->cancel();
+
+    QDialog::reject();
+}
+
+void CBatchDialog::updateAction()
+{
+    const int action = ui->comboAction->currentIndex();
+
+    ui->labelText->setText(action == CHiveBatchJob::Search ? tr("Search &text") : tr("&Value"));
+    ui->editText->setEnabled(action != CHiveBatchJob::Export);
+    ui->editText->setPlaceholderText(action == CHiveBatchJob::Query ? tr("all values and subkeys") : QString());
+    ui->checkRegExp->setEnabled(action == CHiveBatchJob::Search);
+    ui->editOutputDir->setEnabled(action == CHiveBatchJob::Export);
+    ui->buttonBrowse->setEnabled(action == CHiveBatchJob::Export);
+}
+
+void CBatchDialog::setRunning(bool running)
+{
+    ui->listFiles->setEnabled(!running);
+    ui->buttonAdd->setEnabled(!running);
+    ui->buttonRemove->setEnabled(!running);
+    ui->comboAction->setEnabled(!running);
+    ui->editKey->setEnabled(!running);
+    ui->spinThreads->setEnabled(!running);
+    ui->spinMemory->setEnabled(!running);
+    m_runButton->setEnabled(!running);
+
+    if (running) {
+        ui->editText->setEnabled(false);
+        ui->checkRegExp->setEnabled(false);
+        ui->editOutputDir->setEnabled(false);
+        ui->buttonBrowse->setEnabled(false);
+    } else {
+        updateAction();
+    }
+}
+
+void CBatchDialog::addFiles()
+{
+    const QStringList files = getOpenFileNamesD(this, tr("Select hive files"));
+
+    for (const QString &file : files) {
+        if (ui->listFiles->findItems(file, Qt::MatchExactly).isEmpty())
+            ui->listFiles->addItem(file);
+    }
+}
+
+void CBatchDialog::removeFiles()
+{
+    qDeleteAll(ui->listFiles->selectedItems());
+}
+
+void CBatchDialog::browseOutputDir()
+{
+    const QString dir = getExistingDirectoryD(this, tr("Output directory"), ui->editOutputDir->text());
+
+    if (!dir.isEmpty())
+        ui->editOutputDir->setText(dir);
+}
+
+void CBatchDialog::run()
+{
+    QStringList files;
+    for (int i = 0; i < ui->listFiles->count(); i++)
+        files.append(ui->listFiles->item(i)->text());
+
+    if (files.isEmpty()) {
+        QMessageBox::warning(this, windowTitle(), tr("No hive files to process."));
+        return;
+    }
+
+    CHiveBatchJob job;
+    job.action = static_cast<CHiveBatchJob::Action>(ui->comboAction->currentIndex());
+    job.keyPath = ui->editKey->text();
+
+    switch (job.action) {
+        case CHiveBatchJob::Query:
+            job.valueName = ui->editText->text();
+            job.oneValue = !job.valueName.isEmpty();
+            break;
+
+        case CHiveBatchJob::Export:
+            job.outputDir = ui->editOutputDir->text();
+            if (!QFileInfo(job.outputDir).isDir()) {
+                QMessageBox::warning(this, windowTitle(), tr("Output directory does not exist."));
+                return;
+            }
+            break;
+
+        case CHiveBatchJob::Search: {
+            QString error;
+            job.query.text = ui->editText->text();
+            job.query.useRegExp = ui->checkRegExp->isChecked();
+            if (!job.query.prepare(&error)) {
+                QMessageBox::warning(this, windowTitle(), error);
+                return;
+            }
+            break;
+        }
+    }
+
+    ui->editResults->clear();
+    ui->progressBar->setMaximum(files.count());
+    ui->progressBar->setValue(0);
+
+    m_batch->setThreadCount(ui->spinThreads->value());
+    m_batch->setMemoryLimit(static_cast<qint64>(ui->spinMemory->value()) * 1024 * 1024);
+
+    setRunning(true);
+    m_batch->start(files, job);
+}
+
+void CBatchDialog::hiveFinished(const CHiveBatchResult &result)
+{
+    ui->progressBar->setValue(ui->progressBar->value() + 1);
+
+    if (!result.ok) {
+        ui->editResults->appendPlainText(tr("== %1: %2").arg(result.filename, result.error));
+        return;
+    }
+
+    ui->editResults->appendPlainText(tr("== %1").arg(result.filename));
+    if (!result.outputFile.isEmpty())
+        ui->editResults->appendPlainText(tr("Exported to %1").arg(result.outputFile));
+    if (!result.lines.isEmpty())
+        ui->editResults->appendPlainText(result.lines.join(QChar('\n')));
+}
+
+void CBatchDialog::batchFinished(int failed)
+{
+    setRunning(false);
+    ui->editResults->appendPlainText(tr("\nProcessed %1 hives, %2 failed.")
+                                     .arg(ui->progressBar->maximum()).arg(failed));
+}
@@ -0,0 +1,39 @@
+#ifndef BATCHDIALOG_H
+#define BATCHDIALOG_H
+
+#include <QDialog>
+#include <QPushButton>
+#include "hivebatch.h"
+
+namespace Ui {
+class CBatchDialog;
+}
+
+class CBatchDialog : public QDialog
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CBatchDialog)
+
+public:
+    explicit CBatchDialog(QWidget *parent = nullptr);
+    ~CBatchDialog() override;
+
+public Q_SLOTS:
+    void reject() override;
+
+private:
+    Ui::CBatchDialog *ui;
+    CHiveBatch *m_batch { nullptr };
+    QPushButton *m_runButton { nullptr };
+
+    void updateAction();
+    void setRunning(bool running);
+    void addFiles();
+    void removeFiles();
+    void browseOutputDir();
+    void run();
+    void hiveFinished(const CHiveBatchResult &result);
+    void batchFinished(int failed);
+};
+
+#endif // BATCHDIALOG_H
@@ -80,8 +80,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#define NTREG_HAVE_MMAP 1
+#else
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#endif
+
 #include "ntreg.h"
 #include "../functions.h"
 
@@ -830,9 +839,313 @@ int parse_block(struct hive *hdesc, int vofs,int verbose)
   return(seglen);
 }
 
+/* Free cell index
+ * All unused blocks of the hive kept in a treap ordered by offset, each
+ * node also knows the largest block in its subtree. Lowest fitting block
+ * is found in O(log n), in same first-fit order as walking all hbins.
+ * Built by hive_scan_bins() and maintained by alloc_block(), free_block()
+ * and add_bin().
+ */
+
+struct free_cell {
+  int ofs;                   /* Offset of block linkage */
+  int size;                  /* Block size, incl. linkage */
+  int maxsize;               /* Largest block size in this subtree */
+  unsigned int prio;         /* Treap heap priority */
+  struct free_cell *left, *right;
+};
+
+static void fc_update(struct free_cell *t)
+{
+  t->maxsize = t->size;
+  if (t->left && t->left->maxsize > t->maxsize) t->maxsize = t->left->maxsize;
+  if (t->right && t->right->maxsize > t->maxsize) t->maxsize = t->right->maxsize;
+}
+
+static struct free_cell *fc_insert(struct free_cell *t, struct free_cell *n)
+{
+  struct free_cell *r;
+
+  if (!t) return(n);
+
+  if (n->ofs < t->ofs) {
+    t->left = fc_insert(t->left, n);
+    if (t->left->prio > t->prio) {  /* Rotate right */
+      r = t->left;
+      t->left = r->right;
+      r->right = t;
+      fc_update(t);
+      fc_update(r);
+      return(r);
+    }
+  } else {
+    t->right = fc_insert(t->right, n);
+    if (t->right->prio > t->prio) { /* Rotate left */
+      r = t->right;
+      t->right = r->left;
+      r->left = t;
+      fc_update(t);
+      fc_update(r);
+      return(r);
+    }
+  }
+  fc_update(t);
+  return(t);
+}
+
+static struct free_cell *fc_merge(struct free_cell *a, struct free_cell *b)
+{
+  if (!a) return(b);
+  if (!b) return(a);
+  if (a->prio > b->prio) {
+    a->right = fc_merge(a->right, b);
+    fc_update(a);
+    return(a);
+  }
+  b->left = fc_merge(a, b->left);
+  fc_update(b);
+  return(b);
+}
+
+static struct free_cell *fc_remove(struct free_cell *t, int ofs, int *found)
+{
+  struct free_cell *r;
+
+  if (!t) return(NULL);
+
+  if (t->ofs == ofs) {
+    r = fc_merge(t->left, t->right);
+    free(t);
+    *found = 1;
+    return(r);
+  }
+  if (ofs < t->ofs)
+    t->left = fc_remove(t->left, ofs, found);
+  else
+    t->right = fc_remove(t->right, ofs, found);
+  fc_update(t);
+  return(t);
+}
+
+static void fc_free_all(struct free_cell *t)
+{
+  if (!t) return;
+  fc_free_all(t->left);
+  fc_free_all(t->right);
+  free(t);
+}
+
+/* Add unused block to index
+ * ofs  - offset of block linkage
+ * size - block size
+ */
+
+static void fc_add(struct hive *hdesc, int ofs, int size)
+{
+  struct free_cell *n;
+
+  if (!hdesc->binscan || size <= 0) return;
+
+  CREATE(n, struct free_cell, 1);
+  n->ofs = ofs;
+  n->size = size;
+  n->maxsize = size;
+  n->prio = (unsigned int)ofs * 2654435761u;  /* Multiplicative hash, spreads offsets */
+  hdesc->freecells = fc_insert(hdesc->freecells, n);
+}
+
+/* Remove unused block from index, when it's allocated or merged */
+
+static void fc_del(struct hive *hdesc, int ofs)
+{
+  int found = 0;
+
+  if (!hdesc->binscan) return;
+
+  hdesc->freecells = fc_remove(hdesc->freecells, ofs, &found);
+  if (!found) qf_printf("fc_del: WARNING: free block at 0x%x not in index\n", ofs);
+}
+
+/* Find first unused block of at least size bytes
+ * returns: offset of block linkage, 0 if none
+ */
+
+static int fc_find(struct hive *hdesc, int size)
+{
+  struct free_cell *t = hdesc->freecells;
+
+  while (t) {
+    if (t->left && t->left->maxsize >= size) {
+      t = t->left;
+    } else if (t->size >= size) {
+      return(t->ofs);
+    } else if (t->right && t->right->maxsize >= size) {
+      t = t->right;
+    } else {
+      break;
+    }
+  }
+  return(0);
+}
+
+/* Find unused block of at least size bytes with offset in [lo, hi)
+ * last - 0 for the lowest such block, 1 for the highest
+ * returns: offset of block linkage, 0 if none
+ */
+
+static int fc_find_in(struct free_cell *t, int lo, int hi, int size, int last)
+{
+  int r;
+
+  if (!t || t->maxsize < size) return(0);
+  if (t->ofs < lo) return(fc_find_in(t->right, lo, hi, size, last));
+  if (t->ofs >= hi) return(fc_find_in(t->left, lo, hi, size, last));
+
+  r = fc_find_in(last ? t->right : t->left, lo, hi, size, last);
+  if (r) return(r);
+  if (t->size >= size) return(t->ofs);
+  return(fc_find_in(last ? t->left : t->right, lo, hi, size, last));
+}
+
+/* Run through all hbins, tallying pages and used/unused blocks
+ * hdesc - hive
+ * Fills pages, useblk, unuseblk, usetot, unusetot, lastbin,
+ * the hbin offset table and the free cell index.
+ * Done only once per hive, allocation routines keep the numbers up to date
+ * after that.
+ * returns: 0 - ok, 1 - hbin chain is broken (statistics are partial)
+ */
+
+int hive_scan_bins(struct hive *hdesc)
+{
+  struct hbin_page *p = NULL;
+  struct regf_header *hdr;
+  int pofs, vofs, seglen;
+  int binsalloc = 0;
+  int verbose = (hdesc->state & HMODE_VERBOSE);
+  int trace   = (hdesc->state & HMODE_TRACE) ? 1 : 0;
+  int info    = (hdesc->state & HMODE_INFO);
+
+  if (hdesc->binscan) return(0);
+  hdesc->binscan = 1;
+
+  hdesc->pages = 0;
+  hdesc->useblk = hdesc->unuseblk = 0;
+  hdesc->usetot = hdesc->unusetot = 0;
+
+  hdr = (struct regf_header *)hdesc->buffer;
+
+  /* NOTE/KLUDGE: Assume first page starts at offset 0x1000 */
+  pofs = 0x1000;
+  hdesc->lastbin = pofs;
+
+  while (pofs < hdr->filesize + 0x1000 && pofs < hdesc->size) {   /* Loop through hbins until end according to regf header */
+    p = (struct hbin_page *)(hdesc->buffer + pofs);
+    if (p->id != 0x6E696268) {
+      if (info) qf_printf("Page at 0x%x is not 'hbin', assuming file contains garbage at end\n",pofs);
+      break;
+    }
+    if (hdesc->pages >= binsalloc) {
+      binsalloc = binsalloc ? binsalloc * 2 : 256;
+      hdesc->bins = realloc(hdesc->bins, binsalloc * sizeof(int));
+      if (!hdesc->bins) {
+        perror("hive_scan_bins : realloc() ");
+        abort();
+      }
+    }
+    hdesc->bins[hdesc->pages++] = pofs;
+
+    if (verbose) qf_printf("###### Page at 0x%0x ofs_self 0x%0x, size (delta ofs_next) 0x%0x ######\n",
+                           pofs,p->ofs_self,p->ofs_next);
+
+    if (p->ofs_next == 0) {
+      qf_printf("hive_scan_bins: ERROR: Page at 0x%x has size zero! File may be corrupt, or program has a bug\n",pofs);
+      return(1);
+    }
+
+    vofs = pofs + 0x20; /* Skip page header, and run through blocks in hbin */
+
+    while (vofs-pofs < p->ofs_next && vofs < hdesc->size) {
+      seglen = parse_block(hdesc,vofs,trace);
+      if (!seglen) break;
+      if (get_int(hdesc->buffer+vofs) > 0) fc_add(hdesc, vofs, seglen);
+      vofs += seglen;
+    }
+
+    hdesc->lastbin = pofs;
+    pofs += p->ofs_next;
+
+  } /* hbin loop */
+
+  if (verbose) qf_printf("Last HBIN at offset       : 0x%x\n",hdesc->lastbin);
+
+  if (info || verbose) {
+    qf_printf("File size %d [%x] bytes, containing %d pages (+ 1 headerpage)\n",hdesc->size,hdesc->size, hdesc->pages);
+    qf_printf("Used for data: %d/%d blocks/bytes, unused: %d/%d blocks/bytes.\n\n",
+              hdesc->useblk,hdesc->usetot,hdesc->unuseblk,hdesc->unusetot);
+  }
+
+  return(0);
+}
+
 /* ================================================================ */
 /* Scan and allocation routines */
 
+/* Check if hive buffer may be changed
+ * Read-only hives loaded with HMODE_MMAP share their pages with the file,
+ * the buffer is mapped without write access.
+ * func - caller name for the message
+ * returns: 1 - hive can't be modified, 0 - ok
+ */
+
+int hive_immutable(struct hive *hdesc, const char *func)
+{
+  if ((hdesc->state & (HMODE_RO | HMODE_MMAP)) == (HMODE_RO | HMODE_MMAP)) {
+    qf_printf("%s: ERROR: Hive <%s> is mapped read-only, it can't be modified!\n", func, hdesc->filename);
+    return(1);
+  }
+  return(0);
+}
+
+/* Remember pages changed since last writeHive(), so only those need
+ * to be written. Also marks whole hive as dirty.
+ * hdesc - hive
+ * ofs   - offset of first changed byte in buffer
+ * len   - number of changed bytes
+ */
+
+void mark_dirty(struct hive *hdesc, int ofs, int len)
+{
+  int pages, first, last, i;
+  unsigned char *map;
+
+  hdesc->state |= HMODE_DIRTY;
+  if (len <= 0 || ofs < 0) return;
+
+  pages = (hdesc->size + HBIN_PAGESIZE - 1) / HBIN_PAGESIZE;
+  if (pages > hdesc->dirtysize) {  /* First change, or hive has grown */
+    map = realloc(hdesc->dirtymap, pages);
+    if (!map) {
+      perror("mark_dirty : realloc() ");
+      abort();
+    }
+    memset(map + hdesc->dirtysize, 0, pages - hdesc->dirtysize);
+    hdesc->dirtymap = map;
+    hdesc->dirtysize = pages;
+  }
+
+  first = ofs / HBIN_PAGESIZE;
+  last = (ofs + len - 1) / HBIN_PAGESIZE;
+  if (last >= pages) last = pages - 1;
+
+  for (i = first; i <= last; i++) {
+    if (!hdesc->dirtymap[i]) {
+      hdesc->dirtymap[i] = 1;
+      hdesc->dirtypages++;
+    }
+  }
+}
+
 /* Find start of page given a current pointer into the buffer
  * hdesc = hive
  * vofs = offset pointer into buffer
@@ -841,9 +1154,23 @@ int parse_block(struct hive *hdesc, int vofs,int verbose)
 
 int find_page_start(struct hive *hdesc, int vofs)
 {
-  int r,prev;
+  int r,prev,lo,hi,mid;
   struct hbin_page *h;
 
+  if (hdesc->binscan && hdesc->pages > 0) {  /* Binary search in hbin table */
+    lo = 0;
+    hi = hdesc->pages - 1;
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (hdesc->bins[mid] <= vofs) lo = mid;
+      else hi = mid - 1;
+    }
+    r = hdesc->bins[lo];
+    h = (struct hbin_page *)(hdesc->buffer + r);
+    if (r <= vofs && vofs < r + h->ofs_next) return(r);
+    return(0);
+  }
+
   /* Again, assume start at 0x1000 */
 
   r = 0x1000;
@@ -933,7 +1260,7 @@ int find_free_blk(struct hive *hdesc, int pofs, int size)
 
 #undef FB_DEBUG
 
-/* Search pages from start to find free block
+/* Find free block anywhere in hive, using free cell index
  * hdesc - hive
  * size - space requested, in bytes
  * returns: offset to free block, 0 if not found or error
@@ -941,27 +1268,87 @@ int find_free_blk(struct hive *hdesc, int pofs, int size)
 
 int find_free(struct hive *hdesc, int size)
 {
-  int r,blk;
-  struct hbin_page *h;
-
   /* Align to 8 byte boundary */
   if (size & 7) size += (8 - (size & 7));
 
-  /* Again, assume start at 0x1000 */
+  return(fc_find(hdesc, size));
+}
 
-  r = 0x1000;
-  while (r < hdesc->endofs) {
-    h = (struct hbin_page *)(hdesc->buffer + r);
-    if (h->id != 0x6E696268) return(0);
-    if (h->ofs_next == 0) {
-     qf_printf("find_free: zero len or ofs_next found in page at 0x%x\n",r);
-      return(0);
-    }
-    blk = find_free_blk(hdesc,r,size);
-    if (blk) return (blk);
-    r += h->ofs_next;
+/* Find free block close to an offset, so related blocks stay in the same
+ * pages. Tries the hbin of ofs first, then the two hbins around it, then
+ * the whole hive, each time taking the block closer to ofs.
+ * hdesc - hive, bins must be scanned
+ * ofs   - offset to place block near to
+ * size  - space requested, in bytes, aligned
+ * returns: offset to free block, 0 if none fits
+ */
+
+int find_free_near(struct hive *hdesc, int ofs, int size)
+{
+  int lo = 0, hi = hdesc->pages - 1, mid;
+  int binofs, binend, prevofs, nextend, before, after;
+
+  if (hdesc->pages <= 0 || ofs < hdesc->bins[0]) return(0);
+
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (hdesc->bins[mid] <= ofs) lo = mid;
+    else hi = mid - 1;
   }
-  return(0);
+
+  binofs = hdesc->bins[lo];
+  binend = (lo + 1 < hdesc->pages) ? hdesc->bins[lo + 1] : hdesc->endofs;
+  if (ofs >= binend) return(0);
+
+  before = fc_find_in(hdesc->freecells, binofs, ofs, size, 1);
+  after = fc_find_in(hdesc->freecells, ofs, binend, size, 0);
+
+  if (!before && !after) {
+    prevofs = (lo > 0) ? hdesc->bins[lo - 1] : binofs;
+    nextend = (lo + 2 < hdesc->pages) ? hdesc->bins[lo + 2] : hdesc->endofs;
+
+    before = fc_find_in(hdesc->freecells, prevofs, binofs, size, 1);
+    after = fc_find_in(hdesc->freecells, binend, nextend, size, 0);
+  }
+
+  /* Nothing around, take closest one anywhere */
+  if (!before && !after) {
+    before = fc_find_in(hdesc->freecells, hdesc->bins[0], binofs, size, 1);
+    after = fc_find_in(hdesc->freecells, binend, hdesc->endofs, size, 0);
+  }
+
+  if (before && (!after || ofs - before < after - ofs)) return(before);
+  return(after);
+}
+
+/* Resize hive buffer, new space is zeroed. Mapped hives are moved to heap,
+ * a file mapping can't grow and a read-only one can't be changed.
+ * hdesc   - hive
+ * newsize - new buffer size, not less than current
+ */
+
+static void grow_buffer(struct hive *hdesc, int newsize)
+{
+  int oldsize = hdesc->size;
+
+#ifdef NTREG_HAVE_MMAP
+  if (hdesc->mapsize) {
+    char *nbuf;
+    ALLOC(nbuf,1,newsize);
+    memcpy(nbuf, hdesc->buffer, oldsize);
+    munmap(hdesc->buffer, hdesc->mapsize);
+    hdesc->mapsize = 0;
+    hdesc->state &= ~HMODE_MMAP;
+    hdesc->buffer = nbuf;
+  } else
+#endif
+  hdesc->buffer = realloc(hdesc->buffer, newsize);
+  if (!hdesc->buffer) {
+    perror("grow_buffer : realloc() ");
+    abort();
+  }
+  memset(hdesc->buffer + oldsize, 0, newsize - oldsize);
+  hdesc->size = newsize;
 }
 
 /* Add new hbin to end of file. If file contains data at end
@@ -974,7 +1361,7 @@ int find_free(struct hive *hdesc, int size)
 #define ADDBIN_DEBUG
 int add_bin(struct hive *hdesc, int size)
 {
-  int r,newsize,newbinofs;
+  int r,newsize,newbinofs,oldsize;
   struct hbin_page *newbin;
   struct regf_header *hdr;
 
@@ -984,6 +1371,8 @@ int add_bin(struct hive *hdesc, int size)
     return(0);
   }
 
+  hive_scan_bins(hdesc);
+
   r = ((size + 0x20 + 4) & ~0xfff) + HBIN_PAGESIZE;  /* Add header and link, round up to page boundary, usually 0x1000 */
 
   newbinofs = hdesc->endofs;
@@ -1003,12 +1392,10 @@ int add_bin(struct hive *hdesc, int size)
    qf_printf("add_bin: new buffer size = %d [%x]\n",newsize,newsize);
 #endif
 
-    hdesc->buffer = realloc(hdesc->buffer, newsize);
-    if (!hdesc->buffer) {
-      perror("add_bin : realloc() ");
-      abort();
-    }
-    hdesc->size = newsize;
+    /* Padding after the new hbin goes to the file too */
+    oldsize = hdesc->size;
+    grow_buffer(hdesc, newsize);
+    mark_dirty(hdesc, oldsize, newsize - oldsize);
 
   }
 
@@ -1038,8 +1425,19 @@ int add_bin(struct hive *hdesc, int size)
 
   /* Update state */
 
-  hdesc->state |= HMODE_DIDEXPAND | HMODE_DIRTY;
+  hdesc->state |= HMODE_DIDEXPAND;
+  mark_dirty(hdesc, 0, sizeof(struct regf_header));
+  mark_dirty(hdesc, newbinofs, r);
   hdesc->lastbin = newbinofs;  /* Last bin */
+  hdesc->bins = realloc(hdesc->bins, (hdesc->pages + 1) * sizeof(int));
+  if (!hdesc->bins) {
+    perror("add_bin : realloc() ");
+    abort();
+  }
+  hdesc->bins[hdesc->pages++] = newbinofs;
+  hdesc->unuseblk++;
+  hdesc->unusetot += newbin->firstlink;
+  fc_add(hdesc, newbinofs + 0x20, newbin->firstlink);
   hdesc->endofs = newbinofs + r;   /* New data end */
 
  return(newbinofs + 0x20);
@@ -1067,6 +1465,9 @@ int alloc_block(struct hive *hdesc, int ofs, int size)
   int newbin;
   int trail, trailsize, oldsz;
 
+  if (hive_immutable(hdesc, "alloc_block")) return(0);
+  hive_scan_bins(hdesc);
+
   if (hdesc->state & HMODE_NOALLOC) {
    qf_printf("\nERROR: alloc_block: Hive <%s> is in no allocation safe mode,"
 	   "new space not allocated. Operation will fail!\n", hdesc->filename);
@@ -1076,10 +1477,13 @@ int alloc_block(struct hive *hdesc, int ofs, int size)
   size += 4;  /* Add linkage */
   if (size & 7) size += (8 - (size & 7));
 
-  /* Check current page first */
+  /* Check pages around the given offset first */
   if (ofs) {
+    hdesc->nearalloc++;
+    blk = find_free_near(hdesc,ofs,size);
     pofs = find_page_start(hdesc,ofs);
-    blk = find_free_blk(hdesc,pofs,size);
+    if (!pofs || blk < pofs || blk >= pofs + ((struct hbin_page *)(hdesc->buffer + pofs))->ofs_next)
+      hdesc->crossbin++;
   }
 
   /* Then check whole hive */
@@ -1096,6 +1500,8 @@ int alloc_block(struct hive *hdesc, int ofs, int size)
 #endif
     trailsize = oldsz - size;
 
+    fc_del(hdesc, blk);
+
     if (trailsize == 4) {
       trailsize = 0;
       size += 4;
@@ -1132,6 +1538,7 @@ int alloc_block(struct hive *hdesc, int ofs, int size)
       trail = blk + size;
 
       *(int *)((hdesc->buffer)+trail) = (int)trailsize;
+      fc_add(hdesc, trail, trailsize);
 
       hdesc->useblk++;    /* This will keep blockcount */
       hdesc->unuseblk--;
@@ -1145,7 +1552,7 @@ int alloc_block(struct hive *hdesc, int ofs, int size)
 //    bzero( (void *)(hdesc->buffer+blk+4), size-4);
 #endif
 
-    hdesc->state |= HMODE_DIRTY;
+    mark_dirty(hdesc, blk, size + (trailsize ? 4 : 0));
 
 #if 0
    qf_printf("alloc_block: returning %x\n",blk);
@@ -1155,7 +1562,10 @@ int alloc_block(struct hive *hdesc, int ofs, int size)
    qf_printf("alloc_block: failed to alloc %d bytes, trying to expand hive..\n",size);
 
     newbin = add_bin(hdesc,size);
-    if (newbin) return(alloc_block(hdesc,newbin,size)); /* Nasty... recall ourselves. */
+    if (newbin) {
+      if (ofs) hdesc->nearalloc--;  /* Not counted twice, the miss is counted above */
+      return(alloc_block(hdesc,newbin,size)); /* Nasty... recall ourselves. */
+    }
     /* Fallthrough to fail if add_bin fails */
   }
   return(0);
@@ -1175,6 +1585,9 @@ int free_block(struct hive *hdesc, int blk)
   int pofs,vofs,seglen,prev,next,nextsz,prevsz,size;
   struct hbin_page *p;
 
+  if (hive_immutable(hdesc, "free_block")) return(0);
+  hive_scan_bins(hdesc);
+
   if (hdesc->state & HMODE_NOALLOC) {
    qf_printf("free_block: ERROR: Hive %s is in no allocation safe mode,"
 	   "space not freed. Operation will fail!\n", hdesc->filename);
@@ -1252,6 +1665,7 @@ int free_block(struct hive *hdesc, int blk)
 #if 0
    qf_printf("Swallow next\n");
 #endif
+    fc_del(hdesc, next);
     size += nextsz;   /* Swallow it in current block */
     hdesc->useblk--;
     hdesc->usetot -= 4;
@@ -1269,13 +1683,14 @@ int free_block(struct hive *hdesc, int blk)
   hdesc->unusetot -= size;  /* FIXME !?!? */
   hdesc->unuseblk--;
 
-  hdesc->state |= HMODE_DIRTY;
+  mark_dirty(hdesc, blk, size);
  
   /* Check if previous block is also free, if so, merge.. */
   if (prevsz > 0) {
 #if 0
    qf_printf("Swallow prev\n");
 #endif
+    fc_del(hdesc, prev);
     hdesc->usetot -= prevsz;
     hdesc->unusetot += prevsz;
     prevsz += size;
@@ -1285,9 +1700,12 @@ int free_block(struct hive *hdesc, int blk)
 //      bzero( (void *)(hdesc->buffer+prev), prevsz);
 #endif
     *(int *)((hdesc->buffer)+prev) = (int)prevsz;
+    mark_dirty(hdesc, prev, prevsz);
+    fc_add(hdesc, prev, prevsz);
     hdesc->useblk--;
     return(prevsz);
   }
+  fc_add(hdesc, blk, size);
   return(size);
 }
 
@@ -1694,7 +2112,8 @@ int trav_path(struct hive *hdesc, int vofs, char *path, int type)
 
   if (key->no_subkeys > 0) {    /* If it has subkeys, loop through the hash */
     char *partw = NULL;
-    int partw_len, part_len;
+    int partw_len, part_len, use_hash;
+    uint32_t part_hash;
 
     //qf_printf("trav_path: subkey loop: path = %s, part = %s\n",path,part);
 
@@ -1726,8 +2145,20 @@ int trav_path(struct hive *hdesc, int vofs, char *path, int type)
     partw = string_prog2regw(part, partptr-part, &partw_len);
     //    string_prog2rega(part, partptr-part);
     part_len = strlen(part);
+
+    /* lh lists keep a base 37 hash of the uppercased name. For plain ASCII
+     * exact lookups it rejects most siblings without touching their nk records.
+     * (lf 4-char hints don't pay off here, names often share a prefix) */
+    use_hash = (type & TPF_EXACT);
+    for (i = 0, part_hash = 0; i < part_len; i++) {
+      if (part[i] & 0x80) use_hash = 0;
+      part_hash *= 37;
+      part_hash += reg_touppertable[(unsigned char)part[i]];
+    }
+
     do {
       for(i = 0; i < subs; i++) {
+	if (!likey && use_hash && lfkey->id == 0x686c && (uint32_t)lfkey->lh_hash[i].hash != part_hash) continue;
 	if (likey) newnkofs = likey->hash[i].ofs_nk + 0x1004;
 	else newnkofs = lfkey->hash[i].ofs_nk + 0x1004;
 	newnkkey = (struct nk_key *)(buf + newnkofs);
@@ -1863,6 +2294,8 @@ int set_val_type(struct hive *hdesc, int vofs, char *path, int exact, int type)
   struct vk_key *vkkey;
   int vkofs;
 
+  if (hive_immutable(hdesc, "set_val_type")) return -1;
+
   vkofs = trav_path(hdesc, vofs,path,exact | TPF_VK);
   if (!vkofs) {
     return -1;
@@ -1871,6 +2304,7 @@ int set_val_type(struct hive *hdesc, int vofs, char *path, int exact, int type)
   vkkey = (struct vk_key *)(hdesc->buffer + vkofs);
 
   vkkey->val_type = type;
+  mark_dirty(hdesc, vkofs, sizeof(struct vk_key));
 
   return(vkkey->val_type);
 }
@@ -2061,6 +2495,7 @@ int fill_block(struct hive *hdesc, int ofs, void *data, int size)
   }
 
   memcpy(hdesc->buffer + ofs + 4, data, size);
+  mark_dirty(hdesc, ofs + 4, size);
   return(0);
 }
 
@@ -2111,8 +2546,10 @@ int free_val_data(struct hive *hdesc, int vkofs)
   } /* inline check */
 
 
+  vkkey = (struct vk_key *)(hdesc->buffer + vkofs);
   vkkey->len_data = 0;
   vkkey->ofs_data = 0;
+  mark_dirty(hdesc, vkofs, sizeof(struct vk_key));
 
   return(vkofs);
 
@@ -2192,6 +2629,7 @@ int alloc_val_data(struct hive *hdesc, int vofs, char *path, int size,int exact)
   /* Link in new datablock */
   if ( !(size & 0x80000000)) vkkey->ofs_data = datablk - 0x1000;
   vkkey->len_data = size;
+  mark_dirty(hdesc, vkofs, sizeof(struct vk_key));
  
   return(datablk + 4);
 }
@@ -2216,7 +2654,7 @@ struct vk_key *add_value(struct hive *hdesc, int nkofs, char *name, int type)
   char *buf;
 
   if (!name || !*name) return(NULL);
-
+  if (hive_immutable(hdesc, "add_value")) return(NULL);
 
   nk = (struct nk_key *)(hdesc->buffer + nkofs);
   if (nk->id != 0x6b6e) {
@@ -2295,6 +2733,7 @@ struct vk_key *add_value(struct hive *hdesc, int nkofs, char *name, int type)
   /* Finally update the key and free the old valuelist */
   nk->no_values++;
   nk->ofs_vallist = newvlist - 0x1000;
+  mark_dirty(hdesc, nkofs, sizeof(struct nk_key));
   if (oldvlist) free_block(hdesc,oldvlist + 0x1000);
 
   if (nlen==len && nlen>0) FREE(buf);
@@ -2336,6 +2775,8 @@ void del_allvalues(struct hive *hdesc, int nkofs)
   int32_t *vlistkey;
   struct nk_key *nk;
 
+  if (hive_immutable(hdesc, "del_allvalues")) return;
+
   nk = (struct nk_key *)(hdesc->buffer + nkofs);
   if (nk->id != 0x6b6e) {
     qf_printf("del_allvalues: Key pointer not to 'nk' node!\n");
@@ -2360,6 +2801,7 @@ void del_allvalues(struct hive *hdesc, int nkofs)
   free_block(hdesc, vlistofs-4);
   nk->ofs_vallist = -1;
   nk->no_values = 0;
+  mark_dirty(hdesc, nkofs, sizeof(struct nk_key));
 }
 
 
@@ -2379,6 +2821,7 @@ int del_value(struct hive *hdesc, int nkofs, char *name, int exact)
   char *blank="";
 
   if (!name || !*name) return(1);
+  if (hive_immutable(hdesc, "del_value")) return(1);
 
   if (!strcmp(name,"@")) name = blank;
 
@@ -2433,6 +2876,7 @@ int del_value(struct hive *hdesc, int nkofs, char *name, int exact)
   } else {
     nk->ofs_vallist = -1;
   }
+  mark_dirty(hdesc, nkofs, sizeof(struct nk_key));
   return(0);
 }
 
@@ -2461,6 +2905,8 @@ struct nk_key *add_key(struct hive *hdesc, int nkofs, char *name)
   struct nk_key *key, *newnk, *onk;
   int32_t hash;
 
+  if (hive_immutable(hdesc, "add_key")) return(NULL);
+
   key = (struct nk_key *)(hdesc->buffer + nkofs);
 
   if (key->id != 0x6b6e) {
@@ -2734,8 +3180,11 @@ struct nk_key *add_key(struct hive *hdesc, int nkofs, char *name)
 
   /* Update parent, and free old lf list */
   key->no_subkeys++;
+  mark_dirty(hdesc, nkofs, sizeof(struct nk_key));
   if (ri) {  /* ri index */
+    ri = (struct ri_key *)(hdesc->buffer + riofs + 0x1004); /* In case buffer moved */
     ri->hash[rislot].ofs_li = (newlf ? newlfofs : newliofs) - 0x1000;
+    mark_dirty(hdesc, riofs + 0x1008 + rislot * 4, 4);
   } else { /* Parent key */
     key->ofs_lf = (newlf ? newlfofs : newliofs) - 0x1000;
   }
@@ -2773,6 +3222,8 @@ int del_key(struct hive *hdesc, int nkofs, char *name)
   char fullpath[501];
   char* buf;
 
+  if (hive_immutable(hdesc, "del_key")) return(1);
+
   key = (struct nk_key *)(hdesc->buffer + nkofs);
 
 #ifdef DKDEBUG
@@ -2987,6 +3438,7 @@ int del_key(struct hive *hdesc, int nkofs, char *name)
 
   /* Update parent */
   key->no_subkeys--;
+  mark_dirty(hdesc, nkofs, sizeof(struct nk_key));
 
   key = (struct nk_key *)(hdesc->buffer + nkofs);
   oldli = (struct li_key *)(hdesc->buffer + oldliofs + 0x1004);
@@ -3034,6 +3486,7 @@ int del_key(struct hive *hdesc, int nkofs, char *name)
       }
     } else {
       ri->hash[rislot].ofs_li = newlfofs - 0x1000; 
+      mark_dirty(hdesc, riofs + 0x1008 + rislot * 4, 4);
     }
   } else {
     key->ofs_lf = newlfofs - 0x1000;
@@ -3060,6 +3513,7 @@ void rdel_keys(struct hive *hdesc, char *path, int vofs)
   
 
   if (!path || !*path) return;
+  if (hive_immutable(hdesc, "rdel_keys")) return;
 
   nkofs = trav_path(hdesc, vofs, path, TPF_NK_EXACT);
 
@@ -3165,7 +3619,7 @@ int put_buf2val(struct hive *hdesc, struct keyval *kv,
   int copylen, blockofs, blocksize, restlen, point, i, list, parts;
 
   if (!kv) return(-1);
-
+  if (hive_immutable(hdesc, "put_buf2val")) return(-1);
 
   l = get_val_len(hdesc, vofs, path, exact);
   if (l == -1) return(-2);  /* error */
@@ -3218,6 +3672,7 @@ int put_buf2val(struct hive *hdesc, struct keyval *kv,
     }
   } else {
     memcpy(keydataptr, &kv->data, kv->len);
+    mark_dirty(hdesc, (char *)keydataptr - hdesc->buffer, kv->len);
   }
   
   hdesc->state |= HMODE_DIRTY;
@@ -4193,6 +4648,15 @@ void closeHive(struct hive *hdesc)
     close(hdesc->filedesc);
   }
   FREE(hdesc->filename);
+  fc_free_all(hdesc->freecells);
+  FREE(hdesc->bins);
+  FREE(hdesc->dirtymap);
+#ifdef NTREG_HAVE_MMAP
+  if (hdesc->mapsize) {
+    munmap(hdesc->buffer, hdesc->mapsize);
+    hdesc->buffer = NULL;
+  }
+#endif
   FREE(hdesc->buffer);
   FREE(hdesc);
 
@@ -4204,100 +4668,1149 @@ void closeHive(struct hive *hdesc)
  * returns checksum value, 32 bit int
  */
 
-int32_t calc_regfsum(struct hive *hdesc)
+static int32_t regf_sum(char *buf)
 {
   int32_t checksum = 0;
-  struct regf_header *hdr;
   int i;
 
-  hdr = (struct regf_header *) hdesc->buffer;
-
   for (i = 0; i < 0x1fc/4; ++i)
-    checksum ^= ((int32_t *) hdr)[i];
+    checksum ^= ((int32_t *) buf)[i];
 
   return(checksum);
+}
 
+int32_t calc_regfsum(struct hive *hdesc)
+{
+  return(regf_sum(hdesc->buffer));
 }
 
 
 
-/* Write the hive back to disk (only if dirty & not readonly) */
+#define WH_CHUNK 0x100000   /* Write size, hbins are page sized so chunks stay aligned */
+#define WH_PARTIAL 4        /* Write logged pages in place while they are up to 1/4 of hive */
 
-int writeHive(struct hive *hdesc)
-{
-  int len;
-  struct regf_header *hdr;
+/* Write whole buffer to file, in large chunks, retrying short writes
+ * returns: 0 - ok, 1 - failed, errno is set
+ */
 
-  if (hdesc->state & HMODE_RO) return(0);
-  if ( !(hdesc->state & HMODE_DIRTY)) return(0);
+static int write_all(int fd, char *buf, int size)
+{
+  int done = 0, len, r;
+
+  while (done < size) {
+    len = size - done;
+    if (len > WH_CHUNK) len = WH_CHUNK;
+    r = write(fd, buf + done, len);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return(1);
+    done += r;
+  }
+  return(0);
+}
 
-  if ( !(hdesc->state & HMODE_OPEN)) { /* File has been closed */
-    if (!(hdesc->filedesc = open(hdesc->filename,O_RDWR))) {
-      qf_printf("writeHive: open(%s) failed: %s, FILE NOT WRITTEN!\n",hdesc->filename,strerror(errno));
-      return(1);
-    }
-    hdesc->state |= HMODE_OPEN;
-  }  
-  /* Seek back to begginning of file (in case it's already open) */
-  lseek(hdesc->filedesc, 0, SEEK_SET);
+/* Write changed pages of the hive in place, see mark_dirty()
+ * Sequence numbers in header differ while pages are written, the same way
+ * Windows marks a hive in update, so a torn write is seen on next load.
+ * It can only be completed from a log, so the pages must be logged first.
+ * returns: 0 - ok, 1 - failed, errno is set
+ */
 
-  /* compute new checksum */
+static int write_pages(struct hive *hdesc)
+{
+  struct regf_header *hdr;
+  int fd, i, run;
 
+  fd = hdesc->filedesc;
   hdr = (struct regf_header *) hdesc->buffer;
 
+  hdr->unknown1++;
   hdr->checksum = calc_regfsum(hdesc);
-
-
-  len = write(hdesc->filedesc, hdesc->buffer, hdesc->size);
-  if (len != hdesc->size) {
-    qf_printf("writeHive: write of %s failed: %s.\n",hdesc->filename,strerror(errno));
-    return(1);
+  if (lseek(fd, 0, SEEK_SET) < 0 || write_all(fd, hdesc->buffer, HBIN_PAGESIZE) || fsync(fd)) return(1);
+  hdesc->lastwrite = HBIN_PAGESIZE;
+
+  for (i = 1; i < hdesc->dirtysize; i += run) {
+    for (run = 0; i + run < hdesc->dirtysize && hdesc->dirtymap[i + run]; run++) ;
+    if (!run) {
+      run = 1;
+      continue;
+    }
+    if (lseek(fd, (off_t)i * HBIN_PAGESIZE, SEEK_SET) < 0 ||
+	write_all(fd, hdesc->buffer + i * HBIN_PAGESIZE, run * HBIN_PAGESIZE)) return(1);
+    hdesc->lastwrite += run * HBIN_PAGESIZE;
   }
+  if (fsync(fd)) return(1);
+
+  hdr->unknown2 = hdr->unknown1;
+  hdr->checksum = calc_regfsum(hdesc);
+  if (lseek(fd, 0, SEEK_SET) < 0 || write_all(fd, hdesc->buffer, HBIN_PAGESIZE) || fsync(fd)) return(1);
+  hdesc->lastwrite += HBIN_PAGESIZE;
 
-  hdesc->state &= (~HMODE_DIRTY);
   return(0);
 }
 
-#undef LOAD_DEBUG
+#ifndef _WIN32
 
-struct hive *openHive(char *filename, int mode)
+/* Flush directory of a file, so a new or renamed file in it survives a crash
+ * Not all filesystems allow that, so failure is ignored
+ */
+
+static void sync_dir(char *filename)
 {
+  char *dir, *slash;
+  int fd;
+
+  dir = str_dup(filename);
+  slash = strrchr(dir, '/');
+  if (slash == dir) slash[1] = 0;
+  else if (slash) *slash = 0;
+  else strcpy(dir, ".");
+
+  fd = open(dir, O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  FREE(dir);
+}
 
-  struct hive *hdesc;
-  int fmode,r,vofs;
-  struct stat sbuf;
-  uint32_t pofs;
-  int32_t checksum;
-  char *c;
-  int rt;
-  struct hbin_page *p;
-  struct regf_header *hdr;
-  struct nk_key *nk;
-  struct ri_key *rikey;
+#endif
 
-  int verbose = (mode & HMODE_VERBOSE);
-  int trace   = (mode & HMODE_TRACE) ? 1 : 0;
-  int info    = (mode & HMODE_INFO);
+/* ================================================================ */
+/* Transaction logs */
 
-  if (!filename || !*filename) return(NULL);
+/* Windows writes changes to <hive>.LOG1 or .LOG2 before the hive itself.
+ * If that is interrupted, sequence numbers in the hive header differ and
+ * the dirty pages are taken from the log on next load. Each log starts
+ * with a 512 byte copy of the header, then come HvLE entries (Windows 8.1
+ * and newer), or a DIRT bitmap of 512 byte sectors with the sectors.
+ */
 
-  CREATE(hdesc,struct hive,1);
+#define LOG_SECTOR 0x200                   /* Header copy and entries are multiples of this */
+#define LOG_NEWFORMAT 6                    /* File type in header of log with HvLE entries */
+#define LOG_SEED 0x82EF4D887A4E55C5ULL     /* Marvin32 seed of log entry hashes */
 
-  hdesc->filename = str_dup(filename);
-  hdesc->state = 0;
-  hdesc->size = 0;
-  hdesc->buffer = NULL;
+#define ROTL32(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define MARVIN_ROUND(lo,hi) { \
+    hi ^= lo; lo = ROTL32(lo,20); lo += hi; hi = ROTL32(hi,9); \
+    hi ^= lo; lo = ROTL32(lo,27); lo += hi; hi = ROTL32(hi,19); \
+  }
 
-  if ( (mode & HMODE_RO) ) {
-    fmode = O_RDONLY;
-  } else {
-    fmode = O_RDWR;
+/* Marvin32 hash of a buffer, seeded as for log entries
+ * returns: 64 bit hash
+ */
+
+static uint64_t marvin32(unsigned char *data, int len)
+{
+  uint32_t lo = (uint32_t)LOG_SEED, hi = (uint32_t)(LOG_SEED >> 32), w;
+
+  for (; len >= 4; data += 4, len -= 4) {
+    lo += data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+    MARVIN_ROUND(lo,hi);
   }
 
-  /* Some non-unix platforms may need this. Thanks to Dan Schmidt */
-#ifdef O_BINARY
-  fmode |= O_BINARY;
-#endif
+  switch (len) {  /* Tail is padded with 0x80 */
+  case 0:  w = 0x80; break;
+  case 1:  w = 0x8000 | data[0]; break;
+  case 2:  w = 0x800000 | data[0] | data[1] << 8; break;
+  default: w = 0x80000000u | data[0] | data[1] << 8 | data[2] << 16; break;
+  }
+  lo += w;
+  MARVIN_ROUND(lo,hi);
+  MARVIN_ROUND(lo,hi);
+
+  return(((uint64_t)hi << 32) | lo);
+}
+
+/* Make name of log file
+ * ext - extension to add to hive filename
+ * returns: allocated string
+ */
+
+static char *log_name(struct hive *hdesc, char *ext)
+{
+  char *name;
+
+  name = malloc(strlen(hdesc->filename) + strlen(ext) + 1);
+  if (!name) {
+    perror("malloc failure");
+    abort();
+  }
+  sprintf(name, "%s%s", hdesc->filename, ext);
+  return(name);
+}
+
+/* Read whole log file of hive
+ * ext - extension of log, like ".LOG1"
+ * len - gets size of log
+ * returns: buffer with log, NULL if there is no log with valid header
+ */
+
+static char *read_log(struct hive *hdesc, char *ext, int *len)
+{
+  struct regf_header *hdr;
+  struct stat sbuf;
+  char *name, *buf;
+  int fd, r, rt = 0, fmode = O_RDONLY;
+
+#ifdef O_BINARY
+  fmode |= O_BINARY;
+#endif
+
+  name = log_name(hdesc, ext);
+  fd = open(name, fmode);
+  FREE(name);
+  if (fd < 0) return(NULL);
+
+  if (fstat(fd, &sbuf) || sbuf.st_size < LOG_SECTOR || sbuf.st_size > 0x7ffff000) {
+    close(fd);
+    return(NULL);
+  }
+
+  ALLOC(buf, 1, sbuf.st_size);
+  do {
+    r = read(fd, buf + rt, sbuf.st_size - rt);
+    if (r > 0) rt += r;
+  } while (r > 0 && rt < sbuf.st_size);
+  close(fd);
+
+  hdr = (struct regf_header *)buf;
+  if (rt < sbuf.st_size || hdr->id != 0x66676572 || regf_sum(buf) != hdr->checksum) {
+    FREE(buf);
+    return(NULL);
+  }
+
+  *len = rt;
+  return(buf);
+}
+
+/* Check hive bins size set in a log, before anything is replayed
+ * It must be whole hbin pages, and the hive can't grow by more than the log
+ * holds, since new hbins are logged like other changed pages.
+ * len - size of the log file
+ * returns: 1 - ok, 0 - bogus size
+ */
+
+static int log_binsize_ok(struct hive *hdesc, int binsize, int len)
+{
+  if (binsize <= 0 || binsize % HBIN_PAGESIZE || binsize > INT_MAX - 0x1000) return(0);
+  return(binsize - (hdesc->size - 0x1000) <= len);
+}
+
+/* Make room for hive bins data of given size, as set in a log
+ * Called once a log entry is checked, just before its data is copied, so a
+ * read-only mapping is moved to heap only when something gets recovered.
+ */
+
+static void log_binsize(struct hive *hdesc, int binsize)
+{
+  int oldsize = hdesc->size;
+
+  if (binsize <= hdesc->size - 0x1000) {
+    /* Read-only mapping can't be changed in place */
+    if (hdesc->mapsize && (hdesc->state & HMODE_RO)) grow_buffer(hdesc, hdesc->size);
+    return;
+  }
+  grow_buffer(hdesc, binsize + 0x1000);
+  mark_dirty(hdesc, oldsize, hdesc->size - oldsize);
+}
+
+/* Apply HvLE entries of a log, skipping those already in the hive
+ * log    - whole log file
+ * len    - its size
+ * minseq - first sequence number not in hive
+ * binsize - gets hive bins size of last applied entry
+ * returns: sequence number of last applied entry, -1 if none
+ */
+
+static int apply_log_entries(struct hive *hdesc, char *log, int len, int minseq, int *binsize)
+{
+  struct log_entry *e;
+  int ofs, i, data, last = -1;
+
+  for (ofs = LOG_SECTOR; ofs + (int)sizeof(struct log_entry) <= len; ofs += e->size) {
+    e = (struct log_entry *)(log + ofs);
+
+    if (e->id != 0x454c7648 || e->size < (int)sizeof(struct log_entry) || e->size % LOG_SECTOR ||
+	e->size > len - ofs || e->pages < 0 || e->pages > (e->size - 0x28) / 8 ||
+	!log_binsize_ok(hdesc, e->binsize, len)) break;
+    if (e->hash2 != marvin32((unsigned char *)e, 0x20) ||
+	e->hash1 != marvin32((unsigned char *)e + 0x28, e->size - 0x28)) break;
+
+    if (last == -1 && e->seq < minseq) continue;  /* Already written to hive */
+    if (last != -1 && e->seq != last + 1) break;   /* Rest is from older flushes */
+
+    /* Check whole entry before changing anything */
+    data = 0x28 + 8 * e->pages;
+    for (i = 0; i < e->pages; i++) {
+      if (e->page[i].ofs < 0 || e->page[i].size <= 0 || e->page[i].size > e->size - data ||
+	  e->page[i].ofs > e->binsize - e->page[i].size) break;
+      data += e->page[i].size;
+    }
+    if (i < e->pages) break;
+
+    log_binsize(hdesc, e->binsize);
+    data = 0x28 + 8 * e->pages;
+    for (i = 0; i < e->pages; i++) {
+      memcpy(hdesc->buffer + 0x1000 + e->page[i].ofs, (char *)e + data, e->page[i].size);
+      mark_dirty(hdesc, 0x1000 + e->page[i].ofs, e->page[i].size);
+      hdesc->recovered += e->page[i].size;
+      data += e->page[i].size;
+    }
+    *binsize = e->binsize;
+    last = e->seq;
+  }
+  return(last);
+}
+
+/* Apply DIRT bitmap log of older Windows versions
+ * Such log is written whole before the hive, it's valid when sequence
+ * numbers in its header match.
+ * returns: sequence number of log, -1 if not applied
+ */
+
+static int apply_log_dirt(struct hive *hdesc, char *log, int len, int minseq, int *binsize)
+{
+  struct regf_header *lhdr = (struct regf_header *)log;
+  unsigned char *bitmap;
+  int bits, data, i;
+
+  if (lhdr->unknown1 != lhdr->unknown2 || lhdr->unknown2 < minseq) return(-1);
+  if (len < LOG_SECTOR + 4 || get_int(log + LOG_SECTOR) != 0x54524944) return(-1);  /* DIRT */
+  if (!log_binsize_ok(hdesc, lhdr->filesize, len)) return(-1);
+
+  bits = lhdr->filesize / LOG_SECTOR;
+  bitmap = (unsigned char *)log + LOG_SECTOR + 4;
+  data = (LOG_SECTOR + 4 + bits / 8 + LOG_SECTOR - 1) & ~(LOG_SECTOR - 1);
+  if (data > len) return(-1);
+
+  for (i = 0; i < bits; i++) {  /* Check that all sectors are there */
+    if (bitmap[i / 8] & (1 << (i % 8))) data += LOG_SECTOR;
+  }
+  if (data > len) return(-1);
+
+  log_binsize(hdesc, lhdr->filesize);
+  data = (LOG_SECTOR + 4 + bits / 8 + LOG_SECTOR - 1) & ~(LOG_SECTOR - 1);
+  for (i = 0; i < bits; i++) {
+    if (bitmap[i / 8] & (1 << (i % 8))) {
+      memcpy(hdesc->buffer + 0x1000 + i * LOG_SECTOR, log + data, LOG_SECTOR);
+      mark_dirty(hdesc, 0x1000 + i * LOG_SECTOR, LOG_SECTOR);
+      hdesc->recovered += LOG_SECTOR;
+      data += LOG_SECTOR;
+    }
+  }
+  *binsize = lhdr->filesize;
+  return(lhdr->unknown2);
+}
+
+/* Recover hive from its transaction logs, for use when hive header shows
+ * an interrupted write. The log with newest header is tried first.
+ * Recovered pages are marked dirty, saving the hive makes the file
+ * consistent again.
+ * returns: bytes recovered, 0 if no log could be used
+ */
+
+int replay_logs(struct hive *hdesc)
+{
+  static char *exts[] = { ".LOG1", ".LOG2", ".log1", ".log2" };
+  struct regf_header *hdr, *lhdr;
+  char *log[4];
+  int len[4], i, best, last = -1, binsize = 0, minseq;
+
+  hdr = (struct regf_header *)hdesc->buffer;
+  minseq = hdr->unknown2;  /* Last sequence number known to be complete */
+
+  for (i = 0; i < 4; i++) log[i] = read_log(hdesc, exts[i], &len[i]);
+  if (log[0]) FREE(log[2]);  /* Same file on case insensitive filesystems */
+  if (log[1]) FREE(log[3]);
+
+  while (last == -1) {
+    best = -1;
+    for (i = 0; i < 4; i++) {
+      if (log[i] && (best == -1 || ((struct regf_header *)log[i])->unknown2 > ((struct regf_header *)log[best])->unknown2))
+	best = i;
+    }
+    if (best == -1) break;
+
+    lhdr = (struct regf_header *)log[best];
+    if (lhdr->unknown5 == LOG_NEWFORMAT) last = apply_log_entries(hdesc, log[best], len[best], minseq, &binsize);
+    else last = apply_log_dirt(hdesc, log[best], len[best], minseq, &binsize);
+
+    if (last != -1) {
+      /* Header from log is the one matching recovered data */
+      hdr = (struct regf_header *)hdesc->buffer;
+      memcpy(hdr, lhdr, 0x1fc);
+      hdr->unknown1 = last;
+      hdr->unknown2 = last;
+      hdr->unknown5 = 0;   /* Primary file */
+      hdr->filesize = binsize;
+      hdr->checksum = calc_regfsum(hdesc);
+      mark_dirty(hdesc, 0, sizeof(struct regf_header));
+      qf_printf("replay_logs: %s: recovered %d bytes from %s%s\n",hdesc->filename,hdesc->recovered,hdesc->filename,exts[best]);
+    }
+    FREE(log[best]);
+  }
+
+  for (i = 0; i < 4; i++) FREE(log[i]);
+  return(hdesc->recovered);
+}
+
+/* Put changed pages to <filename>.LOG1 as one log entry, before
+ * write_pages() writes them to hive, so an interrupted write can be
+ * completed by replay_logs(). The entry gets sequence number the hive
+ * header will have during the write.
+ * returns: 0 - ok, 1 - failed, errno is set
+ */
+
+static int write_log(struct hive *hdesc)
+{
+  struct regf_header *hdr, *lhdr;
+  struct log_entry *e;
+  char *buf, *name;
+  int i, run, runs = 0, pages = 0, size, data, fd, bins, res;
+  int fmode = O_WRONLY | O_CREAT | O_TRUNC;
+
+#ifdef O_BINARY
+  fmode |= O_BINARY;
+#endif
+
+  hdr = (struct regf_header *)hdesc->buffer;
+
+  /* Padding after last hbin is not logged, it's zeroes anyway */
+  bins = (hdr->filesize + 0x1000) / HBIN_PAGESIZE;
+  if (bins > hdesc->dirtysize) bins = hdesc->dirtysize;
+
+  for (i = 1; i < bins; i += run) {
+    for (run = 0; i + run < bins && hdesc->dirtymap[i + run]; run++) ;
+    if (!run) {
+      run = 1;
+      continue;
+    }
+    runs++;
+    pages += run;
+  }
+
+  size = (0x28 + 8 * runs + pages * HBIN_PAGESIZE + LOG_SECTOR - 1) & ~(LOG_SECTOR - 1);
+  ALLOC(buf, 1, LOG_SECTOR + size);
+
+  memcpy(buf, hdesc->buffer, LOG_SECTOR);
+  lhdr = (struct regf_header *)buf;
+  lhdr->unknown1 = hdr->unknown1 + 1;
+  lhdr->unknown2 = hdr->unknown1 + 1;
+  lhdr->unknown5 = LOG_NEWFORMAT;
+  lhdr->checksum = regf_sum(buf);
+
+  e = (struct log_entry *)(buf + LOG_SECTOR);
+  e->id = 0x454c7648;  /* HvLE */
+  e->size = size;
+  e->seq = hdr->unknown1 + 1;
+  e->binsize = hdr->filesize;
+  e->pages = runs;
+
+  data = 0x28 + 8 * runs;
+  runs = 0;
+  for (i = 1; i < bins; i += run) {
+    for (run = 0; i + run < bins && hdesc->dirtymap[i + run]; run++) ;
+    if (!run) {
+      run = 1;
+      continue;
+    }
+    e->page[runs].ofs = i * HBIN_PAGESIZE - 0x1000;
+    e->page[runs].size = run * HBIN_PAGESIZE;
+    memcpy((char *)e + data, hdesc->buffer + i * HBIN_PAGESIZE, run * HBIN_PAGESIZE);
+    data += run * HBIN_PAGESIZE;
+    runs++;
+  }
+
+  e->hash1 = marvin32((unsigned char *)e + 0x28, size - 0x28);
+  e->hash2 = marvin32((unsigned char *)e, 0x20);
+
+  name = log_name(hdesc, ".LOG1");
+  fd = open(name, fmode, 0644);
+  if (fd < 0) {
+    FREE(name);
+    FREE(buf);
+    return(1);
+  }
+
+  res = (write_all(fd, buf, LOG_SECTOR + size) || fsync(fd));
+  close(fd);
+#ifndef _WIN32
+  if (!res) sync_dir(name);
+#endif
+  FREE(name);
+  FREE(buf);
+  return(res);
+}
+
+/* Write the hive back to disk (only if dirty & not readonly)
+ * The image goes to a temporary file next to the hive, which is synced
+ * and then renamed over the hive, so a crash leaves either the old or the
+ * new file, never a mix. With HMODE_BACKUP the previous file is kept as
+ * <filename>.bak. Windows can't rename over open files, there the hive is
+ * still overwritten in place.
+ * With HMODE_LOGSAVE and only a few pages changed, the pages are put to
+ * <filename>.LOG1 and then written in place by write_pages(). If writing
+ * the log fails, the whole image is saved as above.
+ * returns: 0 - ok or nothing to do, 1 - failed, file unchanged or
+ *          recoverable from log
+ */
+
+int writeHive(struct hive *hdesc)
+{
+  struct regf_header *hdr;
+  int fmode = O_RDWR;
+#ifndef _WIN32
+  struct stat sbuf;
+  char *tmpname, *bakname;
+  int fd;
+#endif
+
+  if (hdesc->state & HMODE_RO) return(0);
+  if ( !(hdesc->state & HMODE_DIRTY)) return(0);
+
+#ifdef O_BINARY
+  fmode |= O_BINARY;
+#endif
+
+  /* With the changes in log, a few pages may be written in place */
+  if ((hdesc->state & HMODE_LOGSAVE) && (hdesc->state & HMODE_OPEN) && !(hdesc->state & HMODE_BACKUP) &&
+      hdesc->dirtypages && hdesc->dirtypages <= hdesc->dirtysize / WH_PARTIAL) {
+    if (write_log(hdesc)) {
+      qf_printf("writeHive: can't write log of %s: %s, writing whole file\n",hdesc->filename,strerror(errno));
+    } else {
+      if (write_pages(hdesc)) {
+	qf_printf("writeHive: write of %s failed: %s, it is recovered from log on next open\n",hdesc->filename,strerror(errno));
+	return(1);
+      }
+      memset(hdesc->dirtymap, 0, hdesc->dirtysize);
+      hdesc->dirtypages = 0;
+      hdesc->state &= (~HMODE_DIRTY);
+      return(0);
+    }
+  }
+
+  /* compute new checksum */
+
+  hdr = (struct regf_header *) hdesc->buffer;
+
+  hdr->checksum = calc_regfsum(hdesc);
+
+#ifdef _WIN32
+
+  if ( !(hdesc->state & HMODE_OPEN)) { /* File has been closed */
+    if ((hdesc->filedesc = open(hdesc->filename,fmode)) < 0) {
+      qf_printf("writeHive: open(%s) failed: %s, FILE NOT WRITTEN!\n",hdesc->filename,strerror(errno));
+      return(1);
+    }
+    hdesc->state |= HMODE_OPEN;
+  }
+  /* Seek back to begginning of file (in case it's already open) */
+  lseek(hdesc->filedesc, 0, SEEK_SET);
+
+  if (write_all(hdesc->filedesc, hdesc->buffer, hdesc->size)) {
+    qf_printf("writeHive: write of %s failed: %s.\n",hdesc->filename,strerror(errno));
+    return(1);
+  }
+
+#else
+
+  tmpname = malloc(strlen(hdesc->filename) + 12);
+  bakname = malloc(strlen(hdesc->filename) + 5);
+  if (!tmpname || !bakname) {
+    perror("malloc failure");
+    abort();
+  }
+  sprintf(tmpname, "%s.tmpXXXXXX", hdesc->filename);
+  sprintf(bakname, "%s.bak", hdesc->filename);
+
+  fd = mkstemp(tmpname);
+  if (fd < 0) {
+    qf_printf("writeHive: can't create %s: %s, FILE NOT WRITTEN!\n",tmpname,strerror(errno));
+    FREE(tmpname);
+    FREE(bakname);
+    return(1);
+  }
+
+  /* Keep permissions and owner of the hive */
+  if (!stat(hdesc->filename, &sbuf)) {
+    fchmod(fd, sbuf.st_mode & 07777);
+    if (fchown(fd, sbuf.st_uid, sbuf.st_gid)) { /* Only root may give files away */ }
+  }
+
+  if (write_all(fd, hdesc->buffer, hdesc->size) || fsync(fd)) {
+    qf_printf("writeHive: write of %s failed: %s.\n",tmpname,strerror(errno));
+    close(fd);
+    unlink(tmpname);
+    FREE(tmpname);
+    FREE(bakname);
+    return(1);
+  }
+
+  /* Link, not rename, so the hive name never goes missing. Where the
+   * filesystem has no hard links, the old file is moved instead */
+  if (hdesc->state & HMODE_BACKUP) {
+    unlink(bakname);
+    if (link(hdesc->filename, bakname) && rename(hdesc->filename, bakname))
+      qf_printf("writeHive: can't keep backup %s: %s\n",bakname,strerror(errno));
+  }
+
+  if (rename(tmpname, hdesc->filename)) {
+    qf_printf("writeHive: rename of %s to %s failed: %s, FILE NOT WRITTEN!\n",tmpname,hdesc->filename,strerror(errno));
+    close(fd);
+    unlink(tmpname);
+    FREE(tmpname);
+    FREE(bakname);
+    return(1);
+  }
+  sync_dir(hdesc->filename);
+
+  /* Old descriptor and mapping still point to the previous file, which
+   * has the same contents as the buffer where not changed since. Keep the
+   * new file open instead, like openHive() does */
+  close(fd);
+  if (hdesc->state & HMODE_OPEN) close(hdesc->filedesc);
+  hdesc->filedesc = open(hdesc->filename, fmode);
+  if (hdesc->filedesc < 0) hdesc->state &= ~HMODE_OPEN;
+  else hdesc->state |= HMODE_OPEN;
+
+  FREE(tmpname);
+  FREE(bakname);
+
+#endif
+
+  hdesc->lastwrite = hdesc->size;
+  if (hdesc->dirtymap) memset(hdesc->dirtymap, 0, hdesc->dirtysize);
+  hdesc->dirtypages = 0;
+  hdesc->state &= (~HMODE_DIRTY);
+  return(0);
+}
+
+
+/* ================================================================ */
+/* Hive compaction */
+
+/* Copies all keys reachable from root into a new image, in depth first
+ * order. Each nk is followed by its class name, value list, every vk with
+ * its data, and its subkey index, so reading a key touches as few pages
+ * as possible. Free and unreferenced blocks are left behind. Subkey
+ * indexes keep their type and hashes, but are sized to their contents.
+ * Security descriptors are copied once, on first use, and chained in
+ * that order with fresh usage counts.
+ */
+
+#define CP_MAXDEPTH 512     /* Deepest key Windows allows, also stops on looped indexes */
+#define CP_MAXBIN  0x40000  /* Don't grow hbins past this, free_block() walks whole hbin */
+
+struct cp_item {
+  int nkofs;     /* Offset of old nk (linkage + 4) */
+  int parent;    /* New parent offset, as stored in ofs_parent */
+  int slot;      /* Where to put new offset of this key in parents index, 0 for root */
+  int depth;
+};
+
+struct cp_state {
+  struct hive *src;
+  char *buf;         /* New image, starts with regf header page */
+  int alloc;         /* Size of buf */
+  int binofs;        /* Current hbin */
+  int end;           /* First unused byte in current hbin */
+  int binend;        /* End of current hbin */
+  int *skmap;        /* Pairs of old/new sk block offset, sorted by old */
+  int *skorder;      /* New sk blocks in order of copying */
+  int sks, skalloc;
+};
+
+/* Size of used block in source hive, 0 if ofs does not point to one */
+
+static int cp_blksize(struct hive *hdesc, int ofs)
+{
+  int end = hdesc->endofs < hdesc->size ? hdesc->endofs : hdesc->size;
+  int size;
+
+  if (ofs < 0x1020 || ofs > end - 8 || (ofs & 7)) return(0);
+  size = -get_int(hdesc->buffer + ofs);
+  if (size < 8 || size > end - ofs) return(0);
+  return(size);
+}
+
+/* Make room for a block of size bytes at end of new image. The current
+ * hbin is grown while it stays small, so big blocks don't leave unused
+ * tails. Otherwise a new hbin is started and the rest of the current one
+ * becomes a free block.
+ */
+
+static void cp_newbin(struct cp_state *c, int size)
+{
+  struct hbin_page *p;
+  int r, grow;
+
+  grow = (size - (c->binend - c->end) + HBIN_PAGESIZE - 1) & ~(HBIN_PAGESIZE - 1);
+  if (c->binend == c->binofs || c->binend - c->binofs + grow > CP_MAXBIN) {
+    grow = 0;
+    r = (size + 0x20 + HBIN_PAGESIZE - 1) & ~(HBIN_PAGESIZE - 1);
+  } else {
+    r = grow;
+  }
+
+  if (c->binend + r > c->alloc) {
+    while (c->binend + r > c->alloc) c->alloc *= 2;
+    c->buf = realloc(c->buf, c->alloc);
+    if (!c->buf) {
+      perror("compact_hive : realloc() ");
+      abort();
+    }
+  }
+  memset(c->buf + c->binend, 0, r);
+
+  if (grow) {
+    c->binend += grow;
+    ((struct hbin_page *)(c->buf + c->binofs))->ofs_next = c->binend - c->binofs;
+    return;
+  }
+
+  if (c->binend > c->end) *(int *)(c->buf + c->end) = c->binend - c->end;
+
+  c->binofs = c->binend;
+  c->binend = c->binofs + r;
+  c->end = c->binofs + 0x20;
+
+  p = (struct hbin_page *)(c->buf + c->binofs);
+  p->id = 0x6E696268;
+  p->ofs_self = c->binofs - 0x1000;
+  p->ofs_next = r;
+}
+
+/* Allocate zeroed block with size bytes of data in new image
+ * returns: offset of block linkage
+ * Buffer may move, pointers into it are invalid after this.
+ */
+
+static int cp_alloc(struct cp_state *c, int size)
+{
+  int blk;
+
+  size += 4;  /* Add linkage */
+  if (size & 7) size += (8 - (size & 7));
+
+  if (c->end + size > c->binend) cp_newbin(c, size);
+
+  blk = c->end;
+  c->end += size;
+  memset(c->buf + blk, 0, size);
+  *(int *)(c->buf + blk) = -size;
+  return(blk);
+}
+
+/* Copy used block ofs of source hive to new image
+ * returns: offset of new block linkage, 0 if ofs is not a used block
+ */
+
+static int cp_block(struct cp_state *c, int ofs)
+{
+  int size = cp_blksize(c->src, ofs);
+  int blk;
+
+  if (!size) {
+    qf_printf("compact_hive: ERROR: no used block at 0x%x\n", ofs);
+    return(0);
+  }
+  blk = cp_alloc(c, size - 4);
+  memcpy(c->buf + blk + 4, c->src->buffer + ofs + 4, size - 4);
+  return(blk);
+}
+
+/* Copy security descriptor once, same old one gives the same new one
+ * ofs - old offset as stored in nk
+ * returns: new offset as stored in nk, 0 on error
+ */
+
+static int cp_sk(struct cp_state *c, int ofs)
+{
+  int lo = 0, hi = c->sks, mid, blk;
+  struct sk_key *sk;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (c->skmap[mid*2] < ofs) lo = mid + 1;
+    else hi = mid;
+  }
+
+  if (lo < c->sks && c->skmap[lo*2] == ofs) {
+    blk = c->skmap[lo*2+1];
+  } else {
+    if (cp_blksize(c->src, ofs + 0x1000) < 4 + (int)sizeof(struct sk_key) - 4
+        || *(short *)(c->src->buffer + ofs + 0x1004) != 0x6b73) {
+      qf_printf("compact_hive: ERROR: not a 'sk' block at 0x%x\n", ofs + 0x1000);
+      return(0);
+    }
+    if (!(blk = cp_block(c, ofs + 0x1000))) return(0);
+
+    if (c->sks == c->skalloc) {
+      c->skalloc = c->skalloc ? c->skalloc * 2 : 64;
+      c->skmap = realloc(c->skmap, c->skalloc * 2 * sizeof(int));
+      c->skorder = realloc(c->skorder, c->skalloc * sizeof(int));
+      if (!c->skmap || !c->skorder) {
+        perror("compact_hive : realloc() ");
+        abort();
+      }
+    }
+    memmove(c->skmap + lo*2 + 2, c->skmap + lo*2, (c->sks - lo) * 2 * sizeof(int));
+    c->skmap[lo*2] = ofs;
+    c->skmap[lo*2+1] = blk;
+    c->skorder[c->sks++] = blk;
+
+    ((struct sk_key *)(c->buf + blk + 4))->no_usage = 0;
+  }
+
+  sk = (struct sk_key *)(c->buf + blk + 4);
+  sk->no_usage++;
+  return(blk - 0x1000);
+}
+
+/* Copy value data, with db indirection for big values
+ * vkblk - new vk block, its ofs_data is changed
+ * returns: 1 - ok, 0 - error
+ */
+
+static int cp_valdata(struct cp_state *c, int vkblk)
+{
+  struct vk_key *vk = (struct vk_key *)(c->buf + vkblk + 4);
+  struct db_key *db;
+  int len = vk->len_data & 0x7fffffff;
+  int dbblk, listblk, listofs, blk, parts, i;
+
+  if (vk->len_data & 0x80000000) return(1);  /* Inline */
+  if (!len) {
+    vk->ofs_data = -1;
+    return(1);
+  }
+
+  if (len <= VAL_DIRECT_LIMIT) {
+    if (!(blk = cp_block(c, vk->ofs_data + 0x1000))) return(0);
+    ((struct vk_key *)(c->buf + vkblk + 4))->ofs_data = blk - 0x1000;
+    return(1);
+  }
+
+  /* Hives older than 1.4 keep big values in one block too */
+  db = (struct db_key *)(c->src->buffer + vk->ofs_data + 0x1004);
+  if (cp_blksize(c->src, vk->ofs_data + 0x1000) < 4 + (int)sizeof(struct db_key) || db->id != 0x6264) {
+    if (!(blk = cp_block(c, vk->ofs_data + 0x1000))) return(0);
+    ((struct vk_key *)(c->buf + vkblk + 4))->ofs_data = blk - 0x1000;
+    return(1);
+  }
+  parts = db->no_part;
+  listofs = db->ofs_data + 0x1000;
+  if (cp_blksize(c->src, listofs) < 4 + 4*parts) {
+    qf_printf("compact_hive: ERROR: bad data block list at 0x%x\n", listofs);
+    return(0);
+  }
+
+  if (!(dbblk = cp_block(c, vk->ofs_data + 0x1000))) return(0);
+  listblk = cp_alloc(c, 4*parts);
+  for (i = 0; i < parts; i++) {
+    if (!(blk = cp_block(c, get_int(c->src->buffer + listofs + 4 + 4*i) + 0x1000))) return(0);
+    *(int *)(c->buf + listblk + 4 + 4*i) = blk - 0x1000;
+  }
+
+  ((struct db_key *)(c->buf + dbblk + 4))->ofs_data = listblk - 0x1000;
+  ((struct vk_key *)(c->buf + vkblk + 4))->ofs_data = dbblk - 0x1000;
+  return(1);
+}
+
+/* Copy value list with all values of a key
+ * nkblk - new nk block, its ofs_vallist is changed
+ * returns: 1 - ok, 0 - error
+ */
+
+static int cp_values(struct cp_state *c, int nkblk)
+{
+  struct nk_key *nk = (struct nk_key *)(c->buf + nkblk + 4);
+  int count = nk->no_values;
+  int listofs = nk->ofs_vallist + 0x1000;
+  int listblk, vkofs, vkblk, i;
+
+  if (count <= 0) {
+    nk->no_values = 0;
+    nk->ofs_vallist = -1;
+    return(1);
+  }
+
+  if (cp_blksize(c->src, listofs) < 4 + 4*count) {
+    qf_printf("compact_hive: ERROR: bad value list at 0x%x\n", listofs);
+    return(0);
+  }
+
+  listblk = cp_alloc(c, 4*count);
+  for (i = 0; i < count; i++) {
+    vkofs = get_int(c->src->buffer + listofs + 4 + 4*i) + 0x1000;
+    if (cp_blksize(c->src, vkofs) < 4 + (int)sizeof(struct vk_key) - 1
+        || *(short *)(c->src->buffer + vkofs + 4) != 0x6b76) {
+      qf_printf("compact_hive: ERROR: not a 'vk' block at 0x%x\n", vkofs);
+      return(0);
+    }
+    if (!(vkblk = cp_block(c, vkofs))) return(0);
+    if (!cp_valdata(c, vkblk)) return(0);
+    *(int *)(c->buf + listblk + 4 + 4*i) = vkblk - 0x1000;
+  }
+
+  ((struct nk_key *)(c->buf + nkblk + 4))->ofs_vallist = listblk - 0x1000;
+  return(1);
+}
+
+/* Copy one subkey index leaf (lf, lh or li), subkeys are pushed to the
+ * stack with their slots in the new leaf, to be filled when they are copied
+ * returns: new leaf block, 0 on error
+ */
+
+static int cp_leaf(struct cp_state *c, int ofs, int parent, int depth,
+                   struct cp_item **stack, int *top, int *stackalloc)
+{
+  struct li_key *li = (struct li_key *)(c->src->buffer + ofs + 4);
+  int entry = (li->id == 0x696c) ? 4 : 8;
+  int count = li->no_keys;
+  int blk, i;
+
+  if (cp_blksize(c->src, ofs) < 8 + entry*count) {
+    qf_printf("compact_hive: ERROR: bad subkey index at 0x%x\n", ofs);
+    return(0);
+  }
+
+  blk = cp_alloc(c, 4 + entry*count);
+  memcpy(c->buf + blk + 4, c->src->buffer + ofs + 4, 4 + entry*count);
+
+  if (*top + count > *stackalloc) {
+    while (*top + count > *stackalloc) *stackalloc *= 2;
+    *stack = realloc(*stack, *stackalloc * sizeof(struct cp_item));
+    if (!*stack) {
+      perror("compact_hive : realloc() ");
+      abort();
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    (*stack)[*top].nkofs = get_int(c->src->buffer + ofs + 8 + entry*i) + 0x1004;
+    (*stack)[*top].parent = parent;
+    (*stack)[*top].slot = blk + 8 + entry*i;
+    (*stack)[*top].depth = depth;
+    (*top)++;
+  }
+
+  return(blk);
+}
+
+/* Build compacted copy of a hive
+ * hdesc - hive to copy, it is not changed
+ * returns: new hive, in memory only, with filename of the source
+ *          and marked dirty, NULL on error
+ */
+
+struct hive *compact_hive(struct hive *hdesc)
+{
+  struct cp_state c;
+  struct cp_item *stack, item, tmp;
+  struct nk_key *nk;
+  struct regf_header *hdr;
+  struct hive *nh = NULL;
+  struct ri_key *ri;
+  int top, stackalloc, rootblk = 0, nkblk, idxofs, idxblk, leafblk;
+  int count, i, pos, start;
+  short id;
+
+  if (cp_blksize(hdesc, hdesc->rootofs) == 0
+      || ((struct nk_key *)(hdesc->buffer + hdesc->rootofs + 4))->id != 0x6b6e) {
+    qf_printf("compact_hive: ERROR: hive <%s> has no root key\n", hdesc->filename);
+    return(NULL);
+  }
+
+  memset(&c, 0, sizeof(c));
+  c.src = hdesc;
+  c.alloc = hdesc->size > 0x10000 ? hdesc->size : 0x10000;
+  ALLOC(c.buf, 1, c.alloc);
+  memcpy(c.buf, hdesc->buffer, 0x1000);
+  c.binofs = c.end = c.binend = 0x1000;
+
+  stackalloc = 256;
+  CREATE(stack, struct cp_item, stackalloc);
+  stack[0].nkofs = hdesc->rootofs + 4;
+  stack[0].parent = ((struct nk_key *)(hdesc->buffer + hdesc->rootofs + 4))->ofs_parent;
+  stack[0].slot = 0;
+  stack[0].depth = 0;
+  top = 1;
+
+  while (top > 0) {
+    item = stack[--top];
+
+    if (cp_blksize(hdesc, item.nkofs - 4) < 4 + (int)sizeof(struct nk_key) - 1
+        || *(short *)(hdesc->buffer + item.nkofs) != 0x6b6e) {
+      qf_printf("compact_hive: ERROR: not a 'nk' block at 0x%x\n", item.nkofs - 4);
+      goto out;
+    }
+
+    if (!(nkblk = cp_block(&c, item.nkofs - 4))) goto out;
+    if (item.slot) *(int *)(c.buf + item.slot) = nkblk - 0x1000;
+    else rootblk = nkblk;
+
+    nk = (struct nk_key *)(c.buf + nkblk + 4);
+    nk->ofs_parent = item.parent;
+
+    if (nk->ofs_classnam != -1 && nk->len_classnam > 0) {
+      i = cp_block(&c, nk->ofs_classnam + 0x1000);
+      if (!i) goto out;
+      ((struct nk_key *)(c.buf + nkblk + 4))->ofs_classnam = i - 0x1000;
+    } else {
+      nk->ofs_classnam = -1;
+      nk->len_classnam = 0;
+    }
+
+    nk = (struct nk_key *)(c.buf + nkblk + 4);
+    if (nk->ofs_sk != -1) {
+      if (!(i = cp_sk(&c, nk->ofs_sk))) goto out;
+      ((struct nk_key *)(c.buf + nkblk + 4))->ofs_sk = i;
+    }
+
+    if (!cp_values(&c, nkblk)) goto out;
+
+    nk = (struct nk_key *)(c.buf + nkblk + 4);
+    if (nk->no_subkeys <= 0 || nk->ofs_lf == -1) {
+      nk->no_subkeys = 0;
+      nk->ofs_lf = -1;
+      continue;
+    }
+
+    if (item.depth >= CP_MAXDEPTH) {
+      qf_printf("compact_hive: ERROR: keys nested too deep at 0x%x\n", item.nkofs - 4);
+      goto out;
+    }
+
+    idxofs = nk->ofs_lf + 0x1000;
+    if (cp_blksize(hdesc, idxofs) < 8) {
+      qf_printf("compact_hive: ERROR: bad subkey index at 0x%x\n", idxofs);
+      goto out;
+    }
+
+    start = top;
+    id = *(short *)(hdesc->buffer + idxofs + 4);
+
+    if (id == 0x666c || id == 0x686c || id == 0x696c) {
+      if (!(idxblk = cp_leaf(&c, idxofs, nkblk - 0x1000, item.depth + 1, &stack, &top, &stackalloc))) goto out;
+    } else if (id == 0x6972) {
+      ri = (struct ri_key *)(hdesc->buffer + idxofs + 4);
+      count = ri->no_lis;
+      if (cp_blksize(hdesc, idxofs) < 8 + 4*count) {
+        qf_printf("compact_hive: ERROR: bad 'ri' index at 0x%x\n", idxofs);
+        goto out;
+      }
+      idxblk = cp_alloc(&c, 4 + 4*count);
+      *(short *)(c.buf + idxblk + 4) = 0x6972;
+      *(short *)(c.buf + idxblk + 6) = (short)count;
+
+      for (i = 0; i < count; i++) {
+        leafblk = get_int(hdesc->buffer + idxofs + 8 + 4*i) + 0x1000;
+        id = cp_blksize(hdesc, leafblk) >= 8 ? *(short *)(hdesc->buffer + leafblk + 4) : 0;
+        if (id != 0x666c && id != 0x686c && id != 0x696c) {
+          qf_printf("compact_hive: ERROR: bad subkey index at 0x%x\n", leafblk);
+          goto out;
+        }
+        if (!(leafblk = cp_leaf(&c, leafblk, nkblk - 0x1000, item.depth + 1, &stack, &top, &stackalloc))) goto out;
+        *(int *)(c.buf + idxblk + 8 + 4*i) = leafblk - 0x1000;
+      }
+    } else {
+      qf_printf("compact_hive: ERROR: index type not supported: 0x%04x\n", id);
+      goto out;
+    }
+
+    nk = (struct nk_key *)(c.buf + nkblk + 4);
+    nk->ofs_lf = idxblk - 0x1000;
+    nk->no_subkeys = top - start;
+
+    /* First subkey must be popped first */
+    for (i = start, pos = top - 1; i < pos; i++, pos--) {
+      tmp = stack[i];
+      stack[i] = stack[pos];
+      stack[pos] = tmp;
+    }
+  }
+
+  /* Close last hbin and chain the security descriptors */
+  if (c.binend > c.end) *(int *)(c.buf + c.end) = c.binend - c.end;
+
+  for (i = 0; i < c.sks; i++) {
+    ((struct sk_key *)(c.buf + c.skorder[i] + 4))->ofs_prevsk = c.skorder[(i + c.sks - 1) % c.sks] - 0x1000;
+    ((struct sk_key *)(c.buf + c.skorder[i] + 4))->ofs_nextsk = c.skorder[(i + 1) % c.sks] - 0x1000;
+  }
+
+  hdr = (struct regf_header *)c.buf;
+  hdr->unknown2 = hdr->unknown1;  /* Sequence numbers match, nothing to recover */
+  hdr->ofs_rootkey = rootblk - 0x1000;
+  hdr->filesize = c.binend - 0x1000;
+
+  CREATE(nh, struct hive, 1);
+  nh->filename = str_dup(hdesc->filename);
+  nh->filedesc = -1;
+  nh->state = HMODE_DIRTY | (hdesc->state & (HMODE_VERBOSE | HMODE_TRACE | HMODE_INFO));
+  nh->type = hdesc->type;
+  nh->size = c.binend;
+  nh->rootofs = rootblk;
+  nh->lastbin = c.binofs;
+  nh->endofs = c.binend;
+  nh->nkindextype = hdesc->nkindextype;
+  nh->buffer = realloc(c.buf, c.binend);
+  if (!nh->buffer) nh->buffer = c.buf;
+  c.buf = NULL;
+
+  hdr = (struct regf_header *)nh->buffer;
+  hdr->checksum = calc_regfsum(nh);
+
+  VERBF(hdesc, "compact_hive: %d bytes -> %d bytes, %d security descriptors\n", hdesc->size, nh->size, c.sks);
+
+ out:
+  FREE(c.buf);
+  FREE(c.skmap);
+  FREE(c.skorder);
+  FREE(stack);
+  return(nh);
+}
+
+#undef LOAD_DEBUG
+
+struct hive *openHive(char *filename, int mode)
+{
+
+  struct hive *hdesc;
+  int fmode,r;
+  struct stat sbuf;
+  int32_t checksum;
+  char *c;
+  int rt;
+  struct regf_header *hdr;
+  struct nk_key *nk;
+  struct ri_key *rikey;
+  void *map;
+
+  int verbose = (mode & HMODE_VERBOSE);
+  int trace   = (mode & HMODE_TRACE) ? 1 : 0;
+  int info    = (mode & HMODE_INFO);
+
+  if (!filename || !*filename) return(NULL);
+
+  CREATE(hdesc,struct hive,1);
+
+  hdesc->filename = str_dup(filename);
+  hdesc->state = 0;
+  hdesc->size = 0;
+  hdesc->buffer = NULL;
+  hdesc->mapsize = 0;
+
+  if ( (mode & HMODE_RO) ) {
+    fmode = O_RDONLY;
+  } else {
+    fmode = O_RDWR;
+  }
+
+  /* Some non-unix platforms may need this. Thanks to Dan Schmidt */
+#ifdef O_BINARY
+  fmode |= O_BINARY;
+#endif
 
   hdesc->filedesc = open(hdesc->filename,fmode);
   if (hdesc->filedesc < 0) {
@@ -4321,27 +5834,44 @@ struct hive *openHive(char *filename, int mode)
   hdesc->size = sbuf.st_size;
   hdesc->state = mode | HMODE_OPEN;
 
-  /* Read the whole file */
+#ifdef NTREG_HAVE_MMAP
+  /* Map the file, pages will be read on demand from page cache.
+   * Read-only hives share the mapping, writable ones get a private
+   * copy-on-write mapping, so the file itself is changed only by writeHive() */
+  if ( (mode & HMODE_MMAP) && hdesc->size > 0 ) {
+    if (mode & HMODE_RO)
+      map = mmap(NULL, hdesc->size, PROT_READ, MAP_SHARED, hdesc->filedesc, 0);
+    else
+      map = mmap(NULL, hdesc->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, hdesc->filedesc, 0);
+    if (map == MAP_FAILED) {
+      qf_printf("openHive(%s): mmap() failed: %s, reading whole file instead\n",hdesc->filename,strerror(errno));
+    } else {
+      hdesc->buffer = map;
+      hdesc->mapsize = hdesc->size;
+    }
+  }
+#endif
+  if (!hdesc->mapsize) hdesc->state &= ~HMODE_MMAP;
 
-  ALLOC(hdesc->buffer,1,hdesc->size);
+  if (!hdesc->buffer) {
 
-  rt = 0;
-  do {  /* On some platforms read may not block, and read in chunks. handle that */
-    r = read(hdesc->filedesc, hdesc->buffer + rt, hdesc->size - rt);
-    rt += r;
-  } while ( (r>0) && (rt < hdesc->size) );
+    /* Read the whole file */
 
-  if (rt < hdesc->size) {
-    qf_printf("Could not read file, got %d bytes while expecting %d\n",
-	    r, hdesc->size);
-    closeHive(hdesc);
-    return(NULL);
-  }
+    ALLOC(hdesc->buffer,1,hdesc->size);
 
-  /* Now run through file, tallying all pages */
-  /* NOTE/KLUDGE: Assume first page starts at offset 0x1000 */
+    rt = 0;
+    do {  /* On some platforms read may not block, and read in chunks. handle that */
+      r = read(hdesc->filedesc, hdesc->buffer + rt, hdesc->size - rt);
+      rt += r;
+    } while ( (r>0) && (rt < hdesc->size) );
 
-   pofs = 0x1000;
+    if (rt < hdesc->size) {
+      qf_printf("Could not read file, got %d bytes while expecting %d\n",
+	      r, hdesc->size);
+      closeHive(hdesc);
+      return(NULL);
+    }
+  }
 
    hdr = (struct regf_header *)hdesc->buffer;
    if (hdr->id != 0x66676572) {
@@ -4355,8 +5885,15 @@ struct hive *openHive(char *filename, int mode)
    qf_printf("openhive: calculated checksum: %08x\n",checksum);
    qf_printf("openhive: file REGF  checksum: %08x\n",hdr->checksum);
 #endif
-   if (checksum != hdr->checksum) {
-     qf_printf("openHive(%s): WARNING: REGF header checksum mismatch! calc: 0x%08x != file: 0x%08x\n",filename,checksum,hdr->checksum);
+   if (checksum != hdr->checksum || hdr->unknown1 != hdr->unknown2) {  /* Write was interrupted */
+     if (replay_logs(hdesc)) {
+       hdr = (struct regf_header *)hdesc->buffer;
+       if (mode & HMODE_RO) hdesc->state &= ~HMODE_DIRTY;  /* Recovered in memory only */
+     } else if (checksum != hdr->checksum) {
+       qf_printf("openHive(%s): WARNING: REGF header checksum mismatch! calc: 0x%08x != file: 0x%08x\n",filename,checksum,hdr->checksum);
+     } else {
+       qf_printf("openHive(%s): WARNING: hive was not written completely, and there is no log to recover it\n",filename);
+     }
    }
 
    hdesc->rootofs = hdr->ofs_rootkey + 0x1000;
@@ -4394,54 +5931,17 @@ struct hive *openHive(char *filename, int mode)
    }
 
 
-   while (pofs < hdr->filesize + 0x1000) {   /* Loop through hbins until end according to regf header */
-#ifdef LOAD_DEBUG
-     int htrace = 1;
-     //     if (htrace) hexdump(hdesc->buffer,pofs,pofs+0x20,1);
-#endif
-     p = (struct hbin_page *)(hdesc->buffer + pofs);
-     if (p->id != 0x6E696268) {
-       if (info) qf_printf("Page at 0x%x is not 'hbin', assuming file contains garbage at end\n",pofs);
-       break;
-     }
-     hdesc->pages++;
-
-     if (verbose) qf_printf("###### Page at 0x%0x ofs_self 0x%0x, size (delta ofs_next) 0x%0x ######\n",
-			pofs,p->ofs_self,p->ofs_next);
-
-     if (p->ofs_next == 0) {
-       qf_printf("openHive: ERROR: Page at 0x%x has size zero! File may be corrupt, or program has a bug\n",pofs);
-       return(hdesc);
-     }
-
-
-     vofs = pofs + 0x20; /* Skip page header, and run through blocks in hbin */
-
-     while (vofs-pofs < p->ofs_next && vofs < hdesc->size) {
-       vofs += parse_block(hdesc,vofs,trace);
-
-     }
-
-     pofs += p->ofs_next;
-
-   } /* hbin loop */
-
-
    hdesc->endofs  = hdr->filesize + 0x1000;
-   hdesc->lastbin = pofs - p->ofs_next;  /* Compensate for loop that added at end above */
+
+   /* Block statistics are collected on first allocation, walking all hbins
+    * here would touch the whole file. Do it now only if asked to report it */
+   if (info || verbose || trace) hive_scan_bins(hdesc);
 
    if (verbose) {
-     qf_printf("Last HBIN at offset       : 0x%x\n",hdesc->lastbin);
      qf_printf("First non-HBIN page offset: 0x%x\n",hdesc->endofs);
      qf_printf("hdr->unknown4 (version?)  : 0x%x\n",hdr->unknown4);
    }
 
-   if (info || verbose) {
-     qf_printf("File size %d [%x] bytes, containing %d pages (+ 1 headerpage)\n",hdesc->size,hdesc->size, hdesc->pages);
-     qf_printf("Used for data: %d/%d blocks/bytes, unused: %d/%d blocks/bytes.\n\n",
-	    hdesc->useblk,hdesc->usetot,hdesc->unuseblk,hdesc->unusetot);
-   }
-
    /* So, let's guess what kind of hive this is, based on keys in its root */
 
    hdesc->type = HTYPE_UNKNOWN;
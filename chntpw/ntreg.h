@@ -271,6 +271,28 @@ struct nk_key {
   char  keyname[1];     /*  0x004C	????	key-name                               */
 };
 
+/* Transaction log entry, found in <hive>.LOG1 and .LOG2 of Windows 8.1 and
+ * newer after a 512 byte copy of the REGF header, one after another.
+ * Dirty page data follows the page list, in the same order.
+ * Older logs have "DIRT" and a bitmap of 512 byte sectors there instead.
+ */
+struct log_entry {
+
+                        /* Offset	Size	Contents */
+  int32_t id;           /*  0x0000	D-Word	ID: ASCII-"HvLE" = 0x454C7648          */
+  int32_t size;         /*  0x0004	D-Word	Size of entry, multiple of 512         */
+  int32_t flags;        /*  0x0008	D-Word	Copy of header flags                   */
+  int32_t seq;          /*  0x000C	D-Word	Sequence number                        */
+  int32_t binsize;      /*  0x0010	D-Word	Hive bins data size, as REGF filesize  */
+  int32_t pages;        /*  0x0014	D-Word	Number of dirty page references        */
+  uint64_t hash1;       /*  0x0018	Q-Word	Marvin32 of entry from 0x28 on         */
+  uint64_t hash2;       /*  0x0020	Q-Word	Marvin32 of entry up to 0x20           */
+  struct log_page {
+    int32_t ofs;        /*  0x0000	D-Word	Offset from first hbin                 */
+    int32_t size;       /*  0x0004	D-Word	Size, multiple of page size            */
+  } page[1];            /*  0x0028 */
+};
+
 /*********************************************************************************/
 
 /* Structure defines for my routines */
@@ -319,6 +341,9 @@ struct keyvala {
 #define HMODE_NOALLOC   0x8        /* Don't allocate new blocks */
 #define HMODE_NOEXPAND  0x10       /* Don't expand file with new hbin */
 #define HMODE_DIDEXPAND 0x20       /* File has been expanded */
+#define HMODE_MMAP      0x40       /* Map file into memory instead of reading it whole */
+#define HMODE_BACKUP    0x80       /* Keep previous file as .bak on each writeHive() */
+#define HMODE_LOGSAVE   0x100      /* Put changes to .LOG1 before writing them to hive */
 #define HMODE_VERBOSE 0x1000
 #define HMODE_TRACE   0x2000
 #define HMODE_INFO    0x4000       /* Show some info on open and close */
@@ -353,6 +378,17 @@ struct hive {
   int  endofs;           /* Offset of first non HBIN page, we can expand from here */
   short nkindextype;     /* Subkey-indextype the root key uses */
   char *buffer;          /* Files raw contents */
+  int  mapsize;          /* Length of mmap()ed buffer, 0 if buffer is malloc()ed */
+  int  binscan;          /* Block statistics above are collected, see hive_scan_bins() */
+  struct free_cell *freecells; /* Size ordered index of unused blocks, built with statistics */
+  int  *bins;            /* Offsets of all hbins, ascending, count is in pages */
+  int  nearalloc;        /* Allocations placed near a given offset, see alloc_block() */
+  int  crossbin;         /* ... of them that did not fit in the hbin of that offset */
+  unsigned char *dirtymap; /* One byte per page changed since last write, see mark_dirty() */
+  int  dirtysize;        /* Pages covered by dirtymap */
+  int  dirtypages;       /* ... of them changed */
+  int  lastwrite;        /* Bytes written by last writeHive() */
+  int  recovered;        /* Bytes applied from transaction log on open, see replay_logs() */
 };
 
 /***************************************************/
@@ -408,6 +444,7 @@ struct keyval *reg_valcat(struct keyval *a, struct keyval *b);
 
 
 int parse_block(struct hive *hdesc, int vofs,int verbose);
+int hive_scan_bins(struct hive *hdesc);
 int ex_next_n(struct hive *hdesc, int nkofs, int *count, int *countri, struct ex_data *sptr);
 int ex_next_v(struct hive *hdesc, int nkofs, int *count, struct vex_data *sptr);
 int get_abs_path(struct hive *hdesc, int nkofs, char *path, int maxlen);
@@ -425,6 +462,7 @@ int put_dword(struct hive *hdesc, int vofs, char *path, int exact, int dword);
 void export_key(struct hive *hdesc, int nkofs, char *name, char *filename, char *prefix);
 void closeHive(struct hive *hdesc);
 int writeHive(struct hive *hdesc);
+struct hive *compact_hive(struct hive *hdesc);
 struct hive *openHive(char *filename, int mode);
 
 void nk_ls(struct hive *hdesc, char *path, int vofs, int type);
@@ -438,6 +476,9 @@ void rdel_keys(struct hive *hdesc, char *path, int nkofs);
 struct keyval *get_class(struct hive *hdesc, int curnk, char *path);
 
 int add_bin(struct hive *hdesc, int size);
+int hive_immutable(struct hive *hdesc, const char *func);
+void mark_dirty(struct hive *hdesc, int ofs, int len);
+int replay_logs(struct hive *hdesc);
 
 int import_reg(struct hive *hdesc, char *filename, char *prefix);
 
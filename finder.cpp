@@ -1,23 +1,41 @@
-#include <QApplication>
+#include <algorithm>
 #include <QThread>
+#include <QMutexLocker>
+#include <QtEndian>
 #include "finder.h"
+#include "hiveindex.h"
+#include "hiveiterators.h"
+#include "textmatcher.h"
 #include "global.h"
 #include <QDebug>
 
+static const int searchChunkSize = 256; // keys per pool job
+
 CFinder::CFinder(QObject *parent)
     : QObject(parent)
 {
+    qRegisterMetaType<QVector<CFinderMatch> >("QVector<CFinderMatch>");
+    qRegisterMetaType<CFinderQuery>("CFinderQuery");
+
+    m_pool.setMaxThreadCount(QThread::idealThreadCount());
+    m_indexPool.setMaxThreadCount(1);
     hiveChanged(QModelIndex());
 }
 
-CFinder::~CFinder() = default;
+CFinder::~CFinder()
+{
+    m_canceled.storeRelease(1);
+    m_pool.waitForDone();
+    dropIndex(nullptr);
+}
 
-void CFinder::searchText(const QModelIndex &idx, const QString &text)
+bool CFinder::prepareSearch(const QModelIndex &idx, const CFinderQuery &query)
 {
-    if (!idx.isValid() || text.isEmpty()) {
+    CFinderQuery q = query;
+
+    if (!idx.isValid() || !q.prepare()) {
         hiveChanged(QModelIndex());
-        Q_EMIT searchFinished();
-        return;
+        return false;
     }
 
     struct nk_key* k = nullptr;
@@ -25,90 +43,509 @@ void CFinder::searchText(const QModelIndex &idx, const QString &text)
     int hive = 0;
     if (!cgl->reg->keyPrepare(idx.internalPointer(),h,hive,k)) {
         hiveChanged(QModelIndex());
-        Q_EMIT searchFinished();
-        return;
+        return false;
     }
 
-    searchKeysOfsFlat = cgl->reg->listAllKeysOfsFlat(h,k);
-    searchHive = hive;
-    searchLastKeyIdx = -1;
-    searchString = text;
-    m_canceled = false;
+    QList<int> keys = cgl->reg->listAllKeysOfsFlat(h,k);
+    filterByIndex(h, q, keys);
 
-    continueSearch();
+    const QMutexLocker locker(&m_stateLock);
+    stopScan();
+    searchHive = h;
+    m_query = q;
+    startScan(keys);
+
+    return true;
 }
 
-void CFinder::continueSearch()
+void CFinder::searchText(const QModelIndex &idx, const CFinderQuery &query)
 {
-    if (searchKeysOfsFlat.isEmpty() || searchString.isEmpty() || m_canceled) return;
+    if (!prepareSearch(idx, query)) {
+        Q_EMIT searchFinished();
+        return;
+    }
 
-    struct hive *h = cgl->reg->getHivePtr(searchHive);
-    if (h==nullptr) { // OOPS. No more hive. Clean all and exit.
-        hiveChanged(QModelIndex());
+    const QMutexLocker locker(&m_stateLock);
+    m_waitingNext = true;
+    Q_EMIT showProgressDialog();
+    if (m_scanFinished) // nothing to search
+        deliverNext();
+}
+
+void CFinder::findAll(const QModelIndex &idx, const CFinderQuery &query)
+{
+    if (!prepareSearch(idx, query)) {
+        Q_EMIT findAllFinished(0);
         return;
     }
 
+    const QMutexLocker locker(&m_stateLock);
+    if (m_scanFinished) {
+        Q_EMIT findAllFinished(0);
+        return;
+    }
+    m_findAll = true;
     Q_EMIT showProgressDialog();
-    QThread::msleep(250);
+}
 
-    bool iok = false;
-    const quint32 snum = searchString.toUInt(&iok);
+void CFinder::startScan(const QList<int> &keys)
+{
+    // The hive buffer is only read by pool jobs. Any hive modification must call
+    // hiveChanged() first, which stops them.
+    m_scan.reset(new CFinderScan());
+    const int chunks = (keys.count() + searchChunkSize - 1) / searchChunkSize;
+    m_scan->chunks.resize(chunks);
+    m_scan->done.fill(false, chunks);
+    m_scanFinished = (chunks == 0);
 
-    while (true) {
-        searchLastKeyIdx++;
-        if (searchLastKeyIdx>=searchKeysOfsFlat.count()) {
-            searchLastKeyIdx=-1;
-            Q_EMIT hideProgressDialog();
-            Q_EMIT searchFinished();
-            return;
+    const CFinderQuery query = m_query;
+    struct hive *h = searchHive;
+    const QSharedPointer<CFinderScan> scan = m_scan;
+
+    for (int c = 0; c < chunks; c++) {
+        m_pool.start([this, scan, keys, c, h, query]() {
+            const int from = c * searchChunkSize;
+            const int to = qMin(from + searchChunkSize, keys.count());
+            QVector<CFinderMatch> res;
+
+            for (int i = from; i < to; i++) {
+                if (m_canceled.loadAcquire() != 0)
+                    return;
+
+                CFinderMatch m;
+                if (matchKey(h, keys.at(i), query, m)) {
+                    m.keyOfs = keys.at(i);
+                    res.append(m);
+                }
+            }
+
+            {
+                const QMutexLocker locker(&scan->lock);
+                scan->chunks[c] = res;
+                scan->done[c] = true;
+            }
+
+            QMetaObject::invokeMethod(this, [this, scan]() {
+                collectResults(scan);
+            }, Qt::QueuedConnection);
+        });
+    }
+}
+
+void CFinder::stopScan()
+{
+    m_canceled.storeRelease(1);
+    m_pool.waitForDone();
+    m_canceled.storeRelease(0);
+
+    m_scan.clear();
+    m_results.clear();
+    m_resultIdx = -1;
+    m_scanFinished = true;
+    m_waitingNext = false;
+    m_findAll = false;
+
+    Q_EMIT searchReset();
+}
+
+void CFinder::collectResults(const QSharedPointer<CFinderScan> &scan)
+{
+    const QMutexLocker locker(&m_stateLock);
+
+    if (scan != m_scan) return; // stale job from canceled search
+
+    const int prevCount = m_results.count();
+
+    {
+        // Append finished chunks in key order, stop on first pending one
+        const QMutexLocker scanLocker(&scan->lock);
+        while (scan->collected < scan->chunks.count() && scan->done.at(scan->collected)) {
+            m_results.append(scan->chunks.at(scan->collected));
+            scan->chunks[scan->collected].clear();
+            scan->collected++;
         }
+        m_scanFinished = (scan->collected == scan->chunks.count());
+        Q_EMIT searchProgress(scan->collected, scan->chunks.count());
+    }
 
-        struct nk_key *k = cgl->reg->getKeyPtr(h,searchKeysOfsFlat.at(searchLastKeyIdx));
-        if (cgl->reg->getKeyName(h,k).contains(searchString,Qt::CaseInsensitive)) {
+    if (m_findAll) {
+        if (m_results.count() > prevCount) {
+            Q_EMIT matchesFound(reinterpret_cast<quintptr>(searchHive),
+                                m_results.mid(prevCount));
+        }
+        if (m_scanFinished) {
+            m_findAll = false;
             Q_EMIT hideProgressDialog();
-            Q_EMIT keyFound(reinterpret_cast<quintptr>(h),
-                            reinterpret_cast<quintptr>(k), QString());
-            return;
+            Q_EMIT findAllFinished(m_results.count());
         }
+    }
 
-        const QList<CValue> vl = cgl->reg->listValues(h, k);
-        for(const auto &v : vl) {
-            if (v.name.contains(searchString,Qt::CaseInsensitive) ||
-                    v.vString.contains(searchString,Qt::CaseInsensitive) ||
-                    v.vOther.contains(searchString.toUtf8()) ||
-                    ((v.type==REG_DWORD)&&iok&&(v.vDWORD==snum)))
-            {
-                Q_EMIT hideProgressDialog();
-                Q_EMIT keyFound(reinterpret_cast<quintptr>(h),
-                                reinterpret_cast<quintptr>(k), v.name);
-                return;
-            }
+    if (m_waitingNext)
+        deliverNext();
+}
+
+void CFinder::deliverNext()
+{
+    if (m_resultIdx + 1 < m_results.count()) {
+        m_resultIdx++;
+        m_waitingNext = false;
+        const CFinderMatch &m = m_results.at(m_resultIdx);
+        Q_EMIT hideProgressDialog();
+        Q_EMIT keyFound(reinterpret_cast<quintptr>(searchHive),
+                        reinterpret_cast<quintptr>(cgl->reg->getKeyPtr(searchHive, m.keyOfs)), m.value);
+        return;
+    }
+
+    if (m_scanFinished) {
+        // Wrap around on next call, like before
+        m_resultIdx = -1;
+        m_waitingNext = false;
+        Q_EMIT hideProgressDialog();
+        Q_EMIT searchFinished();
+    }
+}
+
+/* Matches raw names and data in hive buffer, without decoding values.
+ * Key filters go first, since they are cheap and skip the value list. */
+bool CFinder::matchKey(struct hive *h, int keyOfs, const CFinderQuery &query, CFinderMatch &match)
+{
+    const CSubkeyView key(h, keyOfs);
+
+    if (!query.matchKey(h, key.key()))
+        return false;
+
+    if (!query.hasValueFilter()) {
+        // Root key is shown with hive prefix
+        const bool keyMatch = query.text.isEmpty() ||
+                              (keyOfs == (h->rootofs + 4) ? query.matchName(cgl->reg->getKeyName(h, key.key()))
+                                                          : query.matchName(key.name()));
+        if (keyMatch) {
+            match.column = CFinderMatch::KeyName;
+            match.value.clear();
+            return true;
+        }
+    }
+
+    QByteArray buf;
+    for (const CValueView &vv : CValueRange(h, key.key())) {
+        const struct vex_data vex = vv.toVex();
+
+        if (!query.matchValue(vex))
+            continue;
+
+        const CHiveName name = vv.name();
+        match.value = (name.isEmpty() ? QSL("@") : name.toString());
+
+        if (query.text.isEmpty()) {
+            match.column = CFinderMatch::ValueData;
+            return true;
         }
 
-        QApplication::processEvents();
-        if (m_canceled)
-            break;
+        if (name.isEmpty() ? query.matchName(match.value) : query.matchName(name)) {
+            match.column = CFinderMatch::ValueName;
+            return true;
+        }
+
+        int len = 0;
+        const char *data = cgl->reg->getValueRawData(h, vex, buf, len);
+
+        if (query.matchData(vex, data, len)) {
+            match.column = CFinderMatch::ValueData;
+            return true;
+        }
+    }
+
+    match.value.clear();
+    return false;
+}
+
+// Blocking scan of key subtree, query must be prepared already
+QVector<CFinderMatch> CFinder::scanSubtree(struct hive *hdesc, struct nk_key *key, const CFinderQuery &query)
+{
+    QVector<CFinderMatch> res;
+    const QList<int> keys = cgl->reg->listAllKeysOfsFlat(hdesc, key);
+
+    for (const int keyOfs : keys) {
+        CFinderMatch m;
+        if (matchKey(hdesc, keyOfs, query, m)) {
+            m.keyOfs = keyOfs;
+            res.append(m);
+        }
     }
-    Q_EMIT hideProgressDialog();
+
+    return res;
+}
+
+void CFinder::continueSearch()
+{
+    const QMutexLocker locker(&m_stateLock);
+
+    if (searchHive == nullptr || m_waitingNext || m_findAll) return;
+
+    m_waitingNext = true;
+    deliverNext();
+
+    if (m_waitingNext)
+        Q_EMIT showProgressDialog();
+}
+
+void CFinder::cancelSearch()
+{
+    m_canceled.storeRelease(1);
+
+    QMetaObject::invokeMethod(this, [this]() {
+        hiveChanged(QModelIndex());
+        Q_EMIT hideProgressDialog();
+    }, Qt::QueuedConnection);
 }
 
 void CFinder::destroyFinder()
 {
-    m_canceled = true;
+    m_canceled.storeRelease(1);
+    m_pool.waitForDone();
+    dropIndex(nullptr);
     Q_EMIT requestToDestroy();
 }
 
 void CFinder::hiveChanged(const QModelIndex &idx)
 {
+    struct hive* h = nullptr;
     if (idx.isValid()) {
         struct nk_key* ck = nullptr;
-        struct hive* h = nullptr;
         int hive = 0;
-        if (cgl->reg->keyPrepare(idx.internalPointer(),h,hive,ck))
-            if (searchHive!=hive) return;
+        if (!cgl->reg->keyPrepare(idx.internalPointer(),h,hive,ck))
+            h = nullptr;
+    }
+    hiveChanged(h);
+}
+
+void CFinder::hiveChanged(struct hive *hdesc, bool keysChanged)
+{
+    // Called from GUI thread before hive modifications, waits for running jobs
+    const QMutexLocker locker(&m_stateLock);
+
+    if (hdesc != nullptr && searchHive != hdesc) return;
+
+    // Value edits keep nk offsets valid, so finished results are still usable
+    if (hdesc != nullptr && !keysChanged && m_scanFinished) return;
+
+    stopScan();
+    searchHive = nullptr;
+    m_query = CFinderQuery();
+}
+
+void CFinder::indexHive(struct hive *hdesc)
+{
+    // Called from GUI thread, takes a copy of hive buffer for the index
+    dropIndex(hdesc);
+
+    if (hdesc == nullptr || !cgl->searchIndex) return;
+
+    const QSharedPointer<CHiveIndex> index(new CHiveIndex(hdesc));
+
+    {
+        const QMutexLocker locker(&m_indexLock);
+        m_indexes.insert(hdesc, index);
+    }
+
+    m_indexPool.start([this, hdesc, index]() {
+        if (!index->build())
+            return;
+
+        const QMutexLocker locker(&m_indexLock);
+        if (m_indexes.value(hdesc) == index)
+            index->setReady();
+    });
+}
+
+void CFinder::dropIndex(struct hive *hdesc)
+{
+    QList<QSharedPointer<CHiveIndex> > dropped;
+
+    {
+        const QMutexLocker locker(&m_indexLock);
+        if (hdesc == nullptr) {
+            dropped = m_indexes.values();
+            m_indexes.clear();
+        } else if (m_indexes.contains(hdesc)) {
+            dropped.append(m_indexes.take(hdesc));
+        }
+    }
+
+    for (const auto &index : qAsConst(dropped))
+        index->cancel();
+
+    if (hdesc == nullptr)
+        m_indexPool.waitForDone();
+}
+
+void CFinder::keyChanged(struct hive *hdesc, int nkofs)
+{
+    const QMutexLocker locker(&m_indexLock);
+
+    const QSharedPointer<CHiveIndex> index = m_indexes.value(hdesc);
+    if (index)
+        index->keyChanged(nkofs);
+}
+
+void CFinder::filterByIndex(struct hive *hdesc, const CFinderQuery &query, QList<int> &keys)
+{
+    // Filters only narrow the result, so plain text candidates are still valid
+    if (!query.isIndexable()) return;
+
+    bool iok = false;
+    const quint32 snum = query.text.toUInt(&iok);
+    QVector<int> candidates;
+
+    {
+        const QMutexLocker locker(&m_indexLock);
+        const QSharedPointer<CHiveIndex> index = m_indexes.value(hdesc);
+        if (!index || !index->candidates(query.text, iok, snum, candidates))
+            return;
+    }
+
+    // Keep subtree order, deleted keys are dropped here too
+    QList<int> res;
+    for (const int nkofs : qAsConst(keys)) {
+        if (std::binary_search(candidates.constBegin(), candidates.constEnd(), nkofs))
+            res.append(nkofs);
+    }
+    keys = res;
+}
+
+static quint64 toFileTime(const QDateTime &dt)
+{
+    return static_cast<quint64>(dt.toMSecsSinceEpoch() + Q_INT64_C(11644473600000)) * 10000;
+}
+
+bool CFinderQuery::prepare(QString *error)
+{
+    QString err;
+
+    m_matcher = CTextMatcher(text);
+    m_number = text.toUInt(&m_isNumber);
+
+    // Compiled once, copies share JIT code
+    if (useRegExp) {
+        m_regExp = QRegularExpression(text, QRegularExpression::CaseInsensitiveOption);
+        if (m_regExp.isValid()) {
+            m_regExp.optimize();
+        } else {
+            err = tr("Invalid regular expression: %1").arg(m_regExp.errorString());
+        }
+    }
+
+    if (!keyPath.isEmpty()) {
+        m_keyPathRegExp = QRegularExpression(keyPath, QRegularExpression::CaseInsensitiveOption);
+        if (m_keyPathRegExp.isValid()) {
+            m_keyPathRegExp.optimize();
+        } else {
+            err = tr("Invalid key path expression: %1").arg(m_keyPathRegExp.errorString());
+        }
+    }
+
+    if (useDwordRange && dwordMin > dwordMax)
+        err = tr("Invalid DWORD range.");
+
+    m_timeFrom = (modifiedAfter.isValid() ? toFileTime(modifiedAfter) : 0);
+    m_timeTo = (modifiedBefore.isValid() ? toFileTime(modifiedBefore) : Q_UINT64_C(0xffffffffffffffff));
+
+    if (text.isEmpty() && !hasValueFilter() && keyPath.isEmpty()
+            && !modifiedAfter.isValid() && !modifiedBefore.isValid()) {
+        err = tr("Search text or filter required.");
+    }
+
+    if (error != nullptr)
+        *error = err;
+
+    return err.isEmpty();
+}
+
+bool CFinderQuery::matchKey(struct hive *hdesc, struct nk_key *key) const
+{
+    if (m_timeFrom != 0 || m_timeTo != Q_UINT64_C(0xffffffffffffffff)) {
+        const auto ft = qFromLittleEndian<quint64>(key->timestamp);
+        if (ft < m_timeFrom || ft > m_timeTo)
+            return false;
+    }
+
+    if (!keyPath.isEmpty() && !m_keyPathRegExp.match(cgl->reg->getKeyFullPath(hdesc, key, true)).hasMatch())
+        return false;
+
+    return true;
+}
+
+bool CFinderQuery::matchValue(const struct vex_data &vex) const
+{
+    if (valueType >= 0 && vex.type != valueType)
+        return false;
+
+    if (useDwordRange) {
+        if (vex.type != REG_DWORD)
+            return false;
+
+        const auto val = static_cast<quint32>(vex.val);
+        return (val >= dwordMin && val <= dwordMax);
+    }
+
+    return true;
+}
+
+bool CFinderQuery::matchName(const CHiveName &name) const
+{
+    if (useRegExp)
+        return m_regExp.match(name.toString()).hasMatch();
+
+    return m_matcher.contains(name);
+}
+
+bool CFinderQuery::matchName(const QString &name) const
+{
+    if (useRegExp)
+        return m_regExp.match(name).hasMatch();
+
+    return m_matcher.contains(name);
+}
+
+bool CFinderQuery::matchData(const struct vex_data &vex, const char *data, int len) const
+{
+    const auto *str = reinterpret_cast<const char16_t *>(data);
+
+    switch (vex.type) {
+        case REG_SZ:
+        case REG_EXPAND_SZ: {
+            const int units = CTextMatcher::utf16Length(data, len / 2);
+            if (useRegExp)
+                return m_regExp.match(QString::fromUtf16(str, units)).hasMatch();
+
+            if (m_matcher.containsUtf16(data, units))
+                return true;
+            break;
+        }
+
+        case REG_MULTI_SZ:
+            if (useRegExp) {
+                // One string per line, like in value editor
+                QString s = QString::fromUtf16(str, len / 2);
+                while (s.endsWith(QChar(0)))
+                    s.chop(1);
+                s.replace(QChar(0), QChar('\n'));
+                return m_regExp.match(s).hasMatch();
+            }
+
+            // Separators never match search text
+            if (m_matcher.containsUtf16(data, len / 2))
+                return true;
+            break;
+
+        case REG_DWORD:
+            if (!useRegExp && m_isNumber && static_cast<quint32>(vex.val) == m_number)
+                return true;
+            break;
+
+        default:
+            break;
     }
-    searchHive = -1;
-    searchKeysOfsFlat.clear();
-    searchLastKeyIdx = -1;
-    searchString.clear();
+
+    return (!useRegExp && m_matcher.containsBytes(data, len));
 }
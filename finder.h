@@ -3,11 +3,87 @@
 
 #include <QObject>
 #include <QList>
+#include <QVector>
 #include <QString>
 #include <QModelIndex>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QThreadPool>
+#include <QSharedPointer>
+#include <QHash>
+#include <QDateTime>
+#include <QRegularExpression>
+#include <QCoreApplication>
+#include "textmatcher.h"
 
 struct hive;
 struct nk_key;
+class CHiveIndex;
+
+class CFinderMatch
+{
+public:
+    enum Column { KeyName, ValueName, ValueData };
+
+    int keyOfs { -1 };
+    Column column { KeyName };
+    QString value; // empty for key name match
+};
+
+Q_DECLARE_METATYPE(CFinderMatch)
+
+/* Search request. Plain text matches key names, value names, string data and
+ * raw data of any value, regexp matches names and string data only.
+ * Filters narrow the matched keys and values, everything is checked in one pass.
+ * With value filters, only values are matched, text may be empty then.
+ */
+class CFinderQuery
+{
+    Q_DECLARE_TR_FUNCTIONS(CFinderQuery)
+
+public:
+    QString text;
+    bool useRegExp { false };
+    int valueType { -1 };           // REG_* type of matched values, -1 for any
+    bool useDwordRange { false };
+    quint32 dwordMin { 0 };
+    quint32 dwordMax { 0xffffffff };
+    QDateTime modifiedAfter;        // key last write time limits, invalid for none
+    QDateTime modifiedBefore;
+    QString keyPath;                // regexp for key path below hive root
+
+    bool prepare(QString *error = nullptr);
+    bool hasValueFilter() const { return (valueType >= 0 || useDwordRange); }
+    bool isIndexable() const { return (!useRegExp && !text.isEmpty()); }
+
+    bool matchKey(struct hive *hdesc, struct nk_key *key) const;
+    bool matchValue(const struct vex_data &vex) const;
+    bool matchName(const CHiveName &name) const;
+    bool matchName(const QString &name) const;
+    bool matchData(const struct vex_data &vex, const char *data, int len) const;
+
+private:
+    QRegularExpression m_regExp;
+    QRegularExpression m_keyPathRegExp;
+    CTextMatcher m_matcher;
+    bool m_isNumber { false };
+    quint32 m_number { 0 };
+    quint64 m_timeFrom { 0 };       // FILETIME
+    quint64 m_timeTo { Q_UINT64_C(0xffffffffffffffff) };
+};
+
+Q_DECLARE_METATYPE(CFinderQuery)
+
+/* Results of one search run. Chunks are filled by pool jobs in any order,
+ * CFinder collects them into its result list in key order. */
+class CFinderScan
+{
+public:
+    QMutex lock;
+    QVector<QVector<CFinderMatch> > chunks;
+    QVector<bool> done;
+    int collected { 0 };
+};
 
 class CFinder : public QObject
 {
@@ -15,26 +91,56 @@ class CFinder : public QObject
     Q_DISABLE_COPY(CFinder)
 
 private:
-    int searchHive { -1 };
-    int searchLastKeyIdx { -1 };
-    bool m_canceled { false };
-    QList<int> searchKeysOfsFlat;
-    QString searchString;
+    struct hive *searchHive { nullptr };
+    CFinderQuery m_query;
+    QMutex m_stateLock;
+    QThreadPool m_pool;
+    QAtomicInt m_canceled { 0 };
+    QSharedPointer<CFinderScan> m_scan;
+    QVector<CFinderMatch> m_results;
+    int m_resultIdx { -1 };
+    bool m_scanFinished { true };
+    bool m_waitingNext { false };
+    bool m_findAll { false };
+
+    // Search indexes are built on separate pool, they don't read live hive buffer
+    QThreadPool m_indexPool;
+    QMutex m_indexLock;
+    QHash<struct hive *, QSharedPointer<CHiveIndex> > m_indexes;
+
+    void stopScan();
+    void startScan(const QList<int> &keys);
+    void collectResults(const QSharedPointer<CFinderScan> &scan);
+    void deliverNext();
+    bool prepareSearch(const QModelIndex &idx, const CFinderQuery &query);
+    void filterByIndex(struct hive *hdesc, const CFinderQuery &query, QList<int> &keys);
+    static bool matchKey(struct hive *h, int keyOfs, const CFinderQuery &query, CFinderMatch &match);
 
 public:
     explicit CFinder(QObject *parent = nullptr);
     ~CFinder() override;
     void hiveChanged(const QModelIndex &idx);
-    void cancelSearch() { m_canceled = true; }
+    void hiveChanged(struct hive *hdesc, bool keysChanged = true);
+    void cancelSearch();
+    void indexHive(struct hive *hdesc);
+    void dropIndex(struct hive *hdesc);
+    void keyChanged(struct hive *hdesc, int nkofs);
+
+    static QVector<CFinderMatch> scanSubtree(struct hive *hdesc, struct nk_key *key, const CFinderQuery &query);
 
 public Q_SLOTS:
-    void searchText(const QModelIndex& idx, const QString& text);
+    void searchText(const QModelIndex& idx, const CFinderQuery& query);
+    void findAll(const QModelIndex& idx, const CFinderQuery& query);
     void continueSearch();
     void destroyFinder();
 
 Q_SIGNALS:
     void keyFound(quintptr hdesc, quintptr key, const QString &value);
     void searchFinished();
+    void searchProgress(int value, int maximum);
+    void searchReset();
+    void matchesFound(quintptr hdesc, const QVector<CFinderMatch> &matches);
+    void findAllFinished(int count);
     void requestToDestroy();
 
     void showProgressDialog();
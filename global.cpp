@@ -3,6 +3,7 @@
 #include <QTime>
 #include <QRegularExpression>
 #include "global.h"
+#include "registrymodel.h"
 #include "settingsdlg.h"
 #include "ui_settingsdlg.h"
 
@@ -64,10 +65,11 @@ void stdConsoleOutput(QtMsgType type, const QMessageLogContext &context, const Q
     loggerMutex.unlock();
 }
 
-CGlobal::CGlobal(QObject *parent) : QObject(parent)
+CGlobal::CGlobal(QObject *parent, bool gui) : QObject(parent)
 {
     reg.reset(new CRegController(this));
-    logWindow.reset(new CLogDisplay());
+    if (gui)
+        logWindow.reset(new CLogDisplay());
 
     loadSettings();
 }
@@ -102,6 +104,7 @@ void CGlobal::loadSettings()
     QSettings settings("kernel1024", "qregedit");
     settings.beginGroup("Main");
     hiveOpenMode = settings.value("hiveOpenMode", 0).toInt();
+    searchIndex = settings.value("searchIndex", false).toBool();
     settings.endGroup();
 }
 
@@ -111,6 +114,7 @@ void CGlobal::writeSettings() const
     settings.beginGroup("Main");
     settings.remove("");
     settings.setValue("hiveOpenMode", hiveOpenMode);
+    settings.setValue("searchIndex", searchIndex);
     settings.endGroup();
 }
 
@@ -119,6 +123,10 @@ void CGlobal::settingsDialog(QWidget *parent)
     auto *dlg = new CSettingsDlg(parent);
     dlg->ui->checkNoAlloc->setChecked((hiveOpenMode & HMODE_NOALLOC) != 0);
     dlg->ui->checkNoExpand->setChecked((hiveOpenMode & HMODE_NOEXPAND) != 0);
+    dlg->ui->checkMmap->setChecked((hiveOpenMode & HMODE_MMAP) != 0);
+    dlg->ui->checkBackup->setChecked((hiveOpenMode & HMODE_BACKUP) != 0);
+    dlg->ui->checkLogSave->setChecked((hiveOpenMode & HMODE_LOGSAVE) != 0);
+    dlg->ui->checkSearchIndex->setChecked(searchIndex);
 
     if (dlg->exec() == QDialog::Accepted) {
         if (dlg->ui->checkNoExpand->isChecked()) {
@@ -132,6 +140,39 @@ void CGlobal::settingsDialog(QWidget *parent)
         } else {
             hiveOpenMode &= ~HMODE_NOALLOC;
         }
+
+        if (dlg->ui->checkMmap->isChecked()) {
+            hiveOpenMode |= HMODE_MMAP;
+        } else {
+            hiveOpenMode &= ~HMODE_MMAP;
+        }
+
+        if (dlg->ui->checkBackup->isChecked()) {
+            hiveOpenMode |= HMODE_BACKUP;
+        } else {
+            hiveOpenMode &= ~HMODE_BACKUP;
+        }
+
+        if (dlg->ui->checkLogSave->isChecked()) {
+            hiveOpenMode |= HMODE_LOGSAVE;
+        } else {
+            hiveOpenMode &= ~HMODE_LOGSAVE;
+        }
+
+        // Unlike other modes, these are checked only on save
+        const int saveModes = (HMODE_BACKUP | HMODE_LOGSAVE);
+        for (int i = 0; i < reg->getHivesCount(); i++) {
+            struct hive *h = reg->getHivePtr(i);
+            h->state = (h->state & ~saveModes) | (hiveOpenMode & saveModes);
+        }
+
+        if (searchIndex != dlg->ui->checkSearchIndex->isChecked()) {
+            searchIndex = dlg->ui->checkSearchIndex->isChecked();
+            if (reg->treeModel && reg->treeModel->finder) {
+                for (int i = 0; i < reg->getHivesCount(); i++)
+                    reg->treeModel->finder->indexHive(reg->getHivePtr(i));
+            }
+        }
     }
 
     dlg->deleteLater();
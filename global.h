@@ -17,10 +17,11 @@ class CGlobal : public QObject {
 
 public:
     int hiveOpenMode { 0 };
+    bool searchIndex { false };
     QScopedPointer<CRegController> reg;
     QScopedPointer<CLogDisplay> logWindow;
 
-    explicit CGlobal(QObject *parent = nullptr);
+    explicit CGlobal(QObject *parent = nullptr, bool gui = true);
     ~CGlobal() override;
 
     bool safeToClose(int idx = -1) const;
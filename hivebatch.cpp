@@ -0,0 +1,250 @@
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QThread>
+#include <QMutexLocker>
+#include "hivebatch.h"
+#include "global.h"
+
+// Value data in reg.exe query style
+static QString formatData(const CValue &value)
+{
+    switch (value.type) {
+        case REG_DWORD:
+            return QSL("0x%1").arg(value.vDWORD, 0, 16);
+
+        case REG_SZ:
+        case REG_EXPAND_SZ:
+            return value.vString;
+
+        case REG_MULTI_SZ: {
+            QString s = value.vString;
+            s.replace(QChar('\n'), QSL("\\0"));
+            return s;
+        }
+
+        default:
+            break;
+    }
+
+    return QString::fromLatin1(value.vOther.toHex()).toUpper();
+}
+
+CHiveBatch::CHiveBatch(QObject *parent)
+    : QObject(parent)
+{
+    qRegisterMetaType<CHiveBatchResult>("CHiveBatchResult");
+
+    m_pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+CHiveBatch::~CHiveBatch()
+{
+    cancel();
+    m_pool.waitForDone();
+}
+
+void CHiveBatch::setThreadCount(int count)
+{
+    m_pool.setMaxThreadCount(qMax(1, count));
+}
+
+void CHiveBatch::setMemoryLimit(qint64 bytes)
+{
+    const QMutexLocker locker(&m_memoryLock);
+    m_memoryLimit = bytes;
+    m_memoryFreed.wakeAll();
+}
+
+void CHiveBatch::cancel()
+{
+    const QMutexLocker locker(&m_memoryLock);
+    m_canceled.storeRelease(1);
+    m_memoryFreed.wakeAll();
+}
+
+bool CHiveBatch::reserveMemory(qint64 bytes)
+{
+    const QMutexLocker locker(&m_memoryLock);
+
+    // A hive bigger than the limit still goes, when it is alone
+    while (m_canceled.loadAcquire() == 0 && m_memoryUsed > 0 && (m_memoryUsed + bytes) > m_memoryLimit)
+        m_memoryFreed.wait(&m_memoryLock);
+
+    if (m_canceled.loadAcquire() != 0)
+        return false;
+
+    m_memoryUsed += bytes;
+    return true;
+}
+
+void CHiveBatch::releaseMemory(qint64 bytes)
+{
+    const QMutexLocker locker(&m_memoryLock);
+    m_memoryUsed -= bytes;
+    m_memoryFreed.wakeAll();
+}
+
+void CHiveBatch::start(const QStringList &files, const CHiveBatchJob &job)
+{
+    m_canceled.storeRelease(0);
+    m_failed = 0;
+    m_running = files.count();
+
+    if (files.isEmpty()) {
+        QMetaObject::invokeMethod(this, [this]() {
+            Q_EMIT finished(0);
+        }, Qt::QueuedConnection);
+        return;
+    }
+
+    for (int i = 0; i < files.count(); i++) {
+        const QString filename = files.at(i);
+
+        m_pool.start([this, i, filename, job]() {
+            const CHiveBatchResult res = runHive(i, filename, job);
+
+            QMetaObject::invokeMethod(this, [this, res]() {
+                if (!res.ok)
+                    m_failed++;
+                m_running--;
+
+                Q_EMIT hiveFinished(res);
+                if (m_running == 0)
+                    Q_EMIT finished(m_failed);
+            }, Qt::QueuedConnection);
+        });
+    }
+}
+
+// Pool thread
+CHiveBatchResult CHiveBatch::runHive(int index, const QString &filename, const CHiveBatchJob &job)
+{
+    CHiveBatchResult res;
+    const qint64 size = QFileInfo(filename).size();
+
+    if (!reserveMemory(size)) {
+        res.error = tr("canceled");
+    } else {
+        struct hive *h = cgl->reg->openDetachedHive(filename, HMODE_RO);
+
+        if (h == nullptr) {
+            res.error = tr("failed to open hive");
+        } else {
+            CHiveBatchJob hiveJob = job;
+
+            // Numbered, since hives from different machines have the same names
+            if (job.action == CHiveBatchJob::Export && !job.outputDir.isEmpty()) {
+                hiveJob.outputFile = QDir(job.outputDir).filePath(QSL("%1-%2.reg")
+                                                                  .arg(index + 1, 4, 10, QChar('0'))
+                                                                  .arg(QFileInfo(filename).fileName()));
+            }
+
+            res = processHive(h, hiveJob);
+            cgl->reg->closeDetachedHive(h);
+        }
+
+        releaseMemory(size);
+    }
+
+    res.index = index;
+    res.filename = filename;
+    return res;
+}
+
+/* Runs job on one opened hive. Used by pool threads for detached hives, and
+ * by batch mode for the current hive. */
+CHiveBatchResult CHiveBatch::processHive(struct hive *hdesc, const CHiveBatchJob &job)
+{
+    CHiveBatchResult res;
+    CRegController *reg = cgl->reg.data();
+    struct nk_key *key = reg->findKey(hdesc, job.keyPath);
+
+    if (key == nullptr) {
+        res.error = tr("key %1 not found").arg(job.keyPath);
+        return res;
+    }
+
+    const QString prefix = reg->getHivePrefix(hdesc);
+
+    switch (job.action) {
+        case CHiveBatchJob::Query: {
+            const QString keyPath = prefix + reg->getKeyFullPath(hdesc, key, true);
+            const bool defaultValue = (job.valueName.isEmpty() || job.valueName == QSL("@"));
+            bool found = false;
+
+            res.lines.append(keyPath);
+
+            const QList<CValue> values = reg->listValues(hdesc, key);
+            for (const CValue &v : values) {
+                if (job.oneValue && !(defaultValue ? v.isDefault()
+                                                   : (v.name.compare(job.valueName, Qt::CaseInsensitive) == 0))) {
+                    continue;
+                }
+
+                found = true;
+                res.lines.append(QSL("    %1    %2    %3").arg(v.isDefault() ? tr("(Default)") : v.name,
+                                                               reg->getValueTypeStr(v.type), formatData(v)));
+            }
+
+            if (job.oneValue) {
+                if (!found) {
+                    res.error = tr("value %1 not found").arg(job.valueName);
+                    return res;
+                }
+                break;
+            }
+
+            res.lines.append(QString());
+
+            const QString base = (keyPath.endsWith(QChar('\\')) ? keyPath : keyPath + QChar('\\'));
+            const QStringList subkeys = reg->listKeys(hdesc, key);
+            for (const QString &name : subkeys)
+                res.lines.append(base + name);
+            break;
+        }
+
+        case CHiveBatchJob::Export: {
+            QFile f;
+            bool opened = false;
+
+            if (job.outputFile == QSL("-")) {
+                opened = f.open(stdout, QIODevice::WriteOnly);
+            } else {
+                f.setFileName(job.outputFile);
+                opened = f.open(QIODevice::WriteOnly);
+            }
+
+            if (!opened) {
+                res.error = tr("failed to create file %1").arg(job.outputFile);
+                return res;
+            }
+
+            const bool exported = reg->exportKey(hdesc, key, prefix, &f, job.exportThreads);
+            f.close();
+
+            if (!exported) {
+                res.error = tr("failed to export key to %1").arg(job.outputFile);
+                return res;
+            }
+
+            res.outputFile = job.outputFile;
+            break;
+        }
+
+        case CHiveBatchJob::Search: {
+            const QVector<CFinderMatch> matches = CFinder::scanSubtree(hdesc, key, job.query);
+
+            for (const CFinderMatch &m : matches) {
+                QString line = prefix + reg->getKeyFullPath(hdesc, reg->getKeyPtr(hdesc, m.keyOfs), true);
+                if (m.column != CFinderMatch::KeyName)
+                    line.append(QChar('\t')).append(m.value);
+                res.lines.append(line);
+            }
+            break;
+        }
+    }
+
+    res.ok = true;
+    return res;
+}
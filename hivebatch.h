@@ -0,0 +1,92 @@
+#ifndef HIVEBATCH_H
+#define HIVEBATCH_H
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include "finder.h"
+
+struct hive;
+struct nk_key;
+
+// What to do with every hive of a batch
+class CHiveBatchJob
+{
+public:
+    enum Action { Query, Export, Search };
+
+    Action action { Query };
+    QString keyPath;            // key to query, export or search in, below hive root
+    bool oneValue { false };    // Query: print only valueName
+    QString valueName;
+    CFinderQuery query;         // Search: prepared query
+    QString outputFile;         // Export: .reg file, '-' for stdout
+    QString outputDir;          // Export: directory for a file per hive, used instead of outputFile
+    int exportThreads { 1 };
+};
+
+class CHiveBatchResult
+{
+public:
+    int index { -1 };           // position in the file list
+    QString filename;
+    bool ok { false };
+    QString error;
+    QStringList lines;          // query and search output
+    QString outputFile;         // written export file
+};
+
+Q_DECLARE_METATYPE(CHiveBatchResult)
+
+/* Runs one job on many hive files from a thread pool. Every hive is opened
+ * read only and detached from the hive list, so workers never share a hive.
+ * Open hive buffers are limited by memory budget, results are sent out as
+ * soon as each hive is done and not kept here.
+ */
+class CHiveBatch : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CHiveBatch)
+
+public:
+    static constexpr qint64 defaultMemoryLimit = Q_INT64_C(1024) * 1024 * 1024;
+
+private:
+    QThreadPool m_pool;
+    QMutex m_memoryLock;
+    QWaitCondition m_memoryFreed;
+    qint64 m_memoryLimit { defaultMemoryLimit };
+    qint64 m_memoryUsed { 0 };
+    QAtomicInt m_canceled { 0 };
+    int m_running { 0 };        // hives not reported yet, owner thread only
+    int m_failed { 0 };
+
+    bool reserveMemory(qint64 bytes);
+    void releaseMemory(qint64 bytes);
+    CHiveBatchResult runHive(int index, const QString &filename, const CHiveBatchJob &job);
+
+public:
+    explicit CHiveBatch(QObject *parent = nullptr);
+    ~CHiveBatch() override;
+
+    void setThreadCount(int count);
+    void setMemoryLimit(qint64 bytes);
+    bool isRunning() const { return (m_running > 0); }
+
+    void start(const QStringList &files, const CHiveBatchJob &job);
+
+    static CHiveBatchResult processHive(struct hive *hdesc, const CHiveBatchJob &job);
+
+public Q_SLOTS:
+    void cancel();
+
+Q_SIGNALS:
+    void hiveFinished(const CHiveBatchResult &result);
+    void finished(int failed);
+};
+
+#endif // HIVEBATCH_H
@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <cstring>
+#include <QDebug>
+#include "hivediff.h"
+#include "regexport.h"
+#include "global.h"
+
+static const int maxDepth = 512; // deepest key Windows allows, stops on looped lists
+
+namespace {
+
+struct DiffNode {
+    int oldOfs;     // -1 for key added in new hive
+    int newOfs;     // -1 for key removed from old hive
+    QString path;
+    int depth;
+};
+
+}
+
+template <class Cell>
+static void sortCells(QVector<Cell> &cells)
+{
+    // Windows keeps subkey lists sorted, so usually there is nothing to do
+    for (int i = 1; i < cells.count(); i++) {
+        if (cells.at(i - 1).name.compareUpper(cells.at(i).name) > 0) {
+            std::stable_sort(cells.begin(), cells.end(), [](const Cell &a, const Cell &b) {
+                return (a.name.compareUpper(b.name) < 0);
+            });
+            return;
+        }
+    }
+}
+
+static inline struct nk_key *nkAt(struct hive *hdesc, int nkofs)
+{
+    return reinterpret_cast<struct nk_key *>(hdesc->buffer + nkofs);
+}
+
+CHiveDiff::CHiveDiff(struct hive *oldHive, struct hive *newHive)
+    : m_old(oldHive)
+    , m_new(newHive)
+{
+}
+
+bool CHiveDiff::sameData(const CValueView &oldValue, const CValueView &newValue)
+{
+    if (oldValue.type() != newValue.type() || oldValue.size() != newValue.size())
+        return false;
+
+    int oldLen = 0;
+    int newLen = 0;
+    const char *oldData = cgl->reg->getValueRawData(m_old, oldValue.toVex(), m_oldData, oldLen);
+    const char *newData = cgl->reg->getValueRawData(m_new, newValue.toVex(), m_newData, newLen);
+
+    return (oldLen == newLen && (oldLen == 0 || memcmp(oldData, newData, static_cast<size_t>(oldLen)) == 0));
+}
+
+void CHiveDiff::diffValues(int oldNk, int newNk, const QString &path)
+{
+    m_oldCells.clear();
+    for (const CValueView &vv : CValueRange(m_old, nkAt(m_old, oldNk)))
+        m_oldCells.append({ vv.name(), vv.offset() });
+
+    m_newCells.clear();
+    for (const CValueView &vv : CValueRange(m_new, nkAt(m_new, newNk)))
+        m_newCells.append({ vv.name(), vv.offset() });
+
+    sortCells(m_oldCells);
+    sortCells(m_newCells);
+
+    int i = 0;
+    int j = 0;
+    while (i < m_oldCells.count() || j < m_newCells.count()) {
+        int cmp = 0;
+        if (i >= m_oldCells.count()) {
+            cmp = 1;
+        } else if (j >= m_newCells.count()) {
+            cmp = -1;
+        } else {
+            cmp = m_oldCells.at(i).name.compareUpper(m_newCells.at(j).name);
+        }
+
+        CHiveDiffEntry e;
+        e.path = path;
+
+        if (cmp < 0) {
+            e.kind = CHiveDiffEntry::ValueRemoved;
+            e.valueName = m_oldCells.at(i).name.toString();
+            e.oldOfs = m_oldCells.at(i++).ofs;
+        } else if (cmp > 0) {
+            e.kind = CHiveDiffEntry::ValueAdded;
+            e.valueName = m_newCells.at(j).name.toString();
+            e.newOfs = m_newCells.at(j++).ofs;
+        } else {
+            const NamedCell &o = m_oldCells.at(i++);
+            const NamedCell &n = m_newCells.at(j++);
+
+            if (sameData(CValueView(m_old, o.ofs), CValueView(m_new, n.ofs)))
+                continue;
+
+            e.kind = CHiveDiffEntry::ValueChanged;
+            e.valueName = n.name.toString();
+            e.oldOfs = o.ofs;
+            e.newOfs = n.ofs;
+        }
+
+        m_entries.append(e);
+    }
+}
+
+/* Compares key at path (hive root by default), which must exist in both hives.
+ * Children of a key are pushed in reverse, so entries come in preorder. */
+bool CHiveDiff::compare(const QString &path)
+{
+    m_entries.clear();
+
+    struct nk_key *oldKey = cgl->reg->findKey(m_old, path);
+    struct nk_key *newKey = cgl->reg->findKey(m_new, path);
+
+    if (oldKey == nullptr || newKey == nullptr) {
+        qCritical() << tr("diff: key %1 not found").arg(path);
+        return false;
+    }
+
+    QVector<DiffNode> stack;
+    QVector<DiffNode> children;
+
+    stack.append({ cgl->reg->getKeyOfs(m_old, oldKey), cgl->reg->getKeyOfs(m_new, newKey),
+                   cgl->reg->getKeyFullPath(m_new, newKey, true), 0 });
+
+    while (!stack.isEmpty()) {
+        const DiffNode node = stack.takeLast();
+
+        if (node.oldOfs < 0 || node.newOfs < 0) {
+            CHiveDiffEntry e;
+            e.kind = (node.oldOfs < 0 ? CHiveDiffEntry::KeyAdded : CHiveDiffEntry::KeyRemoved);
+            e.path = node.path;
+            e.oldOfs = node.oldOfs;
+            e.newOfs = node.newOfs;
+            m_entries.append(e);
+            continue;
+        }
+
+        diffValues(node.oldOfs, node.newOfs, node.path);
+
+        if (node.depth >= maxDepth)
+            continue;
+
+        m_oldCells.clear();
+        for (const CSubkeyView &sk : CSubkeyRange(m_old, nkAt(m_old, node.oldOfs)))
+            m_oldCells.append({ sk.name(), sk.offset() });
+
+        m_newCells.clear();
+        for (const CSubkeyView &sk : CSubkeyRange(m_new, nkAt(m_new, node.newOfs)))
+            m_newCells.append({ sk.name(), sk.offset() });
+
+        sortCells(m_oldCells);
+        sortCells(m_newCells);
+
+        const QString base = (node.path.endsWith(QChar('\\')) ? node.path : node.path + QChar('\\'));
+        children.clear();
+
+        // Merge join of the two sorted lists
+        int i = 0;
+        int j = 0;
+        while (i < m_oldCells.count() || j < m_newCells.count()) {
+            int cmp = 0;
+            if (i >= m_oldCells.count()) {
+                cmp = 1;
+            } else if (j >= m_newCells.count()) {
+                cmp = -1;
+            } else {
+                cmp = m_oldCells.at(i).name.compareUpper(m_newCells.at(j).name);
+            }
+
+            if (cmp < 0) {
+                const NamedCell &o = m_oldCells.at(i++);
+                children.append({ o.ofs, -1, base + o.name.toString(), node.depth + 1 });
+            } else if (cmp > 0) {
+                const NamedCell &n = m_newCells.at(j++);
+                children.append({ -1, n.ofs, base + n.name.toString(), node.depth + 1 });
+            } else {
+                const int oldOfs = m_oldCells.at(i++).ofs;
+                const NamedCell &n = m_newCells.at(j++);
+                children.append({ oldOfs, n.ofs, base + n.name.toString(), node.depth + 1 });
+            }
+        }
+
+        for (int k = children.count() - 1; k >= 0; k--)
+            stack.append(children.at(k));
+    }
+
+    return true;
+}
+
+bool CHiveDiff::writeReg(QIODevice *device)
+{
+    CRegExporter exporter(m_new, device);
+    const QString prefix = cgl->reg->getHivePrefix(m_old); // delta is imported to the old hive
+    QString header; // key of the last header, values go under it
+
+    if (!exporter.writeHeader())
+        return false;
+
+    for (const CHiveDiffEntry &e : qAsConst(m_entries)) {
+        switch (e.kind) {
+            case CHiveDiffEntry::KeyAdded:
+                if (!exporter.writeSubtree(nkAt(m_new, e.newOfs), prefix + e.path))
+                    return false;
+                header.clear();
+                break;
+
+            case CHiveDiffEntry::KeyRemoved:
+                exporter.writeKeyHeader(prefix + e.path, true);
+                header.clear();
+                break;
+
+            case CHiveDiffEntry::ValueAdded:
+            case CHiveDiffEntry::ValueRemoved:
+            case CHiveDiffEntry::ValueChanged:
+                if (header != e.path) {
+                    exporter.writeKeyHeader(prefix + e.path);
+                    header = e.path;
+                }
+
+                if (e.kind == CHiveDiffEntry::ValueRemoved) {
+                    exporter.writeValueRemoval(CValueView(m_old, e.oldOfs).name());
+                } else {
+                    exporter.writeValue(CValueView(m_new, e.newOfs));
+                }
+                break;
+        }
+    }
+
+    return exporter.finish();
+}
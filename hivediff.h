@@ -0,0 +1,65 @@
+#ifndef HIVEDIFF_H
+#define HIVEDIFF_H
+
+#include <QCoreApplication>
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+#include <QIODevice>
+#include "hiveiterators.h"
+
+extern "C" {
+#include <chntpw/ntreg.h>
+}
+
+class CHiveDiffEntry
+{
+public:
+    enum Kind { KeyAdded, KeyRemoved, ValueAdded, ValueRemoved, ValueChanged };
+
+    Kind kind { KeyAdded };
+    QString path;               // key path below hive root, starting with '\'
+    QString valueName;          // empty for key entries and default value
+    int oldOfs { -1 };          // nk or vk offset in old hive, -1 when added
+    int newOfs { -1 };          // nk or vk offset in new hive, -1 when removed
+};
+
+/* Structural diff of two hives, or of the same key in both. Subkey lists are
+ * sorted by uppercased name, so both trees are walked together with a merge
+ * join over each pair of lists; values are matched the same way after
+ * sorting. Added and removed keys are reported once, for the whole subtree.
+ * Entries come in preorder of the new tree, values of a key before its
+ * subkeys, ready to be written as .reg delta.
+ */
+class CHiveDiff
+{
+    Q_DECLARE_TR_FUNCTIONS(CHiveDiff)
+
+private:
+    struct NamedCell {
+        CHiveName name;
+        int ofs;
+    };
+
+    struct hive *m_old { nullptr };
+    struct hive *m_new { nullptr };
+    QVector<CHiveDiffEntry> m_entries;
+    QVector<NamedCell> m_oldCells; // reused lists of the current key
+    QVector<NamedCell> m_newCells;
+    QByteArray m_oldData; // values split to db blocks
+    QByteArray m_newData;
+
+    void diffValues(int oldNk, int newNk, const QString &path);
+    bool sameData(const CValueView &oldValue, const CValueView &newValue);
+
+public:
+    CHiveDiff(struct hive *oldHive, struct hive *newHive);
+
+    bool compare(const QString &path = QString());
+    const QVector<CHiveDiffEntry> &entries() const { return m_entries; }
+
+    // Applying this to the old hive makes the compared key same as in the new one
+    bool writeReg(QIODevice *device);
+};
+
+#endif // HIVEDIFF_H
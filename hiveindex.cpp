@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <QStack>
+#include <QtEndian>
+#include "hiveindex.h"
+#include "hiveiterators.h"
+#include "textmatcher.h"
+#include "global.h"
+
+static const int maxIndexedData = 16384; // keys with larger values are always candidates
+
+static inline quint32 trigramHash(quint32 a, quint32 b, quint32 c)
+{
+    const quint64 t = a | (static_cast<quint64>(b) << 21) | (static_cast<quint64>(c) << 42);
+    return static_cast<quint32>((t * Q_UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
+
+/* Trigrams of case folded units, unit(i) returns i-th UTF-16 unit or byte.
+ * Search text never contains NUL, so trigrams with it are skipped - this
+ * drops most of raw UTF-16 string data. */
+template<typename Unit>
+static void addTrigrams(int len, Unit unit, QVector<quint32> &out)
+{
+    if (len < 3) return;
+
+    quint32 a = CTextMatcher::fold(unit(0));
+    quint32 b = CTextMatcher::fold(unit(1));
+
+    for (int i = 2; i < len; i++) {
+        const quint32 c = CTextMatcher::fold(unit(i));
+        if (a != 0 && b != 0 && c != 0)
+            out.append(trigramHash(a, b, c));
+        a = b;
+        b = c;
+    }
+}
+
+static void addTrigrams(const QString &text, QVector<quint32> &out)
+{
+    const ushort *d = text.utf16();
+    addTrigrams(static_cast<int>(text.length()), [d](int i) { return d[i]; }, out);
+}
+
+static void addUtf16Trigrams(const char *data, int units, QVector<quint32> &out)
+{
+    addTrigrams(units, [data](int i) { return qFromLittleEndian<quint16>(data + i * 2); }, out);
+}
+
+static void addLatin1Trigrams(const char *data, int len, QVector<quint32> &out)
+{
+    const auto *d = reinterpret_cast<const uchar *>(data);
+    addTrigrams(len, [d](int i) { return d[i]; }, out);
+}
+
+static void addTrigrams(const CHiveName &name, QVector<quint32> &out)
+{
+    if (name.isAnsi()) {
+        addLatin1Trigrams(name.raw(), name.rawLength(), out);
+    } else {
+        addUtf16Trigrams(name.raw(), name.rawLength() / 2, out);
+    }
+}
+
+CHiveIndex::CHiveIndex(struct hive *hdesc)
+    : m_buffer(hdesc->buffer, hdesc->size)
+{
+    m_hive = *hdesc;
+    m_hive.buffer = m_buffer.data();
+    m_hive.freecells = nullptr;
+    m_hive.bins = nullptr;
+    m_hive.mapsize = 0;
+}
+
+bool CHiveIndex::build()
+{
+    QVector<quint64> pairs; // (trigram << 32) | nk offset
+    QVector<quint32> keyTrigrams;
+    QSet<int> visited;
+    QStack<int> stack;
+
+    stack.push(m_hive.rootofs + 4);
+
+    while (!stack.isEmpty()) {
+        if (m_canceled.loadAcquire() != 0)
+            return false;
+
+        const int nkofs = stack.pop();
+        auto *k = reinterpret_cast<struct nk_key *>(m_hive.buffer + nkofs);
+
+        if (k->id != 0x6b6e || visited.contains(nkofs))
+            continue;
+        visited.insert(nkofs);
+
+        for (const CSubkeyView &sk : CSubkeyRange(&m_hive, k))
+            stack.push(sk.offset());
+
+        // Same data CFinder::matchKey() checks
+        keyTrigrams.clear();
+        if (nkofs == (m_hive.rootofs + 4)) {
+            addTrigrams(cgl->reg->getKeyName(&m_hive, k), keyTrigrams);
+        } else {
+            addTrigrams(CSubkeyView(&m_hive, nkofs).name(), keyTrigrams);
+        }
+
+        bool indexed = true;
+        QByteArray buf;
+        for (const CValueView &vv : CValueRange(&m_hive, k)) {
+            const struct vex_data vex = vv.toVex();
+            int len = 0;
+            const char *data = cgl->reg->getValueRawData(&m_hive, vex, buf, len);
+
+            if (len > maxIndexedData) {
+                indexed = false;
+                break;
+            }
+
+            const CHiveName name = vv.name();
+            if (name.isEmpty()) {
+                addTrigrams(QSL("@"), keyTrigrams);
+            } else {
+                addTrigrams(name, keyTrigrams);
+            }
+
+            if (vex.type == REG_SZ || vex.type == REG_EXPAND_SZ) {
+                addUtf16Trigrams(data, CTextMatcher::utf16Length(data, len / 2), keyTrigrams);
+            } else if (vex.type == REG_MULTI_SZ) {
+                addUtf16Trigrams(data, len / 2, keyTrigrams);
+            }
+            addLatin1Trigrams(data, len, keyTrigrams);
+
+            if (vex.type == REG_DWORD)
+                m_dwords.append((static_cast<quint64>(static_cast<quint32>(vex.val)) << 32) | static_cast<quint32>(nkofs));
+        }
+
+        if (!indexed) {
+            m_unindexed.append(nkofs);
+            continue;
+        }
+
+        std::sort(keyTrigrams.begin(), keyTrigrams.end());
+        keyTrigrams.erase(std::unique(keyTrigrams.begin(), keyTrigrams.end()), keyTrigrams.end());
+        for (const quint32 t : qAsConst(keyTrigrams))
+            pairs.append((static_cast<quint64>(t) << 32) | static_cast<quint32>(nkofs));
+    }
+
+    std::sort(pairs.begin(), pairs.end());
+    std::sort(m_dwords.begin(), m_dwords.end());
+    std::sort(m_unindexed.begin(), m_unindexed.end());
+
+    m_postings.reserve(pairs.count());
+    for (const quint64 p : qAsConst(pairs)) {
+        const auto t = static_cast<quint32>(p >> 32);
+        if (m_trigrams.isEmpty() || m_trigrams.last() != t) {
+            m_trigrams.append(t);
+            m_postingStart.append(m_postings.count());
+        }
+        m_postings.append(static_cast<int>(p & 0xffffffff));
+    }
+    m_postingStart.append(m_postings.count());
+
+    // Hive copy is not needed anymore
+    m_buffer.clear();
+    m_hive.buffer = nullptr;
+
+    return true;
+}
+
+void CHiveIndex::setReady()
+{
+    m_ready = true;
+}
+
+void CHiveIndex::keyChanged(int nkofs)
+{
+    m_changed.insert(nkofs);
+}
+
+// Keys containing all of trigrams
+void CHiveIndex::lookup(QVector<quint32> &trigrams, QVector<int> &keys) const
+{
+    keys.clear();
+
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+    QVector<QPair<int, int> > ranges;
+    ranges.reserve(trigrams.count());
+
+    for (const quint32 t : qAsConst(trigrams)) {
+        const auto it = std::lower_bound(m_trigrams.constBegin(), m_trigrams.constEnd(), t);
+        if (it == m_trigrams.constEnd() || *it != t)
+            return;
+
+        const auto idx = static_cast<int>(it - m_trigrams.constBegin());
+        ranges.append(qMakePair(m_postingStart.at(idx), m_postingStart.at(idx + 1)));
+    }
+
+    if (ranges.isEmpty())
+        return;
+
+    // Start from the shortest posting list
+    std::sort(ranges.begin(), ranges.end(), [](const QPair<int, int> &a, const QPair<int, int> &b) {
+        return (a.second - a.first) < (b.second - b.first);
+    });
+
+    const int *postings = m_postings.constData();
+    keys = QVector<int>(postings + ranges.first().first, postings + ranges.first().second);
+
+    QVector<int> tmp;
+    for (int i = 1; i < ranges.count() && !keys.isEmpty(); i++) {
+        tmp.clear();
+        std::set_intersection(keys.constBegin(), keys.constEnd(),
+                              postings + ranges.at(i).first, postings + ranges.at(i).second,
+                              std::back_inserter(tmp));
+        keys.swap(tmp);
+    }
+}
+
+bool CHiveIndex::candidates(const QString &text, bool isNumber, quint32 number, QVector<int> &keys) const
+{
+    keys.clear();
+
+    if (!m_ready || text.length() < 3)
+        return false;
+
+    // Surrogate pairs are folded as a whole by QString, don't bother with them
+    for (const QChar &c : text) {
+        if (c.isSurrogate() || c.isNull())
+            return false;
+    }
+
+    QVector<quint32> trigrams;
+    addTrigrams(text, trigrams);
+    lookup(trigrams, keys);
+
+    // Raw value data is matched against UTF-8 bytes of the search text
+    const QByteArray utf8 = text.toUtf8();
+    if (utf8.size() != text.length()) {
+        QVector<int> dataKeys;
+        trigrams.clear();
+        addLatin1Trigrams(utf8.constData(), static_cast<int>(utf8.size()), trigrams);
+        lookup(trigrams, dataKeys);
+        keys.append(dataKeys);
+    }
+
+    if (isNumber) {
+        const quint64 first = (static_cast<quint64>(number) << 32);
+        for (auto it = std::lower_bound(m_dwords.constBegin(), m_dwords.constEnd(), first);
+             it != m_dwords.constEnd() && static_cast<quint32>(*it >> 32) == number; ++it) {
+            keys.append(static_cast<int>(*it & 0xffffffff));
+        }
+    }
+
+    keys.append(m_unindexed);
+    for (const int nkofs : m_changed)
+        keys.append(nkofs);
+
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    return true;
+}
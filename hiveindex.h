@@ -0,0 +1,51 @@
+#ifndef HIVEINDEX_H
+#define HIVEINDEX_H
+
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+#include <QSet>
+#include <QAtomicInt>
+#include <QPair>
+
+extern "C" {
+#include <chntpw/ntreg.h>
+}
+
+/* Trigram index over key names, value names, string data and raw value data
+ * of one hive, plus a table of DWORD values.
+ * Built from a private copy of the hive buffer, so the hive may be edited
+ * while the index is built. Keys edited after the copy are remembered and
+ * always returned as candidates. Lookups return a superset of the keys
+ * CFinder::matchKey() accepts, which are then checked as usual.
+ * Not thread-safe, CFinder serializes access (except for build()).
+ */
+class CHiveIndex
+{
+private:
+    QByteArray m_buffer;
+    struct hive m_hive {};
+    QAtomicInt m_canceled { 0 };
+    bool m_ready { false };
+
+    QVector<quint32> m_trigrams;     // sorted unique trigram hashes
+    QVector<int> m_postingStart;     // m_trigrams.count() + 1 entries into m_postings
+    QVector<int> m_postings;         // nk offsets, sorted for each trigram
+    QVector<quint64> m_dwords;       // (value << 32) | nk offset, sorted
+    QVector<int> m_unindexed;        // keys with too large data, sorted
+    QSet<int> m_changed;             // keys edited after buffer copy
+
+    void lookup(QVector<quint32> &trigrams, QVector<int> &keys) const;
+
+public:
+    explicit CHiveIndex(struct hive *hdesc);
+
+    bool build();
+    void cancel() { m_canceled.storeRelease(1); }
+    bool isReady() const { return m_ready; }
+    void setReady();
+    void keyChanged(int nkofs);
+    bool candidates(const QString &text, bool isNumber, quint32 number, QVector<int> &keys) const;
+};
+
+#endif // HIVEINDEX_H
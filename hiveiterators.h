@@ -0,0 +1,334 @@
+#ifndef HIVEITERATORS_H
+#define HIVEITERATORS_H
+
+#include <QString>
+#include <QStringView>
+#include <QLatin1String>
+
+extern "C" {
+#include <chntpw/ntreg.h>
+}
+
+/* Lightweight, non-allocating walkers over the raw hive buffer.
+ * Views point directly into hdesc->buffer, so they are valid only until the
+ * next hive modification (add_bin() may reallocate the buffer).
+ * Offsets follow the CRegController convention: nk/vk offset = cell offset + 4.
+ */
+
+/* Key or value name as stored in nk/vk. ANSI (compressed) names are Latin-1,
+ * Windows compresses a name only when every character fits in a byte, so they
+ * are decoded as such, never with the locale.
+ */
+class CHiveName
+{
+private:
+    const char *m_raw { nullptr };
+    int m_len { 0 };
+    bool m_ansi { false };
+
+public:
+    CHiveName() = default;
+    CHiveName(const char *raw, int len, bool ansi) : m_raw(raw), m_len(len), m_ansi(ansi) {}
+
+    const char *raw() const { return m_raw; }
+    int rawLength() const { return m_len; }
+    bool isAnsi() const { return m_ansi; }
+    bool isEmpty() const { return (m_len <= 0); }
+    int length() const { return (m_ansi ? m_len : m_len / 2); }
+    char16_t unit(int i) const
+    {
+        return (m_ansi ? static_cast<unsigned char>(m_raw[i]) : reinterpret_cast<const char16_t *>(m_raw)[i]);
+    }
+
+    QString toString() const
+    {
+        if (m_len <= 0)
+            return QString();
+        if (m_ansi)
+            return QString::fromLatin1(m_raw, m_len);
+        return QString::fromUtf16(reinterpret_cast<const char16_t *>(m_raw), m_len / 2);
+    }
+
+    int compare(const QString &other, Qt::CaseSensitivity cs = Qt::CaseInsensitive) const
+    {
+        if (m_len <= 0)
+            return (other.isEmpty() ? 0 : -1);
+        if (m_ansi)
+            return QLatin1String(m_raw, m_len).compare(other, cs);
+        return QStringView(reinterpret_cast<const char16_t *>(m_raw), m_len / 2).compare(other, cs);
+    }
+
+    bool equals(const QString &other, Qt::CaseSensitivity cs = Qt::CaseInsensitive) const
+    {
+        return (compare(other, cs) == 0);
+    }
+
+    // Ordering of subkey lists: compare of uppercased UTF-16 units
+    int compareUpper(const QString &other) const
+    {
+        const int len = length();
+        const int olen = static_cast<int>(other.length());
+
+        for (int i = 0; i < len && i < olen; i++) {
+            const int a = QChar::toUpper(unit(i));
+            const int b = QChar::toUpper(other.at(i).unicode());
+            if (a != b)
+                return (a - b);
+        }
+        return (len - olen);
+    }
+
+    int compareUpper(const CHiveName &other) const
+    {
+        const int len = length();
+        const int olen = other.length();
+
+        for (int i = 0; i < len && i < olen; i++) {
+            const char16_t c = unit(i);
+            const char16_t oc = other.unit(i);
+            if (c == oc)
+                continue;
+            const int a = QChar::toUpper(c);
+            const int b = QChar::toUpper(oc);
+            if (a != b)
+                return (a - b);
+        }
+        return (len - olen);
+    }
+
+    // Hash stored in lh lists. Only usable for ASCII names, since our
+    // uppercase table differs from the Windows one outside of it.
+    static bool lhHash(const QString &name, qint32 &hash)
+    {
+        quint32 h = 0;
+        for (const QChar &c : name) {
+            if (c.unicode() >= 0x80)
+                return false;
+            h = h * 37 + QChar::toUpper(c.unicode());
+        }
+        hash = static_cast<qint32>(h);
+        return true;
+    }
+};
+
+class CSubkeyView
+{
+private:
+    struct hive *m_hive { nullptr };
+    int m_ofs { 0 };
+
+public:
+    CSubkeyView() = default;
+    CSubkeyView(struct hive *hdesc, int nkofs) : m_hive(hdesc), m_ofs(nkofs) {}
+
+    int offset() const { return m_ofs; }
+    struct nk_key *key() const { return reinterpret_cast<struct nk_key *>(m_hive->buffer + m_ofs); }
+    CHiveName name() const
+    {
+        const struct nk_key *k = key();
+        return CHiveName(k->keyname, k->len_name, (k->type & 0x20) != 0);
+    }
+};
+
+class CValueView
+{
+private:
+    struct hive *m_hive { nullptr };
+    int m_ofs { 0 };
+
+public:
+    CValueView() = default;
+    CValueView(struct hive *hdesc, int vkofs) : m_hive(hdesc), m_ofs(vkofs) {}
+
+    int offset() const { return m_ofs; }
+    struct vk_key *vk() const { return reinterpret_cast<struct vk_key *>(m_hive->buffer + m_ofs); }
+    int type() const { return vk()->val_type; }
+    int size() const { return (vk()->len_data & 0x7fffffff); }
+    CHiveName name() const
+    {
+        const struct vk_key *v = vk();
+        return CHiveName(v->keyname, v->len_name, (v->flag & 1) != 0);
+    }
+
+    // Same data as ex_next_v() fills, but without the name copy (vex.name is null)
+    struct vex_data toVex() const
+    {
+        struct vex_data vex {};
+        struct vk_key *v = vk();
+        vex.vk = v;
+        vex.vkoffs = m_ofs;
+        vex.type = v->val_type;
+        vex.size = (v->len_data & 0x7fffffff);
+        if (vex.size != 0 && v->val_type == REG_DWORD && (v->len_data & 0x80000000) != 0)
+            vex.val = v->ofs_data;
+        return vex;
+    }
+};
+
+/* Subkeys of nk, handles plain lf/lh/li lists and ri index of li/lf/lh lists */
+class CSubkeyRange
+{
+private:
+    struct hive *m_hive { nullptr };
+    int m_ofsList { 0 };
+    int m_count { 0 };
+
+public:
+    class iterator
+    {
+    private:
+        struct hive *m_hive { nullptr };
+        const struct ri_key *m_ri { nullptr };
+        const struct lf_key *m_list { nullptr }; // lf, lh and li share id/no_keys/ofs_nk layout
+        int m_riIdx { 0 };
+        int m_idx { 0 };
+        int m_count { 0 };
+        int m_ofs { -1 };
+
+        void loadList()
+        {
+            m_list = nullptr;
+            while (m_ri != nullptr && m_riIdx < m_ri->no_lis) {
+                m_list = reinterpret_cast<const struct lf_key *>(
+                    m_hive->buffer + m_ri->hash[m_riIdx].ofs_li + 0x1004);
+                m_count = m_list->no_keys;
+                m_idx = 0;
+                if (m_count > 0)
+                    return;
+                m_riIdx++;
+            }
+            m_list = nullptr;
+        }
+
+        void settle()
+        {
+            if (m_list == nullptr || m_idx >= m_count) {
+                m_ofs = -1;
+                return;
+            }
+
+            const int ofs = (m_list->id == 0x696c
+                             ? reinterpret_cast<const struct li_key *>(m_list)->hash[m_idx].ofs_nk
+                             : m_list->hash[m_idx].ofs_nk) + 0x1004;
+
+            // Stop on broken lists, like ex_next_n() does
+            if (reinterpret_cast<const struct nk_key *>(m_hive->buffer + ofs)->id != 0x6b6e) {
+                m_ofs = -1;
+                return;
+            }
+            m_ofs = ofs;
+        }
+
+    public:
+        iterator() = default;
+        iterator(struct hive *hdesc, int ofsList, int count)
+            : m_hive(hdesc)
+        {
+            const auto *lst = reinterpret_cast<const struct lf_key *>(hdesc->buffer + ofsList);
+            if (lst->id == 0x6972) {
+                m_ri = reinterpret_cast<const struct ri_key *>(lst);
+                loadList();
+            } else {
+                m_list = lst;
+                m_count = count;
+            }
+            settle();
+        }
+
+        CSubkeyView operator*() const { return CSubkeyView(m_hive, m_ofs); }
+        bool operator==(const iterator &other) const { return (m_ofs == other.m_ofs); }
+        bool operator!=(const iterator &other) const { return (m_ofs != other.m_ofs); }
+
+        iterator &operator++()
+        {
+            m_idx++;
+            if (m_ri != nullptr && m_idx >= m_count) {
+                m_riIdx++;
+                loadList();
+            }
+            settle();
+            return *this;
+        }
+    };
+
+    CSubkeyRange(struct hive *hdesc, const struct nk_key *key)
+        : m_hive(hdesc)
+    {
+        if (key->id == 0x6b6e && key->no_subkeys > 0) {
+            m_ofsList = key->ofs_lf + 0x1004;
+            m_count = key->no_subkeys;
+        }
+    }
+
+    iterator begin() const { return (m_count > 0 ? iterator(m_hive, m_ofsList, m_count) : iterator()); }
+    iterator end() const { return iterator(); }
+};
+
+class CValueRange
+{
+private:
+    struct hive *m_hive { nullptr };
+    const int32_t *m_vlist { nullptr };
+    int m_count { 0 };
+
+public:
+    class iterator
+    {
+    private:
+        struct hive *m_hive { nullptr };
+        const int32_t *m_vlist { nullptr };
+        int m_idx { 0 };
+        int m_count { 0 };
+        int m_ofs { -1 };
+
+        void settle()
+        {
+            if (m_idx >= m_count) {
+                m_ofs = -1;
+                return;
+            }
+
+            const int ofs = m_vlist[m_idx] + 0x1004;
+
+            // Stop on non-vk nodes, like ex_next_v() does
+            if (reinterpret_cast<const struct vk_key *>(m_hive->buffer + ofs)->id != 0x6b76) {
+                m_ofs = -1;
+                return;
+            }
+            m_ofs = ofs;
+        }
+
+    public:
+        iterator() = default;
+        iterator(struct hive *hdesc, const int32_t *vlist, int count)
+            : m_hive(hdesc), m_vlist(vlist), m_count(count)
+        {
+            settle();
+        }
+
+        CValueView operator*() const { return CValueView(m_hive, m_ofs); }
+        bool operator==(const iterator &other) const { return (m_ofs == other.m_ofs); }
+        bool operator!=(const iterator &other) const { return (m_ofs != other.m_ofs); }
+
+        iterator &operator++()
+        {
+            m_idx++;
+            settle();
+            return *this;
+        }
+    };
+
+    CValueRange(struct hive *hdesc, const struct nk_key *key)
+        : m_hive(hdesc)
+    {
+        if (key->id == 0x6b6e && key->no_values > 0) {
+            m_vlist = reinterpret_cast<const int32_t *>(hdesc->buffer + key->ofs_vallist + 0x1004);
+            m_count = key->no_values;
+        }
+    }
+
+    iterator begin() const { return (m_count > 0 ? iterator(m_hive, m_vlist, m_count) : iterator()); }
+    iterator end() const { return iterator(); }
+};
+
+#endif // HIVEITERATORS_H
@@ -1,11 +1,21 @@
 #include "mainwindow.h"
 #include "global.h"
+#include "batch.h"
 #include <QApplication>
 
 int main(int argc, char *argv[])
 {
     qInstallMessageHandler(stdConsoleOutput);
 
+    // Batch mode doesn't create any widgets, so it runs without a display
+    if (argc > 1 && qstrcmp(argv[1], "--batch") == 0) {
+        QCoreApplication a(argc, argv);
+        cgl = new CGlobal(&a, false);
+
+        CBatchRunner runner(cgl->reg.data());
+        return runner.run(QCoreApplication::arguments().mid(2));
+    }
+
     QApplication a(argc, argv);
     CMainWindow w;
     w.show();
@@ -5,6 +5,7 @@
 #include <QMessageBox>
 #include <QClipboard>
 #include <QShortcut>
+#include <QFileInfo>
 
 #include "global.h"
 #include "regutils.h"
@@ -12,6 +13,8 @@
 #include "valueeditor.h"
 #include "logdisplay.h"
 #include "userdialog.h"
+#include "searchdialog.h"
+#include "batchdialog.h"
 #include "ui_mainwindow.h"
 
 CMainWindow::CMainWindow(QWidget *parent) :
@@ -30,12 +33,17 @@ CMainWindow::CMainWindow(QWidget *parent) :
     groupsModel = new CSAMGroupsModel(this);
     usersModel = new CSAMUsersModel(this);
     valuesSortModel = new QSortFilterProxyModel(this);
+    resultsModel = new CSearchResultsModel(this);
 
     valuesSortModel->setSourceModel(valuesModel);
     ui->treeHives->setModel(treeModel);
     ui->tableValues->setModel(valuesSortModel);
     ui->treeGroups->setModel(groupsModel);
     ui->tableUsers->setModel(usersModel);
+    ui->tableResults->setModel(resultsModel);
+
+    ui->dockResults->hide();
+    ui->menuTools->insertAction(ui->actionSettings, ui->dockResults->toggleViewAction());
 
     ui->treeHives->setContextMenuPolicy(Qt::CustomContextMenu);
     ui->tableValues->setContextMenuPolicy(Qt::CustomContextMenu);
@@ -49,6 +57,10 @@ CMainWindow::CMainWindow(QWidget *parent) :
     connect(ui->actionOpenHive, &QAction::triggered, this, &CMainWindow::openHive);
     connect(ui->actionOpenHiveRO, &QAction::triggered, this, &CMainWindow::openHive);
     connect(ui->actionImport, &QAction::triggered, this, &CMainWindow::importReg);
+    connect(ui->actionBatch, &QAction::triggered, [this]() {
+        CBatchDialog dlg(this);
+        dlg.exec();
+    });
     connect(ui->actionAbout, &QAction::triggered, this, &CMainWindow::about);
     connect(ui->actionAboutQt, &QAction::triggered, qApp, &QApplication::aboutQt);
     connect(ui->actionSettings, &QAction::triggered, [this]() {
@@ -67,6 +79,21 @@ CMainWindow::CMainWindow(QWidget *parent) :
             searchProgressDialog, &CProgressDialog::hide, Qt::QueuedConnection);
     connect(this, &CMainWindow::startSearch,
             treeModel->finder.data(), &CFinder::searchText, Qt::QueuedConnection);
+    connect(ui->actionFindAll, &QAction::triggered, this, &CMainWindow::searchAll);
+    connect(this, &CMainWindow::startFindAll,
+            treeModel->finder.data(), &CFinder::findAll, Qt::QueuedConnection);
+    connect(treeModel->finder.data(), &CFinder::matchesFound,
+            resultsModel.data(), &CSearchResultsModel::appendMatches, Qt::QueuedConnection);
+    connect(treeModel->finder.data(), &CFinder::searchReset,
+            resultsModel.data(), &CSearchResultsModel::clear, Qt::QueuedConnection);
+    connect(treeModel->finder.data(), &CFinder::findAllFinished,
+            this, &CMainWindow::findAllFinished, Qt::QueuedConnection);
+    connect(treeModel->finder.data(), &CFinder::searchProgress,
+            searchProgressDialog, [this](int value, int maximum) {
+        searchProgressDialog->setMaximum(maximum);
+        searchProgressDialog->setValue(value);
+    }, Qt::QueuedConnection);
+    connect(ui->tableResults, &QTableView::activated, this, &CMainWindow::showSearchResult);
     connect(searchProgressDialog, &CProgressDialog::cancel, [this]() {
         treeModel->finder->cancelSearch();
     });
@@ -191,7 +218,27 @@ void CMainWindow::importReg()
     const QString fname = getOpenFileNameD(this, tr("Import REG file to selected hive"));
 
     if (!fname.isEmpty()) {
-        if (!cgl->reg->importReg(cgl->reg->getHivePtr(idx), fname)) {
+        treeModel->finder->hiveChanged(cgl->reg->getHivePtr(idx));
+
+        CProgressDialog progress(this);
+        progress.setWindowTitle(tr("Registry Editor - Import"));
+        progress.setLabelText(tr("Importing registry file"));
+        progress.setMaximum(1000);
+        connect(cgl->reg.data(), &CRegController::importProgress, &progress, [&progress](qint64 done, qint64 total) {
+            progress.setValue(total > 0 ? static_cast<int>(done * 1000 / total) : 0);
+        });
+        connect(&progress, &CProgressDialog::cancel, cgl->reg.data(), &CRegController::cancelImport);
+        progress.show();
+
+        const bool res = cgl->reg->importReg(cgl->reg->getHivePtr(idx), fname);
+        progress.hide();
+
+        if (!res && progress.wasCanceled()) {
+            QMessageBox::warning(this, tr("Registry Editor - Import"),
+                                 tr("Registry file import canceled.\n"
+                                    "Hive %1 is partially modified, please, do not save it!")
+                                 .arg(cgl->reg->getHivePrefix(cgl->reg->getHivePtr(idx))));
+        } else if (!res) {
             QMessageBox::critical(this, tr("Registry Editor - Error"),
                                   tr("Failed to import file. See log for error messages.\n"
                                      "Please, do not save hive %1!")
@@ -203,7 +250,9 @@ void CMainWindow::importReg()
                                      .arg(cgl->reg->getHivePrefix(cgl->reg->getHivePtr(idx))));
         }
 
+        treeModel->finder->indexHive(cgl->reg->getHivePtr(idx));
         ui->treeHives->collapseAll();
+        valuesModel->keyChanged(ui->treeHives->currentIndex());
     }
 }
 
@@ -229,7 +278,7 @@ void CMainWindow::showValues(const QModelIndex &key)
 
 void CMainWindow::hivePrepareClose(int idx)
 {
-    Q_UNUSED(idx)
+    treeModel->finder->hiveChanged(cgl->reg->getHivePtr(idx));
 
     valuesModel->keyChanged(QModelIndex());
     groupsModel->keyChanged(QModelIndex());
@@ -318,16 +367,38 @@ void CMainWindow::treeCtxMenuPrivate(const QPoint &pos, bool fromValuesTable)
         cm->addSeparator();
         acm = cm->addAction(tr("Find..."));
         connect(acm, &QAction::triggered, [this, idx]() {
-            bool ok = false;
-            const QString s = QInputDialog::getText(this, tr("Registry Editor - Search"),
-                                              tr("Search text"), QLineEdit::Normal, QString(), &ok);
-
-            if (ok && !s.isEmpty())
-                Q_EMIT startSearch(idx, s);
+            searchQuery(idx, false);
         });
 
         struct hive *h = cgl->reg->getHivePtr(hive);
 
+        if (h != nullptr && !idx.parent().isValid()) {
+            acm = cm->addAction(tr("Hive info..."));
+            connect(acm, &QAction::triggered, [this, h]() {
+                QMessageBox::information(this, tr("Registry Editor - Hive info"),
+                                         cgl->reg->getHiveInfo(h));
+            });
+
+            acm = cm->addAction(tr("Save compacted as..."));
+            connect(acm, &QAction::triggered, [this, hive, h]() {
+                const QString fname = getSaveFileNameD(this, tr("Save compacted hive"), QString::fromUtf8(h->filename));
+
+                if (fname.isEmpty())
+                    return;
+
+                const int oldSize = h->size;
+                if (cgl->reg->compactTopHive(hive, fname) < 0) {
+                    QMessageBox::critical(this, tr("Registry Editor - Error"),
+                                          tr("Failed to save compacted hive. See log for error messages."));
+                } else {
+                    QMessageBox::information(this, tr("Registry Editor - Compact"),
+                                             tr("Compacted hive saved to %1.\n"
+                                                "Size: %2 bytes, was %3 bytes.")
+                                             .arg(fname).arg(QFileInfo(fname).size()).arg(oldSize));
+                }
+            });
+        }
+
         if (h != nullptr && h->type == HTYPE_SOFTWARE) {
             cm->addSeparator();
             acm = cm->addAction(tr("Show OS info..."));
@@ -469,16 +540,32 @@ void CMainWindow::keyFound(const QModelIndex &key, const QString &value)
 
 void CMainWindow::searchTxt()
 {
-    const QModelIndex idx = ui->treeHives->currentIndex();
+    searchQuery(ui->treeHives->currentIndex(), false);
+}
+
+void CMainWindow::searchAll()
+{
+    searchQuery(ui->treeHives->currentIndex(), true);
+}
 
+void CMainWindow::searchQuery(const QModelIndex &idx, bool findAll)
+{
     if (!idx.isValid()) return;
 
-    bool ok = false;
-    const QString s = QInputDialog::getText(this, tr("Registry Editor - Search"),
-                                            tr("Search text"), QLineEdit::Normal, QString(), &ok);
+    CSearchDialog dlg(this, (findAll ? tr("Registry Editor - Find all") : tr("Registry Editor - Search")));
+    dlg.setQuery(m_lastQuery);
+
+    if (dlg.exec() != QDialog::Accepted) return;
 
-    if (ok && !s.isEmpty())
-        Q_EMIT startSearch(idx, s);
+    m_lastQuery = dlg.getQuery();
+    searchProgressDialog->setMaximum(0);
+
+    if (findAll) {
+        ui->dockResults->show();
+        Q_EMIT startFindAll(idx, m_lastQuery);
+    } else {
+        Q_EMIT startSearch(idx, m_lastQuery);
+    }
 }
 
 void CMainWindow::searchFinished()
@@ -486,6 +573,23 @@ void CMainWindow::searchFinished()
     QMessageBox::information(this, tr("Registry Editor - Search"), tr("Search completed."));
 }
 
+void CMainWindow::findAllFinished(int count)
+{
+    statusBar()->showMessage(tr("Search completed, %1 matches found.").arg(count));
+}
+
+void CMainWindow::showSearchResult(const QModelIndex &index)
+{
+    struct hive *h = nullptr;
+    struct nk_key *k = nullptr;
+    QString value;
+
+    if (!resultsModel->getMatch(index, h, k, value))
+        return;
+
+    keyFound(treeModel->getKeyIndex(h, k), value);
+}
+
 void CMainWindow::deleteValue(const QModelIndex &value)
 {
     if (!value.isValid()) return;
@@ -506,9 +610,17 @@ void CMainWindow::editUser(const QModelIndex &index)
 
     if (rid < 0) return;
 
+    struct hive *h = cgl->reg->getHivePtr(usersModel->getHiveIdx());
+    treeModel->finder->hiveChanged(h);
+
     auto *dlg = new CUserDialog(this, usersModel->getHiveIdx(), rid);
     dlg->exec();
 
     dlg->setParent(nullptr);
     delete dlg;
+
+    treeModel->finder->indexHive(h);
+
+    // Account editor writes SAM values directly
+    valuesModel->keyChanged(ui->treeHives->currentIndex());
 }
@@ -33,15 +33,19 @@ private:
     QPointer<CSAMGroupsModel> groupsModel;
     QPointer<CSAMUsersModel> usersModel;
     QPointer<QSortFilterProxyModel> valuesSortModel;
+    QPointer<CSearchResultsModel> resultsModel;
     QPointer<CProgressDialog> searchProgressDialog;
+    CFinderQuery m_lastQuery;
 
     void treeCtxMenuPrivate(const QPoint& pos, bool fromValuesTable);
+    void searchQuery(const QModelIndex &idx, bool findAll);
 
 protected:
     void closeEvent(QCloseEvent *event) override;
 
 Q_SIGNALS:
-    void startSearch(const QModelIndex &idx, const QString &text);
+    void startSearch(const QModelIndex &idx, const CFinderQuery &query);
+    void startFindAll(const QModelIndex &idx, const CFinderQuery &query);
 
 public Q_SLOTS:
     void openHive();
@@ -55,7 +59,10 @@ public Q_SLOTS:
     void about();
     void keyFound(const QModelIndex& key, const QString& value);
     void searchTxt();
+    void searchAll();
     void searchFinished();
+    void findAllFinished(int count);
+    void showSearchResult(const QModelIndex& index);
     void deleteValue(const QModelIndex& value);
     void editUser(const QModelIndex& index);
 
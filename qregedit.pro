@@ -23,25 +23,44 @@ SOURCES += main.cpp\
     functions.cpp \
     progressdialog.cpp \
     finder.cpp \
+    hiveindex.cpp \
+    textmatcher.cpp \
+    regexport.cpp \
+    regimport.cpp \
     logdisplay.cpp \
     chntpw/libsam.c \
     sammodel.cpp \
-    userdialog.cpp
+    userdialog.cpp \
+    searchdialog.cpp \
+    batch.cpp \
+    hivebatch.cpp \
+    batchdialog.cpp \
+    hivediff.cpp
 
 HEADERS  += mainwindow.h \
     chntpw/ntreg.h \
     registrymodel.h \
     global.h \
     regutils.h \
+    hiveiterators.h \
     valueeditor.h \
     settingsdlg.h \
     functions.h \
     progressdialog.h \
     finder.h \
+    hiveindex.h \
+    textmatcher.h \
+    regexport.h \
+    regimport.h \
     logdisplay.h \
     chntpw/sam.h \
     sammodel.h \
-    userdialog.h
+    userdialog.h \
+    searchdialog.h \
+    batch.h \
+    hivebatch.h \
+    batchdialog.h \
+    hivediff.h
 
 FORMS    += mainwindow.ui \
     valueeditor.ui \
@@ -49,7 +68,9 @@ FORMS    += mainwindow.ui \
     progressdialog.ui \
     logdisplay.ui \
     userdialog.ui \
-    listdialog.ui
+    listdialog.ui \
+    searchdialog.ui \
+    batchdialog.ui
 
 OTHER_FILES += \
     LICENSE \
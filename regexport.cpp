@@ -0,0 +1,440 @@
+#include <cstring>
+#include <QSet>
+#include <QPair>
+#include <QBuffer>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <QtEndian>
+#include <QDebug>
+#include "regexport.h"
+#include "hiveiterators.h"
+#include "textmatcher.h"
+#include "global.h"
+
+static const int unitBufferUnits = 32 * 1024; // buffer of one parallel export unit
+static const int unitsPerThread = 16;         // split subtree finer than threads, for balance
+static const int maxSplitDepth = 4;
+static const int maxHexColumn = 77;        // wrap hex lines before 80 columns, like regedit
+static const char hexDigits[] = "0123456789abcdef";
+
+// Two UTF-16 digits for every byte value
+static const quint16 *hexTable()
+{
+    static const struct HexTable {
+        quint16 d[512];
+        HexTable()
+        {
+            for (int i = 0; i < 256; i++) {
+                d[i * 2] = static_cast<quint16>(hexDigits[i >> 4]);
+                d[i * 2 + 1] = static_cast<quint16>(hexDigits[i & 15]);
+            }
+        }
+    } table;
+
+    return table.d;
+}
+
+CRegExporter::CRegExporter(struct hive *hdesc, QIODevice *device, int bufferUnits)
+    : m_hive(hdesc)
+    , m_device(device)
+    , m_buffer(bufferUnits)
+{
+    m_pos = m_buffer.data();
+    m_end = m_pos + m_buffer.count();
+}
+
+bool CRegExporter::flush()
+{
+    const auto units = static_cast<qint64>(m_pos - m_buffer.data());
+    m_pos = m_buffer.data();
+
+    if (units == 0 || m_error)
+        return !m_error;
+
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    qToLittleEndian<quint16>(m_buffer.constData(), units, m_buffer.data());
+#endif
+
+    const qint64 bytes = units * 2;
+    if (m_device->write(reinterpret_cast<const char *>(m_buffer.constData()), bytes) != bytes) {
+        qCritical() << "exportKey: failed to write file" << m_device->errorString();
+        m_error = true;
+        return false;
+    }
+
+    m_written += bytes;
+    return true;
+}
+
+bool CRegExporter::writeBytes(const QByteArray &data)
+{
+    if (m_error)
+        return false;
+
+    if (m_device->write(data) != data.size()) {
+        qCritical() << "exportKey: failed to write file" << m_device->errorString();
+        m_error = true;
+        return false;
+    }
+
+    m_written += data.size();
+    return true;
+}
+
+void CRegExporter::putAscii(const char *str)
+{
+    const auto len = static_cast<int>(strlen(str));
+    reserve(len);
+    for (int i = 0; i < len; i++)
+        put(static_cast<quint16>(str[i]));
+}
+
+void CRegExporter::putString(const QString &str)
+{
+    const auto *src = reinterpret_cast<const quint16 *>(str.constData());
+    auto left = static_cast<int>(str.length());
+
+    while (left > 0) {
+        if (m_pos == m_end)
+            flush();
+        const int n = qMin(left, static_cast<int>(m_end - m_pos));
+        memcpy(m_pos, src, static_cast<size_t>(n) * 2);
+        m_pos += n;
+        src += n;
+        left -= n;
+    }
+}
+
+/* Value name with '\' and '"' escaped, returns number of units written.
+ * Names can be longer than the buffer, so room is checked for every char. */
+int CRegExporter::putEscaped(const CHiveName &name)
+{
+    const bool ansi = name.isAnsi();
+    const char *raw = name.raw();
+    const int len = (ansi ? name.rawLength() : name.rawLength() / 2);
+    int written = len;
+
+    for (int i = 0; i < len; i++) {
+        const quint16 c = (ansi ? static_cast<uchar>(raw[i]) : qFromLittleEndian<quint16>(raw + i * 2));
+        reserve(2);
+        if (c == '\\' || c == '"') {
+            put('\\');
+            written++;
+        }
+        put(c);
+    }
+
+    return written;
+}
+
+void CRegExporter::putHex(const char *data, int len, int type, int col)
+{
+    const quint16 *table = hexTable();
+    const auto *bytes = reinterpret_cast<const uchar *>(data);
+
+    if (type == REG_BINARY) {
+        putAscii("hex:");
+        col += 4;
+    } else {
+        char prefix[16] = "hex(";
+        int p = 4;
+        auto t = static_cast<quint32>(type);
+        int shift = 28;
+        while (shift > 0 && ((t >> shift) & 15) == 0)
+            shift -= 4;
+        for (; shift >= 0; shift -= 4)
+            prefix[p++] = hexDigits[(t >> shift) & 15];
+        prefix[p++] = ')';
+        prefix[p++] = ':';
+        prefix[p] = 0;
+        putAscii(prefix);
+        col += p;
+    }
+
+    for (int i = 0; i < len; i++) {
+        reserve(8);
+        m_pos[0] = table[bytes[i] * 2];
+        m_pos[1] = table[bytes[i] * 2 + 1];
+        m_pos += 2;
+        col += 2;
+
+        if ((i + 1) < len) {
+            put(',');
+            if (++col >= maxHexColumn) {
+                put('\\');
+                put('\r');
+                put('\n');
+                put(' ');
+                put(' ');
+                col = 2;
+            }
+        }
+    }
+
+    putAscii("\r\n");
+}
+
+/* REG_SZ as quoted string, up to the first NUL. Returns false without
+ * writing anything when it has non-printable chars, so it goes as hex(1). */
+bool CRegExporter::putStringValue(const char *data, int len)
+{
+    const int units = CTextMatcher::utf16Length(data, len / 2);
+
+    for (int i = 0; i < units; i++) {
+        const quint16 c = qFromLittleEndian<quint16>(data + i * 2);
+
+        if (c >= 0x20 && c < 0x7f)
+            continue;
+
+        if (QChar::isHighSurrogate(c) && (i + 1) < units) {
+            const quint16 low = qFromLittleEndian<quint16>(data + (i + 1) * 2);
+            if (QChar::isLowSurrogate(low) && QChar::isPrint(QChar::surrogateToUcs4(c, low))) {
+                i++;
+                continue;
+            }
+        }
+
+        if (QChar::isSurrogate(c) || !QChar::isPrint(static_cast<uint>(c)))
+            return false;
+    }
+
+    reserve(2);
+    put('"');
+    for (int i = 0; i < units; i++) {
+        const quint16 c = qFromLittleEndian<quint16>(data + i * 2);
+        reserve(2);
+        if (c == '\\' || c == '"')
+            put('\\');
+        put(c);
+    }
+    putAscii("\"\r\n");
+
+    return true;
+}
+
+// Key header, or key removal header with '-' before the path
+void CRegExporter::writeKeyHeader(const QString &path, bool remove)
+{
+    m_keyPath = path;
+    putAscii(remove ? "\r\n[-" : "\r\n[");
+    putString(path);
+    putAscii("]\r\n");
+}
+
+// Returns number of units written for the name with '=' after it
+int CRegExporter::putValueName(const CHiveName &name)
+{
+    if (name.isEmpty()) {
+        putAscii("@=");
+        return 2;
+    }
+
+    reserve(1);
+    put('"');
+    const int col = putEscaped(name) + 3;
+    putAscii("\"=");
+    return col;
+}
+
+// Value of the hive this exporter reads, under the last key header
+void CRegExporter::writeValue(const CValueView &value)
+{
+    const struct vex_data vex = value.toVex();
+    int len = 0;
+    const char *data = cgl->reg->getValueRawData(m_hive, vex, m_data, len);
+
+    if (len == 0 && vex.size > 0) { // failed to assemble data blocks
+        const CHiveName name = value.name();
+        qCritical() << "exportKey: value" << (name.isEmpty() ? QSL("@") : name.toString())
+                    << "of key" << m_keyPath << "could not be read, it is left out";
+        m_dropped++;
+        return;
+    }
+
+    const int col = putValueName(value.name());
+
+    if (vex.type == REG_DWORD && len == 4) {
+        const quint16 *table = hexTable();
+        const auto *bytes = reinterpret_cast<const uchar *>(data);
+        putAscii("dword:");
+        reserve(10);
+        for (int i = 3; i >= 0; i--) {
+            put(table[bytes[i] * 2]);
+            put(table[bytes[i] * 2 + 1]);
+        }
+        put('\r');
+        put('\n');
+    } else if (vex.type != REG_SZ || !putStringValue(data, len)) {
+        putHex(data, len, vex.type, col);
+    }
+}
+
+// Value removal line, name may point to another hive
+void CRegExporter::writeValueRemoval(const CHiveName &name)
+{
+    putValueName(name);
+    putAscii("-\r\n");
+}
+
+void CRegExporter::writeKey(struct nk_key *key, const QString &path)
+{
+    writeKeyHeader(path);
+
+    for (const CValueView &vv : CValueRange(m_hive, key))
+        writeValue(vv);
+}
+
+bool CRegExporter::writeHeader()
+{
+    reserve(1);
+    put(0xfeff);
+    putAscii("Windows Registry Editor Version 5.00\r\n");
+    return !m_error;
+}
+
+/* Preorder walk, children are pushed in reverse so they pop in list order.
+ * path is the full path of key, including hive prefix. */
+bool CRegExporter::writeSubtree(struct nk_key *key, const QString &path)
+{
+    QVector<QPair<int, QString> > stack;
+    QVector<int> children;
+    QSet<int> visited;
+
+    stack.append(qMakePair(static_cast<int>(reinterpret_cast<char *>(key) - m_hive->buffer), path));
+
+    while (!stack.isEmpty() && !m_error) {
+        const QPair<int, QString> cur = stack.takeLast();
+        auto *k = reinterpret_cast<struct nk_key *>(m_hive->buffer + cur.first);
+
+        if (k->id != 0x6b6e || visited.contains(cur.first))
+            continue;
+        visited.insert(cur.first);
+
+        writeKey(k, cur.second);
+
+        children.clear();
+        for (const CSubkeyView &sk : CSubkeyRange(m_hive, k))
+            children.append(sk.offset());
+
+        const QString base = (cur.second.endsWith(QChar('\\')) ? cur.second : cur.second + QChar('\\'));
+        for (int i = children.count() - 1; i >= 0; i--)
+            stack.append(qMakePair(children.at(i), base + CSubkeyView(m_hive, children.at(i)).name().toString()));
+    }
+
+    return !m_error;
+}
+
+/* Splits subtree to units in preorder: a split subtree becomes its key alone,
+ * followed by subtrees of its subkeys. */
+QVector<CRegExporter::ExportUnit> CRegExporter::splitSubtree(int nkofs, const QString &path, int minUnits)
+{
+    QVector<ExportUnit> units { { nkofs, path, true } };
+
+    for (int depth = 0; depth < maxSplitDepth && units.count() < minUnits; depth++) {
+        QVector<ExportUnit> next;
+        bool split = false;
+
+        for (const ExportUnit &u : qAsConst(units)) {
+            const auto *k = reinterpret_cast<const struct nk_key *>(m_hive->buffer + u.nkofs);
+
+            if (!u.subtree || k->id != 0x6b6e || k->no_subkeys <= 0) {
+                next.append(u);
+                continue;
+            }
+
+            next.append({ u.nkofs, u.path, false });
+
+            const QString base = (u.path.endsWith(QChar('\\')) ? u.path : u.path + QChar('\\'));
+            for (const CSubkeyView &sk : CSubkeyRange(m_hive, k))
+                next.append({ sk.offset(), base + sk.name().toString(), true });
+            split = true;
+        }
+
+        units.swap(next);
+        if (!split)
+            break;
+    }
+
+    return units;
+}
+
+/* Units are formatted on pool threads into their own buffers, and written
+ * here in order as they are done. Only a few threads worth of units are
+ * in flight, so finished text doesn't pile up in memory. */
+bool CRegExporter::writeSubtreeParallel(struct nk_key *key, const QString &path, int threads)
+{
+    if (threads < 2)
+        return writeSubtree(key, path);
+
+    const QVector<ExportUnit> units = splitSubtree(static_cast<int>(reinterpret_cast<char *>(key) - m_hive->buffer),
+                                                   path, threads * unitsPerThread);
+    const int window = threads * 4;
+    QVector<QByteArray> results(units.count());
+    QVector<bool> done(units.count(), false);
+    QMutex lock;
+    QWaitCondition ready;
+    QThreadPool pool;
+    int submitted = 0;
+
+    pool.setMaxThreadCount(threads);
+
+    const auto submit = [&](int i) {
+        pool.start([this, &units, &results, &done, &lock, &ready, i]() {
+            const ExportUnit &u = units.at(i);
+            auto *k = reinterpret_cast<struct nk_key *>(m_hive->buffer + u.nkofs);
+            QByteArray text;
+            QBuffer buffer(&text);
+            buffer.open(QIODevice::WriteOnly);
+
+            CRegExporter part(m_hive, &buffer, unitBufferUnits);
+            if (u.subtree) {
+                part.writeSubtree(k, u.path);
+            } else if (k->id == 0x6b6e) {
+                part.writeKey(k, u.path);
+            }
+            part.flush();
+
+            QMutexLocker locker(&lock);
+            results[i] = text;
+            m_dropped += part.m_dropped;
+            done[i] = true;
+            ready.wakeAll();
+        });
+    };
+
+    flush();
+
+    for (int i = 0; i < units.count() && !m_error; i++) {
+        while (submitted < units.count() && submitted < (i + window))
+            submit(submitted++);
+
+        QByteArray text;
+        {
+            QMutexLocker locker(&lock);
+            while (!done.at(i))
+                ready.wait(&lock);
+            text.swap(results[i]);
+        }
+
+        writeBytes(text);
+    }
+
+    pool.waitForDone();
+    return !m_error;
+}
+
+// Fails when some values were left out, even though the rest is written
+bool CRegExporter::finish()
+{
+    putAscii("\r\n");
+
+    if (!flush())
+        return false;
+
+    if (m_dropped > 0) {
+        qCritical() << "exportKey:" << m_dropped << "values could not be read, export is incomplete";
+        return false;
+    }
+    return true;
+}
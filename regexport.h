@@ -0,0 +1,77 @@
+#ifndef REGEXPORT_H
+#define REGEXPORT_H
+
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+#include <QIODevice>
+
+extern "C" {
+#include <chntpw/ntreg.h>
+}
+
+class CHiveName;
+class CValueView;
+
+/* Writes a key subtree as UTF-16LE .reg file. Text is formatted straight into
+ * a big buffer, which is written to the device in chunks, names and data are
+ * read from the hive buffer in place. Subtree is walked without recursion,
+ * in the same order as CSubkeyRange lists subkeys.
+ * Parallel mode only reads the hive from pool threads, the hive must not be
+ * changed until it returns.
+ */
+class CRegExporter
+{
+private:
+    struct hive *m_hive { nullptr };
+    QIODevice *m_device { nullptr };
+    QVector<quint16> m_buffer;
+    quint16 *m_pos { nullptr };
+    quint16 *m_end { nullptr };
+    qint64 m_written { 0 };
+    bool m_error { false };
+    int m_dropped { 0 }; // values left out, their data could not be read
+    QString m_keyPath;   // key of the last header, for messages
+    QByteArray m_data;   // values split to db blocks
+
+    struct ExportUnit {
+        int nkofs;
+        QString path;
+        bool subtree; // whole subtree or the key alone
+    };
+
+    bool flush();
+    bool writeBytes(const QByteArray &data);
+    QVector<ExportUnit> splitSubtree(int nkofs, const QString &path, int minUnits);
+    // Room for a few units, not more than the buffer holds
+    void reserve(int units)
+    {
+        if ((m_end - m_pos) < units)
+            flush();
+    }
+    void put(quint16 unit) { *m_pos++ = unit; }
+    void putAscii(const char *str);
+    void putString(const QString &str);
+    int putEscaped(const CHiveName &name);
+    int putValueName(const CHiveName &name);
+    void putHex(const char *data, int len, int type, int col);
+    bool putStringValue(const char *data, int len);
+    void writeKey(struct nk_key *key, const QString &path);
+
+public:
+    static const int defaultBufferUnits = 512 * 1024; // 1 MiB of UTF-16
+
+    CRegExporter(struct hive *hdesc, QIODevice *device, int bufferUnits = defaultBufferUnits);
+
+    bool writeHeader();
+    bool writeSubtree(struct nk_key *key, const QString &path);
+    bool writeSubtreeParallel(struct nk_key *key, const QString &path, int threads);
+    void writeKeyHeader(const QString &path, bool remove = false);
+    void writeValue(const CValueView &value);
+    void writeValueRemoval(const CHiveName &name);
+    bool finish();
+
+    qint64 bytesWritten() const { return m_written; }
+};
+
+#endif // REGEXPORT_H
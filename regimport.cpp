@@ -0,0 +1,373 @@
+#include <QCoreApplication>
+#include <QHash>
+#include <QDebug>
+#include "regimport.h"
+#include "hiveiterators.h"
+#include "global.h"
+
+static const qint64 chunkSize = 256 * 1024;
+static const int maxPendingValues = 4096; // flush huge keys in parts
+
+CRegLineReader::CRegLineReader(QFile *file)
+    : m_file(file)
+{
+}
+
+bool CRegLineReader::readChunk()
+{
+    const QByteArray data = m_file->read(chunkSize);
+
+    if (data.isEmpty())
+        return false;
+
+    // Encoding is taken from BOM: UTF-16 for regedit 5.00 files, UTF-8 otherwise
+    if (!m_started) {
+#if QT_VERSION >= 0x060000
+        const auto encoding = QStringConverter::encodingForData(data);
+        m_decoder = QStringDecoder(encoding ? *encoding : QStringConverter::Utf8);
+#else
+        m_decoder.reset(QTextCodec::codecForUtfText(data, QTextCodec::codecForName("UTF-8"))->makeDecoder());
+#endif
+    }
+
+    m_text.remove(0, m_pos);
+    m_pos = 0;
+
+#if QT_VERSION >= 0x060000
+    const QString part = m_decoder.decode(data);
+#else
+    const QString part = m_decoder->toUnicode(data);
+#endif
+    m_text.append(part);
+
+    if (!m_started) {
+        m_started = true;
+        if (m_text.startsWith(QChar(0xfeff)))
+            m_pos = 1;
+    }
+
+    return true;
+}
+
+bool CRegLineReader::nextLine(QStringView &line)
+{
+    auto eol = static_cast<int>(m_text.indexOf(QChar('\n'), m_pos));
+
+    while (eol < 0) {
+        const auto scanned = static_cast<int>(m_text.length()) - m_pos;
+        if (!readChunk())
+            break;
+        eol = static_cast<int>(m_text.indexOf(QChar('\n'), m_pos + scanned));
+    }
+
+    if (eol < 0) {
+        if (m_pos >= m_text.length())
+            return false;
+        eol = static_cast<int>(m_text.length());
+    }
+
+    line = QStringView(m_text).mid(m_pos, eol - m_pos);
+    m_pos = eol + 1;
+
+    if (line.endsWith(QChar('\r')))
+        line = line.left(line.length() - 1);
+
+    return true;
+}
+
+CRegImporter::CRegImporter(CRegController *reg, struct hive *hdesc)
+    : m_reg(reg)
+    , m_hive(hdesc)
+    , m_prefix(reg->getHivePrefix(hdesc))
+{
+    m_pathOfs.append(hdesc->rootofs + 4);
+}
+
+void CRegImporter::cancel()
+{
+    m_canceled = true;
+}
+
+bool CRegImporter::openKey(QStringView path)
+{
+    if (!path.startsWith(m_prefix, Qt::CaseInsensitive)
+            || (path.length() > m_prefix.length() && path.at(m_prefix.length()) != QChar('\\'))) {
+        qCritical() << tr("importReg: could not import key %1 to %2 registry hive").arg(path.toString(), m_prefix);
+        return false;
+    }
+
+    const QStringList names = path.mid(m_prefix.length()).toString().split(QChar('\\'), Qt::SkipEmptyParts);
+
+    // Keep the part shared with the previous key
+    int common = 0;
+    while (common < names.count() && common < m_pathNames.count()
+           && names.at(common).compare(m_pathNames.at(common), Qt::CaseInsensitive) == 0) {
+        common++;
+    }
+
+    while (m_pathNames.count() > common)
+        m_pathNames.removeLast();
+    m_pathOfs.resize(common + 1);
+
+    for (int i = common; i < names.count(); i++) {
+        const QString &name = names.at(i);
+        int ofs = m_reg->findKeyOfs(m_hive, m_reg->getKeyPtr(m_hive, m_pathOfs.last()), name);
+
+        if (ofs < 0) {
+            if (!m_reg->createKey(m_hive, m_reg->getKeyPtr(m_hive, m_pathOfs.last()), name)) {
+                qCritical() << "importReg: failed to create key " << name;
+                return false;
+            }
+
+            ofs = m_reg->findKeyOfs(m_hive, m_reg->getKeyPtr(m_hive, m_pathOfs.last()), name);
+            if (ofs < 0) {
+                qCritical() << "importReg: failed to navigate key " << name;
+                return false;
+            }
+        }
+
+        m_pathNames.append(name);
+        m_pathOfs.append(ofs);
+    }
+
+    return true;
+}
+
+/* Deletes key with its subkeys, a key that does not exist is skipped like
+ * regedit does. Lookup is case insensitive, ntreg needs the stored name.
+ */
+bool CRegImporter::removeKey(QStringView path)
+{
+    if (!path.startsWith(m_prefix, Qt::CaseInsensitive)
+            || (path.length() > m_prefix.length() && path.at(m_prefix.length()) != QChar('\\'))) {
+        qCritical() << tr("importReg: could not delete key %1 in %2 registry hive").arg(path.toString(), m_prefix);
+        return false;
+    }
+
+    const QStringList names = path.mid(m_prefix.length()).toString().split(QChar('\\'), Qt::SkipEmptyParts);
+
+    if (names.isEmpty()) {
+        qCritical() << tr("importReg: could not delete root key of %1 registry hive").arg(m_prefix);
+        return false;
+    }
+
+    int parentOfs = m_hive->rootofs + 4;
+    int ofs = parentOfs;
+
+    for (const QString &name : names) {
+        parentOfs = ofs;
+        ofs = m_reg->findKeyOfs(m_hive, m_reg->getKeyPtr(m_hive, parentOfs), name);
+
+        if (ofs < 0)
+            return true;
+    }
+
+    m_reg->deleteKey(m_hive, m_reg->getKeyPtr(m_hive, parentOfs), CSubkeyView(m_hive, ofs).name().toString());
+
+    // Cached offsets may point into the deleted subtree
+    m_pathNames.clear();
+    m_pathOfs.resize(1);
+
+    return true;
+}
+
+bool CRegImporter::removeValue(const QString &name)
+{
+    // Earlier values of the key must be there to be deleted
+    if (!flushValues())
+        return false;
+
+    const QString vname = (name == QSL("@") ? QString() : name);
+    struct nk_key *key = m_reg->getKeyPtr(m_hive, m_pathOfs.last());
+
+    for (const CValueView &vv : CValueRange(m_hive, key)) {
+        const CHiveName stored = vv.name();
+
+        if (stored.equals(vname)) {
+            if (!m_reg->deleteValue(m_hive, key, stored.isEmpty() ? QSL("@") : stored.toString())) {
+                qCritical() << "importReg: failed to delete value " << name;
+                return false;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+/* Writes collected values of the current key. Existing names are looked up
+ * once for the whole batch, ignoring case like the registry does, and values
+ * are updated under their stored name. Key pointer is taken again after every
+ * change, since allocations may move the hive buffer.
+ */
+bool CRegImporter::flushValues()
+{
+    if (m_pending.isEmpty())
+        return true;
+
+    const int nkofs = m_pathOfs.last();
+    QHash<QString, QPair<QString, int>> existing; // folded name -> stored name, vk offset
+
+    for (const CValueView &vv : CValueRange(m_hive, m_reg->getKeyPtr(m_hive, nkofs))) {
+        const CHiveName name = vv.name();
+        const QString s = (name.isEmpty() ? QSL("@") : name.toString());
+        existing.insert(s.toCaseFolded(), qMakePair(s, vv.offset()));
+    }
+
+    for (CValue v : qAsConst(m_pending)) {
+        const QString folded = v.name.toCaseFolded();
+        const auto it = existing.constFind(folded);
+
+        if (it == existing.constEnd()) {
+            if (!m_reg->createValue(m_hive, m_reg->getKeyPtr(m_hive, nkofs), v.type, v.name)) {
+                qCritical() << "importReg: failed to create value " << v.name;
+                return false;
+            }
+            existing.insert(folded, qMakePair(v.name, -1));
+        } else {
+            v.name = it.value().first;
+
+            if (it.value().second >= 0) {
+                // Imported type replaces the old one, like regedit does
+                reinterpret_cast<struct vk_key *>(m_hive->buffer + it.value().second)->val_type = v.type;
+                mark_dirty(m_hive, it.value().second, sizeof(struct vk_key));
+            }
+        }
+
+        if (!m_reg->setValue(m_hive, m_reg->getKeyPtr(m_hive, nkofs), v)) {
+            qCritical() << "importReg: failed to set value " << v.name;
+            return false;
+        }
+    }
+
+    m_pending.clear();
+    return true;
+}
+
+bool CRegImporter::addValue(CValue &value)
+{
+    finishValue(value);
+    m_pending.append(value);
+    value = CValue();
+
+    return (m_pending.count() < maxPendingValues || flushValues());
+}
+
+bool CRegImporter::importFile(const QString &filename)
+{
+    if (hive_immutable(m_hive, "importReg"))
+        return false;
+
+    QFile f(filename);
+
+    if (!f.open(QIODevice::ReadOnly)) {
+        qCritical() << "importReg: failed to open file" << filename;
+        return false;
+    }
+
+    CRegLineReader reader(&f);
+    QStringView line;
+
+    if (!reader.nextLine(line) || !line.trimmed().startsWith(QLatin1String("Windows Registry Editor Version 5.00"))) {
+        qCritical() << "importReg: file signature missing";
+        return false;
+    }
+
+    const qint64 total = f.size();
+    qint64 reported = 0;
+    bool inKey = false;
+    bool wrapped = false; // hex data continues on the next line
+    CValue value;
+
+    while (reader.nextLine(line)) {
+        if (f.pos() != reported) {
+            reported = f.pos();
+            Q_EMIT progress(reported, total);
+            QCoreApplication::processEvents();
+
+            if (m_canceled) {
+                qWarning() << "importReg: import canceled";
+                return false;
+            }
+        }
+
+        const QStringView s = line.trimmed();
+
+        // Empty line ends wrapped data too, older exports could leave a wrap marker after the last byte
+        if (wrapped && (s.isEmpty() || s.startsWith(QChar('[')))) {
+            wrapped = false;
+            if (!addValue(value))
+                return false;
+        }
+
+        if (s.startsWith(QChar('['))) { // keyname
+            if (!flushValues())
+                return false;
+
+            const QStringView path = s.mid(1, s.endsWith(QChar(']')) ? s.length() - 2 : s.length() - 1);
+
+            if (path.startsWith(QChar('-'))) {
+                if (!removeKey(path.mid(1)))
+                    return false;
+
+                inKey = false;
+                continue;
+            }
+
+            if (!openKey(path))
+                return false;
+
+            inKey = true;
+        } else if (!s.isEmpty()) {
+            const bool more = s.endsWith(QChar('\\')); // wrap marker
+            const QStringView part = (more ? s.left(s.length() - 1) : s);
+
+            if (wrapped) {
+                // Continuation is decoded right into the value data
+                if (!parseHexData(part, value.vOther)) {
+                    qCritical() << "importReg: failed to parse hex value " << value.name;
+                    return false;
+                }
+            } else {
+                bool isHex = false;
+                bool isRemoval = false;
+
+                if (!inKey) {
+                    qCritical() << "importReg: value without key " << s.toString();
+                    return false;
+                }
+
+                if (!parseValueLine(part, value, &isHex, &isRemoval)) {
+                    qCritical() << "importReg: failed to parse value " << s.toString();
+                    return false;
+                }
+
+                if (more && !isHex) {
+                    qCritical() << "importReg: unexpected line wrap in value " << value.name;
+                    return false;
+                }
+
+                if (isRemoval) {
+                    if (!removeValue(value.name))
+                        return false;
+
+                    value = CValue();
+                    continue;
+                }
+            }
+
+            wrapped = more;
+            if (!wrapped && !addValue(value))
+                return false;
+        }
+    }
+
+    if (wrapped && !addValue(value))
+        return false;
+
+    if (!flushValues())
+        return false;
+
+    Q_EMIT progress(total, total);
+    return true;
+}
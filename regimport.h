@@ -0,0 +1,80 @@
+#ifndef REGIMPORT_H
+#define REGIMPORT_H
+
+#include <QObject>
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include <QStringView>
+#include <QVector>
+#include <QScopedPointer>
+#if QT_VERSION >= 0x060000
+#include <QStringDecoder>
+#else
+#include <QTextCodec>
+#endif
+#include "regutils.h"
+
+/* Reads .reg file in big chunks and returns lines as views into the decoded
+ * chunk, without a QString per line.
+ */
+class CRegLineReader
+{
+private:
+    QFile *m_file { nullptr };
+    QString m_text;
+    int m_pos { 0 };
+    bool m_started { false };
+#if QT_VERSION >= 0x060000
+    QStringDecoder m_decoder;
+#else
+    QScopedPointer<QTextDecoder> m_decoder;
+#endif
+
+    bool readChunk();
+
+public:
+    explicit CRegLineReader(QFile *file);
+
+    // Line without CR/LF, valid until the next call
+    bool nextLine(QStringView &line);
+};
+
+/* Single pass .reg import. The path of the last key is cached, so a key
+ * header only walks the part that differs from the previous one. Values
+ * of a key are collected and written together, after one pass over its
+ * value list. Deletions, [-key] and "name"=-, are applied as they come.
+ */
+class CRegImporter : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CRegImporter)
+
+private:
+    CRegController *m_reg { nullptr };
+    struct hive *m_hive { nullptr };
+    QString m_prefix;
+    QStringList m_pathNames;   // components of the current key path
+    QVector<int> m_pathOfs;    // nk offsets, root first, one more than m_pathNames
+    QList<CValue> m_pending;   // values of the current key
+    bool m_canceled { false };
+
+    bool openKey(QStringView path);
+    bool removeKey(QStringView path);
+    bool removeValue(const QString &name);
+    bool flushValues();
+    bool addValue(CValue &value);
+
+public:
+    CRegImporter(CRegController *reg, struct hive *hdesc);
+
+    bool importFile(const QString &filename);
+
+public Q_SLOTS:
+    void cancel();
+
+Q_SIGNALS:
+    void progress(qint64 done, qint64 total);
+};
+
+#endif // REGIMPORT_H
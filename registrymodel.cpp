@@ -3,13 +3,6 @@
 #include <QThread>
 #include <QStack>
 #include <QFile>
-#include <QTextStream>
-#if QT_VERSION >= 0x060000
-#include <QStringEncoder>
-#include <QStringDecoder>
-#else
-#include <QTextCodec>
-#endif
 #include "registrymodel.h"
 #include "global.h"
 #include <QDebug>
@@ -32,6 +25,13 @@ CRegistryModel::CRegistryModel(QObject *parent)
     connect(th,&QThread::finished,finder.data(),&CFinder::deleteLater);
     connect(th,&QThread::finished,th,&QThread::deleteLater);
 
+    connect(cgl->reg.data(), &CRegController::hiveOpened, this, [this](int idx) {
+        finder->indexHive(cgl->reg->getHivePtr(idx));
+    });
+    connect(cgl->reg.data(), &CRegController::hiveAboutToClose, this, [this](int idx) {
+        finder->dropIndex(cgl->reg->getHivePtr(idx));
+    });
+
     th->start();
 }
 
@@ -123,15 +123,9 @@ QModelIndex CRegistryModel::parent(const QModelIndex &child) const
         return createIndex(hive, 0, pk);
 
     // Parent is also key, row - index in grandparent's child list
-    struct nk_key *gpk = cgl->reg->getKeyPtr(h, pk->ofs_parent + 0x1004);
-
-    if (!cgl->reg->checkKey(gpk))
-        return QModelIndex();
+    int const row = cgl->reg->getKeyRow(h, pk);
 
-    const QList<int> pkeys = cgl->reg->listKeysOfs(h, gpk);
-    int const row = pkeys.indexOf(cgl->reg->getKeyOfs(h, pk));
-
-    if (row < 0 || row >= pkeys.count())
+    if (row < 0)
         qFatal("search for parent index in grandparent's child list failure");
 
     return createIndex(row, 0, pk);
@@ -233,11 +227,19 @@ bool CRegistryModel::createKey(const QModelIndex &parent, const QString &name)
 
     const QList<int> sl = cgl->reg->listKeysOfs(h, k);
 
+    const int nkofs = cgl->reg->getKeyOfs(h, k);
+
     finder->hiveChanged(parent);
     beginInsertRows(parent, sl.count(), sl.count());
     bool const res = cgl->reg->createKey(h, k, name);
     endInsertRows();
 
+    if (res) {
+        const int newofs = cgl->reg->findKeyOfs(h, cgl->reg->getKeyPtr(h, nkofs), name);
+        if (newofs >= 0)
+            finder->keyChanged(h, newofs);
+    }
+
     return res;
 }
 
@@ -285,20 +287,7 @@ bool CRegistryModel::exportKey(const QModelIndex &idx, const QString &filename)
     if (!f.open(QIODevice::WriteOnly))
         return false;
 
-    QTextStream ts(&f);
-#if QT_VERSION >= 0x060000
-    ts.setEncoding(QStringConverter::Utf16);
-#else
-    ts.setCodec("UTF-16");
-#endif
-
-    ts.setGenerateByteOrderMark(true);
-    ts << "Windows Registry Editor Version 5.00\r\n";
-
-    bool const res = cgl->reg->exportKey(h, k, prefix, ts);
-
-    ts << "\r\n";
-    ts.flush();
+    bool const res = cgl->reg->exportKey(h, k, prefix, &f, QThread::idealThreadCount());
     f.close();
 
     return res;
@@ -319,16 +308,12 @@ QModelIndex CRegistryModel::getKeyIndex(struct hive *hdesc, struct nk_key *key)
     QModelIndex idx = index(cgl->reg->getHive(key), 0, QModelIndex());
 
     while (!ofs.isEmpty()) {
-        const int ko = ofs.pop();
+        const int row = cgl->reg->getKeyRow(hdesc, cgl->reg->getKeyPtr(hdesc, ofs.pop()));
 
-        for (int i = 0; i < rowCount(idx); i++) {
-            const QModelIndex pidx = index(i, 0, idx);
+        if (row < 0)
+            break;
 
-            if (pidx.internalPointer() == cgl->reg->getKeyPtr(hdesc, ko)) {
-                idx = pidx;
-                break;
-            }
-        }
+        idx = index(row, 0, idx);
     }
 
     return idx;
@@ -361,14 +346,14 @@ void CValuesModel::reloadKey(void* newKey)
 {
     // Close old key
     if (hive_num >= 0 && key_ofs >= 0) {
-        if (val_count > 0) {
-            beginRemoveRows(QModelIndex(), 0, val_count - 1);
+        if (!m_values.isEmpty()) {
+            beginRemoveRows(QModelIndex(), 0, m_values.count() - 1);
+            m_values.clear();
             endRemoveRows();
         }
 
         hive_num = -1;
         key_ofs = -1;
-        val_count = 0;
         key_ptr = nullptr;
         m_keyName.clear();
     }
@@ -383,7 +368,6 @@ void CValuesModel::reloadKey(void* newKey)
     if (!cgl->reg->keyPrepare(newKey, h, hive_num, ck)) {
         hive_num = -1;
         key_ofs = -1;
-        val_count = 0;
         key_ptr = nullptr;
         m_keyName.clear();
         return;
@@ -391,11 +375,13 @@ void CValuesModel::reloadKey(void* newKey)
 
     key_ofs = cgl->reg->getKeyOfs(h, ck);
     m_keyName = cgl->reg->getKeyFullPath(h, ck);
-    val_count = cgl->reg->listValues(h, ck).count();
     key_ptr = newKey;
 
-    if (val_count > 0) {
-        beginInsertRows(QModelIndex(), 0, val_count - 1);
+    const QList<CValue> vl = cgl->reg->listValues(h, ck);
+
+    if (!vl.isEmpty()) {
+        beginInsertRows(QModelIndex(), 0, vl.count() - 1);
+        m_values = vl;
         endInsertRows();
     }
 
@@ -433,11 +419,15 @@ bool CValuesModel::deleteValue(const QModelIndex &idx)
 
     const QString name = getValueName(idx);
 
+    stopFinder(h);
+    if (!cgl->reg->deleteValue(h, k, name))
+        return false;
+
     beginRemoveRows(QModelIndex(), idx.row(), idx.row());
-    const bool res = cgl->reg->deleteValue(h, k, name);
+    m_values.removeAt(idx.row());
     endRemoveRows();
 
-    return res;
+    return true;
 }
 
 QString CValuesModel::getValueName(const QModelIndex &idx) const
@@ -445,19 +435,12 @@ QString CValuesModel::getValueName(const QModelIndex &idx) const
     if (!idx.isValid() || hive_num < 0 || key_ofs < 0)
         return QString();
 
-    struct hive *h = cgl->reg->getHivePtr(hive_num);
-    struct nk_key *k = cgl->reg->getKeyPtr(h, key_ofs);
-
-    const QList<CValue> vl = cgl->reg->listValues(h, k);
-
     const int row = idx.row();
 
-    if  (row < 0 || row >= vl.count())
+    if  (row < 0 || row >= m_values.count())
         return QString();
 
-    const CValue &v = vl.at(row);
-
-    return v.name;
+    return m_values.at(row).name;
 }
 
 CValue CValuesModel::getValue(const QModelIndex &idx) const
@@ -465,17 +448,12 @@ CValue CValuesModel::getValue(const QModelIndex &idx) const
     if (!idx.isValid() || hive_num < 0 || key_ofs < 0)
         return CValue();
 
-    struct hive *h = cgl->reg->getHivePtr(hive_num);
-    struct nk_key *k = cgl->reg->getKeyPtr(h, key_ofs);
-
-    const QList<CValue> vl = cgl->reg->listValues(h, k);
-
     const int row = idx.row();
 
-    if  (row < 0 || row >= vl.count())
+    if  (row < 0 || row >= m_values.count())
         return CValue();
 
-    return vl.at(row);
+    return m_values.at(row);
 }
 
 QModelIndex CValuesModel::getValueIdx(const QString &name) const
@@ -483,13 +461,8 @@ QModelIndex CValuesModel::getValueIdx(const QString &name) const
     if (name.isEmpty() || hive_num < 0 || key_ofs < 0)
         return QModelIndex();
 
-    struct hive *h = cgl->reg->getHivePtr(hive_num);
-    struct nk_key *k = cgl->reg->getKeyPtr(h, key_ofs);
-
-    const QList<CValue> vl = cgl->reg->listValues(h, k);
-
-    for (int i = 0; i < vl.count(); i++) {
-        if (vl.at(i).name == name)
+    for (int i = 0; i < m_values.count(); i++) {
+        if (m_values.at(i).name == name)
             return index(i, 0, QModelIndex());
     }
 
@@ -509,7 +482,12 @@ bool CValuesModel::setValue(const QModelIndex &idx, const CValue &value)
     struct hive *h = cgl->reg->getHivePtr(hive_num);
     struct nk_key *k = cgl->reg->getKeyPtr(h, key_ofs);
 
-    return cgl->reg->setValue(h, k, value);
+    stopFinder(h);
+    if (!cgl->reg->setValue(h, k, value))
+        return false;
+
+    refreshValue(idx.row(), value.name);
+    return true;
 }
 
 bool CValuesModel::createValue(const CValue &value)
@@ -520,16 +498,56 @@ bool CValuesModel::createValue(const CValue &value)
     struct hive *h = cgl->reg->getHivePtr(hive_num);
     struct nk_key *k = cgl->reg->getKeyPtr(h, key_ofs);
 
+    stopFinder(h);
+
     bool success = false;
     if (cgl->reg->createValue(h, k, value.type, value.name))
         success = cgl->reg->setValue(h, k, value);
 
-    if (success) {
+    if (!success)
+        return false;
+
+    // add_value() appends to the value list, so the new value is the last row
+    const CValue nv = cgl->reg->getValue(h, k, value.name);
+
+    if (nv.isEmpty()) {
         reloadKey(key_ptr);
         return true;
     }
 
-    return false;
+    beginInsertRows(QModelIndex(), m_values.count(), m_values.count());
+    m_values.append(nv);
+    endInsertRows();
+
+    return true;
+}
+
+void CValuesModel::stopFinder(struct hive *hdesc)
+{
+    // Search jobs read the hive buffer, which may be reallocated by value changes
+    if (cgl->reg->treeModel && cgl->reg->treeModel->finder) {
+        cgl->reg->treeModel->finder->hiveChanged(hdesc, false);
+        cgl->reg->treeModel->finder->keyChanged(hdesc, key_ofs);
+    }
+}
+
+void CValuesModel::refreshValue(int row, const QString &name)
+{
+    if  (row < 0 || row >= m_values.count())
+        return;
+
+    struct hive *h = cgl->reg->getHivePtr(hive_num);
+    struct nk_key *k = cgl->reg->getKeyPtr(h, key_ofs);
+
+    const CValue v = cgl->reg->getValue(h, k, name);
+
+    if (v.isEmpty()) {
+        reloadKey(key_ptr);
+        return;
+    }
+
+    m_values[row] = v;
+    Q_EMIT dataChanged(index(row, 0), index(row, columnCount(QModelIndex()) - 1));
 }
 
 int CValuesModel::rowCount(const QModelIndex &parent) const
@@ -539,7 +557,7 @@ int CValuesModel::rowCount(const QModelIndex &parent) const
     if (hive_num < 0 || key_ofs < 0)
         return 0;
 
-    return val_count;
+    return m_values.count();
 }
 
 int CValuesModel::columnCount(const QModelIndex &parent) const
@@ -554,17 +572,12 @@ QVariant CValuesModel::data(const QModelIndex &index, int role) const
     if (!index.isValid() || hive_num < 0 || key_ofs < 0)
         return QVariant();
 
-    struct hive *h = cgl->reg->getHivePtr(hive_num);
-    struct nk_key *k = cgl->reg->getKeyPtr(h, key_ofs);
-
-    const QList<CValue> vl = cgl->reg->listValues(h, k);
-
     const int row = index.row();
     const int col = index.column();
 
-    if  (row < 0 || row >= vl.count()) return QVariant();
+    if  (row < 0 || row >= m_values.count()) return QVariant();
 
-    CValue const v = vl.at(row);
+    const CValue &v = m_values.at(row);
 
     if (role == Qt::DisplayRole) {
         if (col == 0) {
@@ -652,3 +665,134 @@ QVariant CValuesModel::headerData(int section, Qt::Orientation orientation, int
 }
 
 
+
+CSearchResultsModel::CSearchResultsModel(QObject *parent)
+    : QAbstractTableModel(parent)
+{
+}
+
+CSearchResultsModel::~CSearchResultsModel() = default;
+
+bool CSearchResultsModel::getMatch(const QModelIndex &idx, hive *&hdesc, nk_key *&key, QString &value) const
+{
+    if (!idx.isValid() || m_hive == nullptr)
+        return false;
+
+    const int row = idx.row();
+
+    if (row < 0 || row >= m_matches.count())
+        return false;
+
+    hdesc = m_hive;
+    key = cgl->reg->getKeyPtr(m_hive, m_matches.at(row).keyOfs);
+    value = m_matches.at(row).value;
+
+    return true;
+}
+
+void CSearchResultsModel::clear()
+{
+    beginResetModel();
+    m_hive = nullptr;
+    m_matches.clear();
+    endResetModel();
+}
+
+void CSearchResultsModel::appendMatches(quintptr hdesc, const QVector<CFinderMatch> &matches)
+{
+    if (matches.isEmpty())
+        return;
+
+    auto *h = reinterpret_cast<struct hive *>(hdesc);
+
+    if (m_hive != h) {
+        clear();
+        m_hive = h;
+    }
+
+    beginInsertRows(QModelIndex(), m_matches.count(), m_matches.count() + matches.count() - 1);
+    m_matches.append(matches);
+    endInsertRows();
+}
+
+int CSearchResultsModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.isValid())
+        return 0;
+
+    return m_matches.count();
+}
+
+int CSearchResultsModel::columnCount(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent)
+
+    return 3;
+}
+
+QVariant CSearchResultsModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || m_hive == nullptr || role != Qt::DisplayRole)
+        return QVariant();
+
+    const int row = index.row();
+
+    if (row < 0 || row >= m_matches.count()) return QVariant();
+
+    const CFinderMatch &m = m_matches.at(row);
+
+    switch (index.column()) {
+        case 0:
+            // Paths are resolved only for visible rows
+            return QSL("\\") + cgl->reg->getKeyFullPath(m_hive, cgl->reg->getKeyPtr(m_hive, m.keyOfs));
+
+        case 1:
+            return m.value;
+
+        case 2:
+            switch (m.column) {
+                case CFinderMatch::KeyName:
+                    return tr("Key name");
+
+                case CFinderMatch::ValueName:
+                    return tr("Value name");
+
+                case CFinderMatch::ValueData:
+                    return tr("Value data");
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return QVariant();
+}
+
+Qt::ItemFlags CSearchResultsModel::flags(const QModelIndex &index) const
+{
+    Q_UNUSED(index)
+
+    return (Qt::ItemIsSelectable | Qt::ItemIsEnabled);
+}
+
+QVariant CSearchResultsModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (role == Qt::DisplayRole && orientation == Qt::Horizontal) {
+        switch (section) {
+            case 0:
+                return QSL("Key");
+
+            case 1:
+                return QSL("Value");
+
+            case 2:
+                return QSL("Match");
+
+            default:
+                return QVariant();
+        }
+    }
+
+    return QVariant();
+}
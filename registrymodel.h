@@ -7,8 +7,8 @@
 #include <QVector>
 #include <QString>
 #include "finder.h"
+#include "regutils.h"
 
-class CValue;
 struct hive;
 struct nk_key;
 
@@ -17,9 +17,6 @@ class CRegistryModel : public QAbstractItemModel
     Q_OBJECT
     Q_DISABLE_COPY(CRegistryModel)
 
-private:
-    QModelIndex getKeyIndex(struct hive *hdesc, struct nk_key *key);
-
 public:
     QPointer<CFinder> finder;
 
@@ -37,6 +34,7 @@ public:
     void deleteKey(const QModelIndex &idx);
 
     bool exportKey(const QModelIndex &idx, const QString& filename);
+    QModelIndex getKeyIndex(struct hive *hdesc, struct nk_key *key);
 
 protected:
     QModelIndex index(int row, int column, const QModelIndex &parent) const override;
@@ -61,11 +59,14 @@ class CValuesModel : public QAbstractTableModel
     Q_DISABLE_COPY(CValuesModel)
 
 private:
-    int val_count { 0 };
     int key_ofs { -1 };
     int hive_num { -1 };
     void *key_ptr { nullptr };
     QString m_keyName;
+    QList<CValue> m_values; // decoded snapshot of the current key values
+
+    void refreshValue(int row, const QString &name);
+    void stopFinder(struct hive *hdesc);
 
 public:
     explicit CValuesModel(QObject *parent = nullptr);
@@ -98,4 +99,32 @@ Q_SIGNALS:
 
 };
 
+class CSearchResultsModel : public QAbstractTableModel
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CSearchResultsModel)
+
+private:
+    struct hive *m_hive { nullptr };
+    QVector<CFinderMatch> m_matches;
+
+public:
+    explicit CSearchResultsModel(QObject *parent = nullptr);
+    ~CSearchResultsModel() override;
+
+    bool getMatch(const QModelIndex &idx, struct hive *&hdesc, struct nk_key *&key, QString &value) const;
+
+public Q_SLOTS:
+    void clear();
+    void appendMatches(quintptr hdesc, const QVector<CFinderMatch> &matches);
+
+protected:
+    int rowCount(const QModelIndex &parent) const override;
+    int columnCount(const QModelIndex &parent) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    Qt::ItemFlags flags(const QModelIndex &index) const override;
+    QVariant headerData(int section, Qt::Orientation orientation, int role) const override;
+
+};
+
 #endif // REGISTRYMODEL_H
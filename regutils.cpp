@@ -1,9 +1,14 @@
 #include "registrymodel.h"
 #include "regutils.h"
+#include "hiveiterators.h"
+#include "regexport.h"
+#include "regimport.h"
 #include "global.h"
 #include <QApplication>
 #include <QMessageBox>
 #include <QDateTime>
+#include <QFileInfo>
+#include <QSaveFile>
 #if QT_VERSION >= 0x060000
 #include <QStringEncoder>
 #include <QStringDecoder>
@@ -49,21 +54,45 @@ QString fromUtf16(const QByteArray &str)
 #endif
 }
 
-bool CRegController::openTopHive(const QString &filename, int mode)
+/* Hive that is not in the hive list. Controller methods can be used on it
+ * from any thread, as long as nothing else changes it. */
+struct hive *CRegController::openDetachedHive(const QString &filename, int mode)
 {
     struct hive *h = openHive(filename.toUtf8().data(), cgl->hiveOpenMode | mode);
 
     if (h == nullptr) {
         qCritical() << "Failed to open hive" << filename;
-        return false;
+        return nullptr;
     }
 
     if (h->type == HTYPE_UNKNOWN) {
         qCritical() << "Unable to detect hive type" << filename << " type " << h->type;
         closeHive(h);
-        return false;
+        return nullptr;
     }
 
+    if (h->recovered > 0) {
+        qWarning() << tr("Hive %1 was recovered from its transaction log, save it to update the file")
+                      .arg(filename);
+    }
+
+    return h;
+}
+
+void CRegController::closeDetachedHive(struct hive *hdesc)
+{
+    // Cached subkey lists must go before the pointer can be reused by another hive
+    invalidateSubkeys(hdesc);
+    closeHive(hdesc);
+}
+
+bool CRegController::openTopHive(const QString &filename, int mode)
+{
+    struct hive *h = openDetachedHive(filename, mode);
+
+    if (h == nullptr)
+        return false;
+
     if (treeModel)
         treeModel->beginInsertRows(QModelIndex(), getHivesCount(), getHivesCount());
 
@@ -120,16 +149,82 @@ bool CRegController::saveTopHive(int idx)
             return false;
     }
 
-    if (writeHive(h) == 0) {
-        Q_EMIT hiveSaved(idx);
+    if (writeTopHive(idx))
         return true;
-    }
+
     QMessageBox::warning(nullptr,
                          tr("Registry Editor - Error"),
                          tr("Failed to save hive file '%1'.").arg(h->filename));
     return false;
 }
 
+// Saves modified hive without questions
+bool CRegController::writeTopHive(int idx)
+{
+    if (idx < 0 || idx >= hives.count()) return false;
+
+    struct hive *h = hives.at(idx);
+
+    if ((h->state & HMODE_DIRTY) == 0)
+        return true;
+
+    if (writeHive(h) != 0) {
+        qCritical() << "Failed to save hive file" << h->filename;
+        return false;
+    }
+
+    Q_EMIT hiveSaved(idx);
+    return true;
+}
+
+// Writes copy of hive with keys in depth first order and no free space, hive itself is not changed
+bool CRegController::writeCompactedHive(struct hive *hdesc, const QString &filename)
+{
+    struct hive *c = compact_hive(hdesc);
+
+    if (c == nullptr) {
+        qCritical() << tr("Failed to compact hive %1").arg(QString::fromUtf8(hdesc->filename));
+        return false;
+    }
+
+    QSaveFile f(filename);
+    const bool res = (f.open(QIODevice::WriteOnly) && f.write(c->buffer, c->size) == c->size && f.commit());
+
+    if (!res)
+        qCritical() << tr("Failed to write compacted hive %1: %2").arg(filename, f.errorString());
+
+    closeHive(c);
+    return res;
+}
+
+/* Saves compacted hive to filename. When it is the file of the hive, the
+ * hive is opened again to use the new layout, and moves to the end of the
+ * list. Returns index of the hive, -1 on error. */
+int CRegController::compactTopHive(int idx, const QString &filename)
+{
+    if (idx < 0 || idx >= hives.count()) return -1;
+
+    struct hive *h = hives.at(idx);
+    const QString hiveFile = QString::fromUtf8(h->filename);
+    const QFileInfo target(filename);
+    const bool replace = (target.exists() && target.canonicalFilePath() == QFileInfo(hiveFile).canonicalFilePath());
+
+    if (replace && (h->state & HMODE_RO) != 0) {
+        qCritical() << tr("Hive %1 is opened read only").arg(hiveFile);
+        return -1;
+    }
+
+    if (!writeCompactedHive(h, filename))
+        return -1;
+
+    if (!replace)
+        return idx;
+
+    // Changes are in the new file already, old buffer is dropped without saving
+    closeTopHive(idx);
+    return (openTopHive(hiveFile, HMODE_RW) ? getHivesCount() - 1 : -1);
+}
+
 void CRegController::closeTopHive(int idx)
 {
     if (idx < 0 || idx >= hives.count()) return;
@@ -142,6 +237,7 @@ void CRegController::closeTopHive(int idx)
         treeModel->beginRemoveRows(QModelIndex(), idx, idx);
 
     hives.removeAt(idx);
+    invalidateSubkeys(h);
 
     if (treeModel)
         treeModel->endRemoveRows();
@@ -162,93 +258,143 @@ struct hive *CRegController::getHivePtr(int idx)
 
 QStringList CRegController::listKeys(struct hive *hdesc, struct nk_key *key)
 {
-    int nkofs = 0;
-    struct ex_data ex
-    {};
-    int count = 0;
-    int countri = 0;
-
     QStringList keys;
 
-    nkofs = (quintptr)key - (quintptr)(hdesc->buffer);
-
     if (key->id != 0x6b6e) {
-        qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(nkofs, 0, 16);
+        qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(getKeyOfs(hdesc, key), 0, 16);
         return keys;
     }
 
-    if (key->no_subkeys != 0) {
-        while ((ex_next_n(hdesc, nkofs, &count, &countri, &ex) > 0)) {
-            keys << QString(ex.name);
-            FREE(ex.name);
-        }
-    }
+    for (const CSubkeyView &sk : CSubkeyRange(hdesc, key))
+        keys << sk.name().toString();
 
     return keys;
 }
 
 QList<CValue> CRegController::listValues(struct hive *hdesc, struct nk_key *key, int exact)
 {
-    int nkofs = 0;
-    int count = 0;
-    struct vex_data vex
-    {};
-
     QList<CValue> vals;
 
-    nkofs = (quintptr)key - (quintptr)(hdesc->buffer);
-
     if (key->id != 0x6b6e) {
-        qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(nkofs, 0, 16);
+        qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(getKeyOfs(hdesc, key), 0, 16);
         return vals;
     }
 
-    if (key->no_values != 0) {
-        while ((ex_next_v(hdesc, nkofs, &count, &vex) > 0)) {
-            QString str;
-            const QVariant v = getValue(hdesc, vex, false, exact);
+    for (const CValueView &vv : CValueRange(hdesc, key)) {
+        QString str;
+        const struct vex_data vex = vv.toVex();
+        const QVariant v = getValue(hdesc, vex, false, exact);
 
-            if (v.isNull()) {
-                FREE(vex.name);
-                continue;
-            }
+        if (v.isNull())
+            continue;
 
-            if (strcmp(v.typeName(), "QString") == 0)
-                str = v.toString();
+        if (strcmp(v.typeName(), "QString") == 0)
+            str = v.toString();
 
-            vals << CValue(vex, str, getValue(hdesc, vex, true).toByteArray());
-            FREE(vex.name);
-        }
+        vals << CValue(vv.name().toString(), vex, str, getValue(hdesc, vex, true).toByteArray());
     }
 
     return vals;
 }
 
-int CRegController::findKeyOfs(struct hive *hdesc, struct nk_key *key, const QString &name)
+static int subkeyListOfs(const struct lf_key *lst, int idx)
 {
-    int nkofs = 0;
-    struct ex_data ex {};
-    int count = 0;
-    int countri = 0;
+    if (lst->id == 0x696c)
+        return reinterpret_cast<const struct li_key *>(lst)->hash[idx].ofs_nk + 0x1004;
 
-    if (name.isEmpty()) return -3;
+    return lst->hash[idx].ofs_nk + 0x1004;
+}
 
-    nkofs = getKeyOfs(hdesc, key);
+/* Binary search in one lf/lh/li list, sorted by uppercased name. Windows keeps
+ * them sorted this way, but keys added by other tools may be not.
+ */
+static int bsearchSubkeyList(struct hive *hdesc, const struct lf_key *lst, int count, const QString &name)
+{
+    int lo = 0;
+    int hi = count - 1;
+
+    while (lo <= hi) {
+        const int mid = lo + (hi - lo) / 2;
+        const CSubkeyView sk(hdesc, subkeyListOfs(lst, mid));
+
+        if (sk.key()->id != 0x6b6e)
+            return -1;
+
+        const int cmp = sk.name().compareUpper(name);
+
+        if (cmp == 0)
+            return (sk.name().equals(name) ? sk.offset() : -1);
+
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+// Linear scan, with lh hashes used to skip non-matching entries
+static int scanSubkeyList(struct hive *hdesc, const struct lf_key *lst, int count, const QString &name,
+                          bool useHash, qint32 hash)
+{
+    useHash = useHash && (lst->id == 0x686c);
+
+    for (int i = 0; i < count; i++) {
+        if (useHash && lst->lh_hash[i].hash != hash)
+            continue;
+
+        const CSubkeyView sk(hdesc, subkeyListOfs(lst, i));
+
+        if (sk.key()->id == 0x6b6e && sk.name().equals(name))
+            return sk.offset();
+    }
+
+    return -1;
+}
+
+int CRegController::findKeyOfs(struct hive *hdesc, struct nk_key *key, const QString &name)
+{
+    if (name.isEmpty()) return -3;
 
     if (key->id != 0x6b6e) {
-        qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(nkofs, 0, 16);
+        qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(getKeyOfs(hdesc, key), 0, 16);
         return -1;
     }
 
-    if (key->no_subkeys != 0) {
-        while ((ex_next_n(hdesc, nkofs, &count, &countri, &ex) > 0)) {
-            if (QString::compare(name, ex.name, Qt::CaseInsensitive) == 0) {
-                FREE(ex.name);
-                return ex.nkoffs + 4;
-            }
+    if (key->no_subkeys <= 0) return -2;
+
+    // Plain list, or ri index of lists
+    QVector<QPair<const struct lf_key *, int> > lists;
+    const auto *lst = reinterpret_cast<const struct lf_key *>(hdesc->buffer + key->ofs_lf + 0x1004);
 
-            FREE(ex.name);
+    if (lst->id == 0x6972) {
+        const auto *ri = reinterpret_cast<const struct ri_key *>(lst);
+        lists.reserve(ri->no_lis);
+        for (int i = 0; i < ri->no_lis; i++) {
+            const auto *sub = reinterpret_cast<const struct lf_key *>(hdesc->buffer + ri->hash[i].ofs_li + 0x1004);
+            lists.append(qMakePair(sub, static_cast<int>(sub->no_keys)));
         }
+    } else {
+        lists.append(qMakePair(lst, static_cast<int>(key->no_subkeys)));
+    }
+
+    for (const auto &l : qAsConst(lists)) {
+        const int ofs = bsearchSubkeyList(hdesc, l.first, l.second, name);
+        if (ofs >= 0)
+            return ofs;
+    }
+
+    // Not found in sorted order - list may be unsorted (add_key() sorts with
+    // case folding, not uppercase), so check every entry with lh hints.
+    qint32 hash = 0;
+    const bool useHash = CHiveName::lhHash(name, hash);
+
+    for (const auto &l : qAsConst(lists)) {
+        const int ofs = scanSubkeyList(hdesc, l.first, l.second, name, useHash, hash);
+        if (ofs >= 0)
+            return ofs;
     }
 
     return -2;
@@ -257,9 +403,6 @@ int CRegController::findKeyOfs(struct hive *hdesc, struct nk_key *key, const QSt
 QList<int> CRegController::listKeysOfs(struct hive *hdesc, struct nk_key *key)
 {
     int nkofs = 0;
-    struct ex_data ex {};
-    int count = 0;
-    int countri = 0;
 
     QList<int> keys;
 
@@ -270,16 +413,77 @@ QList<int> CRegController::listKeysOfs(struct hive *hdesc, struct nk_key *key)
         return keys;
     }
 
-    if (key->no_subkeys != 0) {
-        while ((ex_next_n(hdesc, nkofs, &count, &countri, &ex) > 0)) {
-            keys << ex.nkoffs + 4;
-            FREE(ex.name);
+    {
+        const QMutexLocker locker(&m_subkeysMutex);
+        auto hit = m_subkeys.constFind(hdesc);
+        if (hit != m_subkeys.constEnd()) {
+            auto kit = hit->constFind(nkofs);
+            // Subkey count check catches changes made behind our back (libsam)
+            if (kit != hit->constEnd() && kit->count() == key->no_subkeys)
+                return kit.value();
         }
     }
 
+    keys.reserve(key->no_subkeys);
+    for (const CSubkeyView &sk : CSubkeyRange(hdesc, key))
+        keys << sk.offset();
+
+    const QMutexLocker locker(&m_subkeysMutex);
+    m_subkeys[hdesc].insert(nkofs, keys);
+
+    QHash<int, int> &rows = m_subkeyRows[hdesc];
+    for (int i = 0; i < keys.count(); i++)
+        rows.insert(keys.at(i), i);
+
     return keys;
 }
 
+int CRegController::getKeyRow(struct hive *hdesc, struct nk_key *key)
+{
+    const int nkofs = getKeyOfs(hdesc, key);
+
+    if (nkofs == (hdesc->rootofs + 4))
+        return hives.indexOf(hdesc);
+
+    struct nk_key *pk = getKeyPtr(hdesc, key->ofs_parent + 0x1004);
+
+    if (!checkKey(pk))
+        return -1;
+
+    // Parent list is validated against nk->no_subkeys, rows are checked against it
+    const QList<int> pkeys = listKeysOfs(hdesc, pk);
+    int row = -1;
+
+    {
+        const QMutexLocker locker(&m_subkeysMutex);
+        row = m_subkeyRows.value(hdesc).value(nkofs, -1);
+    }
+
+    if (row >= 0 && row < pkeys.count() && pkeys.at(row) == nkofs)
+        return row;
+
+    return pkeys.indexOf(nkofs);
+}
+
+void CRegController::invalidateSubkeys(struct hive *hdesc, int nkofs)
+{
+    const QMutexLocker locker(&m_subkeysMutex);
+
+    if (nkofs < 0) {
+        m_subkeys.remove(hdesc);
+        m_subkeyRows.remove(hdesc);
+    } else {
+        auto hit = m_subkeys.find(hdesc);
+        if (hit != m_subkeys.end()) {
+            // Siblings order changes, so forget old rows of the children too
+            QHash<int, int> &rows = m_subkeyRows[hdesc];
+            const QList<int> keys = hit->take(nkofs);
+            for (const int child : keys)
+                rows.remove(child);
+        }
+    }
+}
+
 QList<int> CRegController::listAllKeysOfsFlat(struct hive *hdesc, struct nk_key *key)
 {
     QList<int> childs = listKeysOfs(hdesc, key);
@@ -344,16 +548,11 @@ QString CRegController::getKeyName(struct hive *hdesc, struct nk_key *key)
     if (!ret.isEmpty())
         return ret;
 
-    if (key->len_name <= 0) {
+    // Same decoding as CHiveName, ANSI names hold Latin-1 characters
+    if (key->len_name <= 0)
         qWarning() << tr("CRegController::getKeyName: nk at 0x%1 has no name!").arg((quintptr)key, 8, 16);
-    } else if ((key->type & 0x20) != 0) {
-        ret = QString::fromLocal8Bit(key->keyname, key->len_name);
-    } else {
-        int outlen = 0;
-        char *name = string_regw2prog(key->keyname, key->len_name, &outlen);
-        ret = QString(name);
-        FREE(name);
-    }
+    else
+        ret = CHiveName(key->keyname, key->len_name, (key->type & 0x20) != 0).toString();
 
     return ret;
 }
@@ -371,28 +570,17 @@ QString CRegController::getKeyTooltip(struct hive *hdesc, struct nk_key *key)
 struct keyval *CRegController::getKeyValue(struct hive *hdesc, struct nk_key *key, keyval *kv,
         const QString &name, int type, int exact)
 {
-    int nkofs = 0;
-    int count = 0;
-    struct vex_data vex
-    {};
     struct keyval *nkv = kv;
 
-    nkofs = getKeyOfs(hdesc, key);
-
     if (key->id != 0x6b6e) {
-        qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(nkofs, 0, 16);
+        qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(getKeyOfs(hdesc, key), 0, 16);
         return nkv;
     }
 
-    if (key->no_values != 0) {
-        while ((ex_next_v(hdesc, nkofs, &count, &vex) > 0)) {
-            if (QString(vex.name) == name) {
-                nkv = getKeyValue(hdesc, nkv, vex, type, exact);
-                FREE(vex.name);
-                break;
-            }
-
-            FREE(vex.name);
+    for (const CValueView &vv : CValueRange(hdesc, key)) {
+        if (vv.name().equals(name, Qt::CaseSensitive)) {
+            nkv = getKeyValue(hdesc, nkv, vv.toVex(), type, exact);
+            break;
         }
     }
 
@@ -442,7 +630,8 @@ struct keyval *CRegController::getKeyValue(struct hive *hdesc, struct keyval *kv
         auto *db = (struct db_key *)keydataptr;
 
         if (db->id != 0x6264) {
-            qCritical() << "CRegController::getKeyValue: invalid db_key structure found for value " << vex.name;
+            qCritical() << "CRegController::getKeyValue: invalid db_key structure found for value "
+                        << CValueView(hdesc, vex.vkoffs).name().toString();
             return nullptr;
         }
 
@@ -483,7 +672,7 @@ QVariant CRegController::getValue(struct hive *hdesc, struct vex_data vex, bool
     struct keyval *kv = getKeyValue(hdesc, nullptr, vex, 0, exact);
 
     if (!kv) {
-        qCritical() << "Value - could not fetch data" << vex.name;
+        qCritical() << "Value - could not fetch data at offset" << vex.vkoffs;
         return QVariant();
     }
 
@@ -528,6 +717,25 @@ QVariant CRegController::getValue(struct hive *hdesc, struct vex_data vex, bool
     return res;
 }
 
+/* Value data without copying, when it's stored in one cell. Big values are
+ * assembled from db blocks into buf. */
+const char *CRegController::getValueRawData(struct hive *hdesc, const struct vex_data &vex, QByteArray &buf, int &len)
+{
+    len = vex.size;
+
+    if ((vex.vk->len_data & 0x80000000) != 0) {
+        len = qMin(len, static_cast<int>(sizeof(vex.vk->ofs_data)));
+        return reinterpret_cast<const char *>(&vex.vk->ofs_data);
+    }
+
+    if (len <= VAL_DIRECT_LIMIT)
+        return (hdesc->buffer + vex.vk->ofs_data + 0x1004);
+
+    buf = getValue(hdesc, vex, true).toByteArray();
+    len = buf.size();
+    return buf.constData();
+}
+
 CValue CRegController::getValue(hive *hdesc, nk_key *key, const QString &name, int checkType)
 {
     const QList<CValue> vl = listValues(hdesc, key);
@@ -560,10 +768,14 @@ QString CRegController::getKeyFullPath(struct hive *hdesc, struct nk_key *key, b
     keys.prepend(getKeyName(hdesc, k));
 
     while (getKeyOfs(hdesc, k) != (hdesc->rootofs + 4)) {
-        k = getKeyPtr(hdesc, k->ofs_parent + 0x1004);
+        // Checked against this hive only, it may be detached from the hive list
+        const int pofs = k->ofs_parent + 0x1004;
+        k = getKeyPtr(hdesc, pofs);
 
-        if (!checkKey(k))
+        if (pofs < 0x1004 || pofs >= hdesc->size || k->id != 0x6b6e) {
+            qCritical() << tr("Error: Not a 'nk' node at offset 0x%1!").arg(pofs, 0, 16);
             return QString();
+        }
 
         keys.prepend(getKeyName(hdesc, k));
     }
@@ -576,103 +788,27 @@ QString CRegController::getKeyFullPath(struct hive *hdesc, struct nk_key *key, b
 
 bool CRegController::createKey(hive *hdesc, nk_key *parent, const QString &name)
 {
-    return (add_key(hdesc, getKeyOfs(hdesc, parent), name.toUtf8().data()) != nullptr);
+    const int nkofs = getKeyOfs(hdesc, parent);
+    const bool res = (add_key(hdesc, nkofs, name.toUtf8().data()) != nullptr);
+    invalidateSubkeys(hdesc, nkofs);
+    return res;
 }
 
 void CRegController::deleteKey(hive *hdesc, nk_key *parent, const QString &name)
 {
     rdel_keys(hdesc, name.toUtf8().data(), getKeyOfs(hdesc, parent));
+    // Whole subtree is gone and its cells may be reused, drop everything for this hive
+    invalidateSubkeys(hdesc);
 }
 
-QString escapeString(const QString &str)
+bool CRegController::exportKey(struct hive *hdesc, struct nk_key *key, const QString &prefix, QIODevice *device,
+                               int threads)
 {
-    QString s = str;
-    s.replace('\\', "\\\\");
-    s.replace('\"', "\\\"");
-    return s;
-}
-
-void exportBin(const QByteArray &data, int type, int &col, QTextStream &file)
-{
-    if (type == REG_BINARY) {
-        file << "hex:";
-        col += 4;
-    } else {
-        file << QSL("hex(%1):").arg(type, 0, 16);
-        col += 7;
-    }
-
-    int start = (col  - 2) / 3;
-
-    for (int i = 0; i < data.size(); i++) {
-        if (i < (data.size() - 1)) {
-            file << QSL("%1,").arg((quint8)data.at(i), 2, 16, QChar('0'));
-        } else {
-            file << QSL("%1").arg((quint8) data.at(i), 2, 16, QChar('0'));
-        }
+    CRegExporter exporter(hdesc, device);
 
-        if (((i + start) % 25) == 0)
-            file << "\\\r\n  ";
-    }
-
-    file << "\r\n";
-}
-
-bool CRegController::exportKey(struct hive *hdesc, struct nk_key *key, const QString &prefix, QTextStream &file)
-{
-    const QString path = getKeyFullPath(hdesc, key, true);
-    // export the key
-    file << "\r\n";
-    file << QSL("[%1\%2]\r\n").arg(prefix, path);
-    // export values
-    const QList<CValue> vl = listValues(hdesc, key);
-
-    for (const auto &v : vl) {
-        int col = 0;
-        QString name = escapeString(v.name);
-
-        /* print name */
-        if (name.isEmpty()) {
-            file << "@=";
-            name = QSL("@");
-            col += 2;
-        } else {
-            file << QSL("\"%1\"=").arg(name);
-            col += name.length() + 3;
-        }
-
-        if (v.type == REG_DWORD)
-        {
-            file << QSL("dword:%1\r\n").arg(v.vDWORD, 8, 16, QChar('0'));
-        }
-        else if (v.type == REG_SZ)
-        {
-            bool hex = false;
-
-            for (int i = 0; i < v.vString.length(); i++) {
-                if (!v.vString.at(i).isPrint()) {
-                    exportBin(v.vString.toUtf8(), v.type, col, file);
-                    hex = true;
-                    break;
-                }
-            }
-
-            if (!hex)
-                file << QSL("\"%1\"\r\n").arg(escapeString(v.vString));
-        }
-        else
-        {
-            exportBin(v.vOther, v.type, col, file);
-        }
-    }
-
-    // export subkeys
-    const QList<int> kl = listKeysOfs(hdesc, key);
-
-    for (const auto &ofs : kl)
-        exportKey(hdesc, getKeyPtr(hdesc, ofs), prefix, file);
-
-    return true;
+    return (exporter.writeHeader()
+            && exporter.writeSubtreeParallel(key, prefix + getKeyFullPath(hdesc, key, true), threads)
+            && exporter.finish());
 }
 
 struct nk_key *CRegController::navigateKey(struct hive *hdesc, const QString &path, bool allowCreate)
@@ -708,6 +844,48 @@ struct nk_key *CRegController::navigateKey(struct hive *hdesc, const QString &pa
     return key;
 }
 
+// Key by path below hive root, with or without hive prefix. Empty path is the root key.
+struct nk_key *CRegController::findKey(struct hive *hdesc, const QString &path)
+{
+    QString p = path;
+    const QString prefix = getHivePrefix(hdesc);
+
+    if (!prefix.isEmpty() && p.startsWith(prefix, Qt::CaseInsensitive)
+            && (p.length() == prefix.length() || p.at(prefix.length()) == QChar('\\'))) {
+        p = p.mid(prefix.length());
+    }
+
+    if (p.split(QChar('\\'), Qt::SkipEmptyParts).isEmpty())
+        return getKeyPtr(hdesc, hdesc->rootofs + 4);
+
+    return navigateKey(hdesc, p);
+}
+
+QString CRegController::getHiveInfo(struct hive *hdesc)
+{
+    // Block statistics are collected lazily, on first allocation or here
+    hive_scan_bins(hdesc);
+
+    return tr("File: %1\n"
+              "Size: %2 bytes, %3 hbins\n\n"
+              "Used: %4 blocks, %5 bytes\n"
+              "Free: %6 blocks, %7 bytes\n\n"
+              "Placed near owner: %8 blocks, %9 outside its hbin\n"
+              "Last save: %10 bytes written\n"
+              "Recovered from transaction log: %11 bytes")
+           .arg(QString::fromUtf8(hdesc->filename))
+           .arg(hdesc->size)
+           .arg(hdesc->pages)
+           .arg(hdesc->useblk)
+           .arg(hdesc->usetot)
+           .arg(hdesc->unuseblk)
+           .arg(hdesc->unusetot)
+           .arg(hdesc->nearalloc)
+           .arg(hdesc->crossbin)
+           .arg(hdesc->lastwrite)
+           .arg(hdesc->recovered);
+}
+
 QString CRegController::getOSInfo(struct hive *hdesc)
 {
     struct nk_key *key = navigateKey(hdesc, "\\Microsoft\\Windows NT\\CurrentVersion");
@@ -1091,194 +1269,208 @@ bool CRegController::writeVValue(hive *hdesc, int rid, const QByteArray &data)
     return setValue(hdesc, ukey, v);
 }
 
-QString unquoteString(const QString &s)
+static QStringView unquoteString(QStringView s)
 {
-    QString a = s;
+    if (!s.startsWith(QChar('"'))) return s;
 
-    if (!s.startsWith('"')) return a;
+    return s.mid(1, s.endsWith(QChar('"')) && s.length() > 1 ? s.length() - 2 : s.length() - 1);
+}
+
+static QString unescapeString(QStringView s)
+{
+    QString a;
+    a.reserve(static_cast<int>(s.length()));
+
+    for (int i = 0; i < s.length(); i++) {
+        if (s.at(i) == QChar('\\') && (i + 1) < s.length()
+                && (s.at(i + 1) == QChar('"') || s.at(i + 1) == QChar('\\'))) {
+            i++;
+        }
+        a.append(s.at(i));
+    }
 
-    a.remove(0, 1);
-    a.remove(a.length() - 1, 1);
     return a;
 }
 
-QString unescapeString(const QString &s)
+// Hex digit values for ASCII, -1 for anything else
+static inline int hexValue(char16_t c)
 {
-    QString a = s;
-    a.replace("\\\"", "\"");
-    a.replace("\\\\", "\\");
-    return a;
+    static const struct HexValues {
+        signed char v[128];
+        HexValues()
+        {
+            for (int i = 0; i < 128; i++)
+                v[i] = -1;
+            for (int i = 0; i < 10; i++)
+                v['0' + i] = static_cast<signed char>(i);
+            for (int i = 0; i < 6; i++) {
+                v['a' + i] = static_cast<signed char>(10 + i);
+                v['A' + i] = static_cast<signed char>(10 + i);
+            }
+        }
+    } table;
+
+    return (c < 128 ? table.v[c] : -1);
+}
+
+/* Appends bytes of "xx,xx,..." text to data. Linear, data is sized once
+ * for the worst case and cut to the decoded length. */
+bool parseHexData(QStringView text, QByteArray &data)
+{
+    const auto start = static_cast<int>(data.size());
+    data.resize(start + static_cast<int>(text.length()) / 2 + 1);
+
+    char *out = data.data() + start;
+    const QChar *p = text.data();
+    const QChar *end = p + text.length();
+
+    while (p < end) {
+        const char16_t c = p->unicode();
+
+        if (c == ',' || c == ' ' || c == '\t') {
+            p++;
+            continue;
+        }
+
+        const int hi = hexValue(c);
+        const int lo = ((end - p) > 1 ? hexValue(p[1].unicode()) : -1);
+
+        if (hi < 0 || lo < 0) {
+            data.resize(start);
+            return false;
+        }
+
+        *out++ = static_cast<char>((hi << 4) | lo);
+        p += 2;
+    }
+
+    data.resize(static_cast<int>(out - data.constData()));
+    return true;
 }
 
-CValue parseValueStr(const QString &s)
+/* Parses name and data of one value line. Data of hex values may continue
+ * on the next lines, their text goes to parseHexData() and then the value
+ * is completed with finishValue(). With isRemoval given, "name"=- is taken
+ * as deletion of the value and only its name is returned. */
+bool parseValueLine(QStringView s, CValue &v, bool *isHex, bool *isRemoval)
 {
     QString name;
-    QString val;
-    CValue v;
+    QStringView val;
+    bool found = false;
+
+    if (isHex != nullptr)
+        *isHex = false;
+    if (isRemoval != nullptr)
+        *isRemoval = false;
 
     // search for '=' outside quotes
     bool q = false;
 
     for (int i = 0; i < s.length(); i++) {
-        if (s.at(i) == QChar('"')) q ^= 1;
-
-        if ((s.at(i) == QChar('=')) && !q) {
-            name = unescapeString(unquoteString(s.left(i)));
-            val = unescapeString(unquoteString(s.mid(i + 1)));
+        if (s.at(i) == QChar('"')) {
+            q = !q;
+        } else if (q && s.at(i) == QChar('\\')) {
+            i++; // escaped char
+        } else if ((s.at(i) == QChar('=')) && !q) {
+            name = unescapeString(unquoteString(s.left(i).trimmed()));
+            val = s.mid(i + 1).trimmed();
+            found = true;
             break;
         }
     }
 
-    if (name.isEmpty()) {
-        qCritical() << "parseValueStr: empty value name parsed";
-        return CValue();
+    if (!found || name.isEmpty()) {
+        qCritical() << "parseValueLine: empty value name parsed";
+        return false;
     }
 
-    if (val.startsWith("dword")) {
+    if (isRemoval != nullptr && val == QLatin1String("-")) {
+        v = CValue();
+        *isRemoval = true;
+    } else if (val.startsWith(QChar('"'))) {
+        v = CValue(REG_SZ);
+        v.vString = unescapeString(unquoteString(val));
+    } else if (val.startsWith(QLatin1String("dword"))) {
         v = CValue(REG_DWORD);
-        val.remove(0, val.indexOf(':') + 1);
         bool ok = false;
-        v.vDWORD = val.toUInt(&ok, 16);
+        v.vDWORD = val.mid(val.indexOf(QChar(':')) + 1).toString().toUInt(&ok, 16);
 
         if (!ok) {
-            qCritical() << "parseValueStr: incorrect hex dword value for " << v.name;
-            return CValue();
+            qCritical() << "parseValueLine: incorrect hex dword value for " << name;
+            return false;
         }
-    } else if (val.startsWith("hex")) {
+    } else if (val.startsWith(QLatin1String("hex"))) {
         int type = REG_BINARY;
-        QString vt = val.mid(3, val.indexOf(':') - 3);
+        const auto colon = static_cast<int>(val.indexOf(QChar(':')));
+        QStringView vt = val.mid(3, colon - 3);
+
+        if (colon < 0) {
+            qCritical() << "parseValueLine: failed to parse value type " << name;
+            return false;
+        }
 
         if (!vt.isEmpty()) {
-            vt.remove(0, 1);
-            vt.remove(vt.length() - 1, 1);
             bool ok = false;
-            type = vt.toInt(&ok, 16);
+            if (vt.startsWith(QChar('(')) && vt.endsWith(QChar(')')))
+                type = vt.mid(1, vt.length() - 2).toString().toInt(&ok, 16);
 
             if (!ok) {
-                qCritical() << "parseValueStr: failed to parse value type " << v.name;
-                return CValue();
+                qCritical() << "parseValueLine: failed to parse value type " << name;
+                return false;
             }
         }
 
         v = CValue(type);
-        val.remove(0, val.indexOf(':') + 1);
-
-        while (!val.isEmpty()) {
-            bool ok = false;
-            v.vOther.append((quint8)val.left(2).toInt(&ok, 16));
-
-            if (!ok) {
-                qCritical() << "parseValueStr: failed to parse hex value " << v.name;
-                return CValue();
-            }
-
-            val.remove(0, 2);
-
-            if (val.startsWith(','))
-                val.remove(0, 1);
 
+        if (!parseHexData(val.mid(colon + 1), v.vOther)) {
+            qCritical() << "parseValueLine: failed to parse hex value " << name;
+            return false;
         }
 
-        if (v.type == REG_EXPAND_SZ ||
-                v.type == REG_MULTI_SZ) {
-            if (v.vOther.endsWith(QByteArray(2, 0))) // remove trailing \0
-                v.vOther.remove(v.vOther.size() - 2, 2);
-
-            v.vString = fromUtf16(v.vOther);
-
-            if (v.type == REG_MULTI_SZ)
-                v.vString.replace(QChar(0), QChar('\n'));
-        }
+        if (isHex != nullptr)
+            *isHex = true;
     } else {
         v = CValue(REG_SZ);
-        v.vString = val;
+        v.vString = val.toString();
     }
 
     v.name = name;
-    return v;
+    return true;
 }
 
-bool CRegController::importReg(struct hive *hdesc, const QString &filename)
+// String types given as hex bytes
+void finishValue(CValue &v)
 {
-    QFile f(filename);
+    if (!v.vString.isEmpty() || v.vOther.isEmpty())
+        return;
 
-    if (!f.open(QIODevice::ReadOnly)) {
-        qCritical() << "importReg: failed to open file" << filename;
-        return false;
-    }
+    if (v.type == REG_SZ || v.type == REG_EXPAND_SZ || v.type == REG_MULTI_SZ) {
+        if (v.vOther.endsWith(QByteArray(2, 0))) // remove trailing \0
+            v.vOther.chop(2);
 
-    QTextStream fs(&f);
-    const QString prefix = getHivePrefix(hdesc);
-    const QString sign = fs.readLine();
+        v.vString = fromUtf16(v.vOther);
 
-    if (!sign.startsWith("Windows Registry Editor Version 5.00")) {
-        qCritical() << "importReg: file signature missing";
-        return false;
+        if (v.type == REG_MULTI_SZ)
+            v.vString.replace(QChar(0), QChar('\n'));
     }
+}
 
-    struct nk_key *key = nullptr;
-
-    QString valacc;
-
-    while (!fs.atEnd()) {
-        QString s = fs.readLine().trimmed();
-
-        if (s.startsWith('[')) { // keyname
-            s.remove(0, 1);
-            s.remove(s.length() - 1, 1);
-
-            if (!s.startsWith(prefix, Qt::CaseInsensitive)) {
-                qCritical() << tr("importReg: could not import key %1 to %2 registry hive").arg(s, prefix);
-                return false;
-            }
-
-            s.remove(prefix, Qt::CaseInsensitive);
-            key = navigateKey(hdesc, s, true);
-
-            if (key == nullptr) {
-                qCritical() << "importReg: failed to navigate key " << s;
-                return false;
-            }
-
-            valacc.clear();
-        } else if (!s.isEmpty()) {
-            if (s.endsWith('\\')) { // string with wrap marker
-                s.remove(s.length() - 1, 1);
-                valacc += s;
-                continue;
-            }
-
-            s = valacc + s; // Now we have complete value string
-
-            CValue v = parseValueStr(s);
-
-            if (v.isEmpty()) {
-                qCritical() << "importReg: failed to parse value " << s;
-                return false;
-            }
-
-            const QList<CValue> vl = listValues(hdesc, key);
-
-            if (!vl.contains(v)) {
-                if (!createValue(hdesc, key, v.type, v.name)) {
-                    qCritical() << "importReg: failed to create value " << v.name;
-                    return false;
-                }
-            }
-
-            if (!setValue(hdesc, key, v)) {
-                qCritical() << "importReg: failed to set value " << v.name;
-                return false;
-            }
-
-            valacc.clear();
-        }
-    }
+bool CRegController::importReg(struct hive *hdesc, const QString &filename)
+{
+    CRegImporter importer(this, hdesc);
+    connect(&importer, &CRegImporter::progress, this, &CRegController::importProgress);
 
-    f.close();
+    m_importer = &importer;
+    const bool res = importer.importFile(filename);
+    m_importer = nullptr;
 
-    return true;
+    return res;
+}
 
+void CRegController::cancelImport()
+{
+    if (m_importer != nullptr)
+        m_importer->cancel();
 }
 
 int CRegController::getHive(const struct nk_key *key) const
@@ -1400,9 +1592,9 @@ CValue::CValue(const QString &aname, int atype)
     , name(aname)
 {}
 
-CValue::CValue(struct vex_data vex, const QString &str, const QByteArray &data)
+CValue::CValue(const QString &aname, struct vex_data vex, const QString &str, const QByteArray &data)
 {
-    name = QString(vex.name);
+    name = aname;
 
     if (name.isEmpty())
         name = QSL("@");
@@ -3,10 +3,13 @@
 
 #include <QObject>
 #include <QStringList>
+#include <QStringView>
 #include <QList>
 #include <QPointer>
 #include <QAbstractItemModel>
-#include <QTextStream>
+#include <QIODevice>
+#include <QHash>
+#include <QMutex>
 
 extern "C" {
 #include <chntpw/ntreg.h>
@@ -15,6 +18,7 @@ extern "C" {
 
 class CRegistryModel;
 class CValuesModel;
+class CRegImporter;
 
 using CStrHash = QHash<QString,QString>;
 
@@ -32,7 +36,7 @@ public:
     CValue(const CValue& other) = default;
     explicit CValue(int atype);
     CValue(const QString& aname, int atype);
-    CValue(struct vex_data vex, const QString &str, const QByteArray &data);
+    CValue(const QString &aname, struct vex_data vex, const QString &str, const QByteArray &data);
     CValue &operator=(const CValue& other) = default;
     bool operator==(const CValue& ref) const;
     bool operator!=(const CValue& ref) const;
@@ -118,6 +122,15 @@ class CRegController : public QObject
 private:
     QList <struct hive *> hives;
 
+    // Child nk offsets, per hive and per parent nk offset. Filled lazily by listKeysOfs,
+    // shared with the finder thread.
+    QHash<struct hive *, QHash<int, QList<int> > > m_subkeys;
+    QHash<struct hive *, QHash<int, int> > m_subkeyRows; // nk offset -> row in parent list
+    QMutex m_subkeysMutex;
+    CRegImporter *m_importer { nullptr };
+
+    void invalidateSubkeys(struct hive *hdesc, int nkofs = -1);
+
 public:
     QPointer<CRegistryModel> treeModel; // TODO: hide this
     QPointer<CValuesModel> valuesModel;
@@ -125,8 +138,13 @@ public:
     explicit CRegController(QObject* parent = nullptr);
 
     bool openTopHive(const QString &filename, int mode);
+    struct hive *openDetachedHive(const QString &filename, int mode);
+    void closeDetachedHive(struct hive *hdesc);
     bool saveTopHive(int idx);
+    bool writeTopHive(int idx);
     void closeTopHive(int idx);
+    bool writeCompactedHive(struct hive *hdesc, const QString &filename);
+    int compactTopHive(int idx, const QString &filename);
 
     int getHivesCount() const { return hives.count(); }
     struct hive* getHivePtr(int idx);
@@ -136,6 +154,7 @@ public:
 
     QStringList listKeys(struct hive *hdesc, nk_key *key);
     QList<int> listKeysOfs(struct hive *hdesc, nk_key *key);
+    int getKeyRow(struct hive *hdesc, struct nk_key *key);
     QList<int> listAllKeysOfsFlat(struct hive *hdesc, nk_key *key);
     struct nk_key * getKeyPtr(struct hive* hdesc, int nkofs);
     int getKeyOfs(struct hive* hdesc, struct nk_key* key);
@@ -144,10 +163,12 @@ public:
     QString getKeyFullPath(struct hive *hdesc, struct nk_key* key, bool skipRoot = false);
     bool createKey(struct hive *hdesc, struct nk_key* parent, const QString& name);
     void deleteKey(struct hive *hdesc, struct nk_key* parent, const QString& name);
-    bool exportKey(struct hive *hdesc, struct nk_key* key, const QString &prefix, QTextStream &file);
+    bool exportKey(struct hive *hdesc, struct nk_key* key, const QString &prefix, QIODevice *device,
+                   int threads = 1);
     bool importReg(struct hive *hdesc, const QString& filename);
 
     QVariant getValue(struct hive *hdesc, struct vex_data vex, bool forceHex, int exact = TPF_VK);
+    const char *getValueRawData(struct hive *hdesc, const struct vex_data &vex, QByteArray &buf, int &len);
     CValue getValue(struct hive *hdesc, struct nk_key *key, const QString& name, int checkType = REG_NONE);
     QList<CValue> listValues(struct hive *hdesc, struct nk_key *key, int exact = TPF_VK);
     struct keyval *getKeyValue(struct hive *hdesc, struct keyval *kv, const struct vex_data &vex,
@@ -161,6 +182,9 @@ public:
     QString getHivePrefix(struct hive *hdesc);
     int findKeyOfs(struct hive *hdesc, struct nk_key *key, const QString &name);
     struct nk_key *navigateKey(struct hive *hdesc, const QString &path, bool allowCreate=false);
+    struct nk_key *findKey(struct hive *hdesc, const QString &path);
+
+    QString getHiveInfo(struct hive *hdesc);
 
     // For SOFTWARE hive
     QString getOSInfo(struct hive *hdesc);
@@ -172,7 +196,11 @@ public:
     bool writeFValue(struct hive *hdesc, int rid, const QByteArray &f);
     QByteArray readVValue(struct hive *hdesc, int rid);
     bool writeVValue(struct hive *hdesc, int rid, const QByteArray &data);
+public Q_SLOTS:
+    void cancelImport();
+
 Q_SIGNALS:
+    void importProgress(qint64 done, qint64 total);
     void hiveOpened(int idx);
     void hiveClosed(int old_idx);
     void hiveSaved(int idx);
@@ -181,5 +209,8 @@ Q_SIGNALS:
 
 QByteArray toUtf16(const QString &str);
 QString fromUtf16(const QByteArray &str);
+bool parseValueLine(QStringView s, CValue &v, bool *isHex = nullptr, bool *isRemoval = nullptr);
+bool parseHexData(QStringView text, QByteArray &data);
+void finishValue(CValue &v);
 
 #endif // REGUTILS_H
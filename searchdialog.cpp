@@ -0,0 +1,120 @@
+#include <QMessageBox>
+#include "global.h"
+#include "searchdialog.h"
+#include "ui_searchdialog.h"
+
+CSearchDialog::CSearchDialog(QWidget *parent, const QString &title) :
+    QDialog(parent),
+    ui(new Ui::CSearchDialog)
+{
+    ui->setupUi(this);
+    setWindowTitle(title);
+
+    ui->comboType->addItem(tr("Any type"), -1);
+    for (int i = REG_NONE; i < REG_MAX; i++)
+        ui->comboType->addItem(cgl->reg->getValueTypeStr(i), i);
+
+    const QDateTime now = QDateTime::currentDateTime();
+    ui->dateModifiedAfter->setDateTime(now.addDays(-1));
+    ui->dateModifiedBefore->setDateTime(now);
+
+    connect(ui->groupFilters, &QGroupBox::toggled, this, &CSearchDialog::updateFilters);
+    connect(ui->checkDwordRange, &QCheckBox::toggled, this, &CSearchDialog::updateFilters);
+    connect(ui->checkModifiedAfter, &QCheckBox::toggled, this, &CSearchDialog::updateFilters);
+    connect(ui->checkModifiedBefore, &QCheckBox::toggled, this, &CSearchDialog::updateFilters);
+
+    updateFilters();
+}
+
+CSearchDialog::~CSearchDialog()
+{
+    delete ui;
+}
+
+void CSearchDialog::updateFilters()
+{
+    ui->editDwordMin->setEnabled(ui->checkDwordRange->isChecked());
+    ui->editDwordMax->setEnabled(ui->checkDwordRange->isChecked());
+    ui->dateModifiedAfter->setEnabled(ui->checkModifiedAfter->isChecked());
+    ui->dateModifiedBefore->setEnabled(ui->checkModifiedBefore->isChecked());
+}
+
+void CSearchDialog::setQuery(const CFinderQuery &query)
+{
+    ui->editText->setText(query.text);
+    ui->checkRegExp->setChecked(query.useRegExp);
+
+    const bool filters = (query.hasValueFilter() || query.modifiedAfter.isValid()
+                          || query.modifiedBefore.isValid() || !query.keyPath.isEmpty());
+    ui->groupFilters->setChecked(filters);
+
+    const int typeIdx = ui->comboType->findData(query.valueType);
+    ui->comboType->setCurrentIndex(typeIdx < 0 ? 0 : typeIdx);
+
+    ui->checkDwordRange->setChecked(query.useDwordRange);
+    if (query.useDwordRange) {
+        ui->editDwordMin->setText(QString::number(query.dwordMin));
+        ui->editDwordMax->setText(QString::number(query.dwordMax));
+    }
+
+    ui->checkModifiedAfter->setChecked(query.modifiedAfter.isValid());
+    if (query.modifiedAfter.isValid())
+        ui->dateModifiedAfter->setDateTime(query.modifiedAfter);
+
+    ui->checkModifiedBefore->setChecked(query.modifiedBefore.isValid());
+    if (query.modifiedBefore.isValid())
+        ui->dateModifiedBefore->setDateTime(query.modifiedBefore);
+
+    ui->editKeyPath->setText(query.keyPath);
+
+    updateFilters();
+}
+
+CFinderQuery CSearchDialog::getQuery() const
+{
+    CFinderQuery query;
+    query.text = ui->editText->text();
+    query.useRegExp = ui->checkRegExp->isChecked();
+
+    if (!ui->groupFilters->isChecked())
+        return query;
+
+    query.valueType = ui->comboType->currentData().toInt();
+
+    if (ui->checkDwordRange->isChecked()) {
+        bool okMin = true;
+        bool okMax = true;
+        query.useDwordRange = true;
+        // Base 0 accepts both decimal and 0x-prefixed hex numbers
+        if (!ui->editDwordMin->text().isEmpty())
+            query.dwordMin = ui->editDwordMin->text().toUInt(&okMin, 0);
+        if (!ui->editDwordMax->text().isEmpty())
+            query.dwordMax = ui->editDwordMax->text().toUInt(&okMax, 0);
+        if (!okMin || !okMax) {
+            query.dwordMin = 1;
+            query.dwordMax = 0; // invalid range, rejected by prepare()
+        }
+    }
+
+    if (ui->checkModifiedAfter->isChecked())
+        query.modifiedAfter = ui->dateModifiedAfter->dateTime();
+    if (ui->checkModifiedBefore->isChecked())
+        query.modifiedBefore = ui->dateModifiedBefore->dateTime();
+
+    query.keyPath = ui->editKeyPath->text();
+
+    return query;
+}
+
+void CSearchDialog::accept()
+{
+    CFinderQuery query = getQuery();
+    QString error;
+
+    if (!query.prepare(&error)) {
+        QMessageBox::warning(this, windowTitle(), error);
+        return;
+    }
+
+    QDialog::accept();
+}
@@ -0,0 +1,32 @@
+#ifndef SEARCHDIALOG_H
+#define SEARCHDIALOG_H
+
+#include <QDialog>
+#include "finder.h"
+
+namespace Ui {
+class CSearchDialog;
+}
+
+class CSearchDialog : public QDialog
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CSearchDialog)
+
+public:
+    CSearchDialog(QWidget *parent, const QString &title);
+    ~CSearchDialog() override;
+
+    void setQuery(const CFinderQuery &query);
+    CFinderQuery getQuery() const;
+
+public Q_SLOTS:
+    void accept() override;
+
+private:
+    Ui::CSearchDialog *ui;
+
+    void updateFilters();
+};
+
+#endif // SEARCHDIALOG_H
@@ -0,0 +1,197 @@
+#include <cstring>
+#include <QtEndian>
+#include <QtAlgorithms>
+#include "textmatcher.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEXTMATCHER_SSE2
+#endif
+
+static inline quint32 unitAt(const char *data, int idx)
+{
+    return qFromLittleEndian<quint16>(data + idx * 2);
+}
+
+CTextMatcher::CTextMatcher(const QString &text)
+    : m_text(text)
+    , m_bytes(text.toUtf8())
+{
+    m_folded.reserve(text.length());
+    for (const QChar &c : text)
+        m_folded.append(fold(c.unicode()));
+
+    if (!m_folded.isEmpty()) {
+        const quint32 a = m_folded.first();
+        m_anchorLower = static_cast<quint16>(a);
+        m_anchorUpper = static_cast<quint16>((a >= 'a' && a <= 'z') ? a - 0x20 : a);
+    }
+}
+
+/* Candidate positions are units equal to the first search char in either case,
+ * and any non-ASCII unit, since some of them fold to ASCII letters too.
+ */
+bool CTextMatcher::containsUtf16(const char *data, int units) const
+{
+    const int m = m_folded.count();
+
+    if (m == 0) return true;
+    if (units < m) return false;
+
+    const quint32 *needle = m_folded.constData();
+    const int last = units - m;
+    int i = 0;
+
+    const auto matchAt = [data, needle, m](int pos) {
+        for (int j = 0; j < m; j++) {
+            if (fold(unitAt(data, pos + j)) != needle[j])
+                return false;
+        }
+        return true;
+    };
+
+#ifdef TEXTMATCHER_SSE2
+    const __m128i lower = _mm_set1_epi16(static_cast<short>(m_anchorLower));
+    const __m128i upper = _mm_set1_epi16(static_cast<short>(m_anchorUpper));
+    const __m128i highBits = _mm_set1_epi16(static_cast<short>(0xff80));
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 8 <= last + 1; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 2));
+        const __m128i anchor = _mm_or_si128(_mm_cmpeq_epi16(v, lower), _mm_cmpeq_epi16(v, upper));
+        const __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, highBits), zero);
+        auto mask = static_cast<quint32>(_mm_movemask_epi8(anchor) | ~_mm_movemask_epi8(ascii)) & 0xffff;
+
+        while (mask != 0) {
+            const int bit = static_cast<int>(qCountTrailingZeroBits(mask));
+            if (matchAt(i + bit / 2))
+                return true;
+            mask &= ~(3U << bit); // two mask bits per unit
+        }
+    }
+#endif
+
+    for (; i <= last; i++) {
+        const quint32 u = unitAt(data, i);
+        if ((u == m_anchorLower || u == m_anchorUpper || u >= 0x80) && matchAt(i))
+            return true;
+    }
+
+    return false;
+}
+
+bool CTextMatcher::containsLatin1(const char *data, int len) const
+{
+    const int m = m_folded.count();
+
+    if (m == 0) return true;
+    if (len < m) return false;
+
+    const quint32 *needle = m_folded.constData();
+    const auto *text = reinterpret_cast<const uchar *>(data);
+    const int last = len - m;
+    int i = 0;
+
+    const auto matchAt = [text, needle, m](int pos) {
+        for (int j = 0; j < m; j++) {
+            if (fold(text[pos + j]) != needle[j])
+                return false;
+        }
+        return true;
+    };
+
+#ifdef TEXTMATCHER_SSE2
+    // Non-ASCII anchor is caught by high bit check
+    const char lowerCh = static_cast<char>(m_anchorLower < 0x80 ? m_anchorLower : 0x80);
+    const char upperCh = static_cast<char>(m_anchorUpper < 0x80 ? m_anchorUpper : 0x80);
+    const __m128i lower = _mm_set1_epi8(lowerCh);
+    const __m128i upper = _mm_set1_epi8(upperCh);
+
+    for (; i + 16 <= last + 1; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+        const __m128i anchor = _mm_or_si128(_mm_cmpeq_epi8(v, lower), _mm_cmpeq_epi8(v, upper));
+        auto mask = static_cast<quint32>(_mm_movemask_epi8(anchor) | _mm_movemask_epi8(v));
+
+        while (mask != 0) {
+            if (matchAt(i + static_cast<int>(qCountTrailingZeroBits(mask))))
+                return true;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i <= last; i++) {
+        const quint32 u = text[i];
+        if ((u == m_anchorLower || u == m_anchorUpper || u >= 0x80) && matchAt(i))
+            return true;
+    }
+
+    return false;
+}
+
+bool CTextMatcher::containsBytes(const char *data, int len) const
+{
+    const auto m = static_cast<int>(m_bytes.size());
+
+    if (m == 0) return true;
+    if (len < m) return false;
+
+    const char *needle = m_bytes.constData();
+    const int last = len - m;
+    int i = 0;
+
+#ifdef TEXTMATCHER_SSE2
+    // Filter on first two bytes
+    const int second = (m > 1 ? 1 : 0);
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i next = _mm_set1_epi8(needle[second]);
+
+    for (; i + 16 <= last + 1; i += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + second));
+        auto mask = static_cast<quint32>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                                          _mm_cmpeq_epi8(b, next))));
+
+        while (mask != 0) {
+            if (memcmp(data + i + qCountTrailingZeroBits(mask), needle, m) == 0)
+                return true;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while (i <= last) {
+        const auto *p = static_cast<const char *>(memchr(data + i, needle[0], last - i + 1));
+        if (p == nullptr)
+            return false;
+        if (memcmp(p, needle, m) == 0)
+            return true;
+        i = static_cast<int>(p - data) + 1;
+    }
+
+    return false;
+}
+
+// Length of UTF-16LE string up to the first NUL
+int CTextMatcher::utf16Length(const char *data, int units)
+{
+    int i = 0;
+
+#ifdef TEXTMATCHER_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 8 <= units; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 2));
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+        if (mask != 0)
+            return i + static_cast<int>(qCountTrailingZeroBits(static_cast<quint32>(mask))) / 2;
+    }
+#endif
+
+    for (; i < units; i++) {
+        if (unitAt(data, i) == 0)
+            return i;
+    }
+
+    return units;
+}
@@ -0,0 +1,51 @@
+#ifndef TEXTMATCHER_H
+#define TEXTMATCHER_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include "hiveiterators.h"
+
+/* Substring matcher for raw hive data. Case-insensitive search runs directly
+ * over UTF-16LE and Latin-1 strings in hive buffer, with the same case folding
+ * as QString::contains(..., Qt::CaseInsensitive). Exact search runs over raw
+ * bytes. Uses SSE2 to find candidate positions where available.
+ */
+class CTextMatcher
+{
+private:
+    QString m_text;
+    QVector<quint32> m_folded;  // case folded UTF-16 units of m_text
+    QByteArray m_bytes;         // UTF-8 of m_text
+    quint16 m_anchorLower { 0 };
+    quint16 m_anchorUpper { 0 };
+
+public:
+    CTextMatcher() = default;
+    explicit CTextMatcher(const QString &text);
+
+    bool isEmpty() const { return m_text.isEmpty(); }
+
+    bool containsUtf16(const char *data, int units) const;
+    bool containsLatin1(const char *data, int len) const;
+    bool containsBytes(const char *data, int len) const;
+
+    bool contains(const QString &str) const { return str.contains(m_text, Qt::CaseInsensitive); }
+    bool contains(const CHiveName &name) const
+    {
+        return (name.isAnsi() ? containsLatin1(name.raw(), name.rawLength())
+                              : containsUtf16(name.raw(), name.rawLength() / 2));
+    }
+
+    static int utf16Length(const char *data, int units);
+
+    // Same folding as QString::contains() does for BMP characters
+    static quint32 fold(quint32 c)
+    {
+        if (c < 0x80)
+            return ((c >= 'A' && c <= 'Z') ? c + 0x20 : c);
+        return QChar::toCaseFolded(c);
+    }
+};
+
+#endif // TEXTMATCHER_H